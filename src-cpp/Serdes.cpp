@@ -116,6 +116,48 @@ Handle *Handle::create (const Conf *conf, std::string &errstr) {
 }
 
 
+static void cache_log_cb_trampoline (serdes_t *sd, int level,
+                                     const char *fac,
+                                     const char *buf, void *opaque) {
+  LogCb *log_cb = static_cast<LogCb*>(opaque);
+  log_cb->log_cb(NULL, level, fac, buf);
+}
+
+Cache *Cache::create (const Conf *conf, std::string &errstr) {
+  const ConfImpl *confimpl = conf ? dynamic_cast<const ConfImpl*>(conf) : NULL;
+  serdes_conf_t *sconf;
+  char c_errstr[256];
+
+  if (confimpl) {
+    sconf = serdes_conf_copy(confimpl->conf_);
+
+    /* The cache may outlive the Cache object: pass the
+     * application's LogCb directly. */
+    if (confimpl->log_cb_) {
+      serdes_conf_set_opaque(sconf, (void *)confimpl->log_cb_);
+      serdes_conf_set_log_cb(sconf, cache_log_cb_trampoline);
+    }
+
+  } else {
+    sconf = serdes_conf_new(NULL, 0, NULL);
+  }
+
+  serdes_conf_set_schema_load_cb(sconf,
+                                 schema_load_cb_trampoline,
+                                 schema_unload_cb_trampoline);
+
+  CacheImpl *cache = new CacheImpl();
+  cache->cache_ = serdes_cache_new(sconf, c_errstr, sizeof(c_errstr));
+  if (!cache->cache_) {
+    errstr = c_errstr;
+    delete cache;
+    return NULL;
+  }
+
+  return cache;
+}
+
+
 Conf *Conf::create () {
   ConfImpl *conf = new ConfImpl();
   conf->conf_ = serdes_conf_new(NULL, 0, NULL);
@@ -158,6 +200,33 @@ Schema *Schema::get (Handle *handle, const std::string &name,
 }
 
 
+static Schema *schema_acquire (Handle *handle, const char *name, int id,
+                               std::string &errstr) {
+  HandleImpl *hnd = dynamic_cast<HandleImpl*>(handle);
+  char c_errstr[512];
+
+  serdes_schema_t *c_schema = serdes_schema_acquire(hnd->sd_, name, id,
+                                                    c_errstr, sizeof(c_errstr));
+  if (!c_schema) {
+    errstr = c_errstr;
+    return NULL;
+  }
+
+  return new SchemaImpl(c_schema, true);
+}
+
+
+Schema *Schema::acquire (Handle *handle, int id, std::string &errstr) {
+  return schema_acquire(handle, NULL, id, errstr);
+}
+
+
+Schema *Schema::acquire (Handle *handle, const std::string &name,
+                         std::string &errstr) {
+  return schema_acquire(handle, name.c_str(), -1, errstr);
+}
+
+
 
 static Schema *schema_add (Handle *handle, const char* name, int id,
                            const void *definition, int definition_len,
@@ -239,8 +308,9 @@ ssize_t AvroImpl::serialize (Schema *schema, const avro::GenericDatum *datum,
   /* Extract written bytes. */
   auto encoded = avro::snapshot(*bin_os.get());
 
-  /* Write framing */
-  schema->framing_write(out);
+  /* Write framing: this handle's, which differs from the schema's
+   * handle's for schemas of a shared cache. */
+  schema->framing_write(this, out);
 
   /* Write binary encoded Avro to output vector */
   out.insert(out.end(), encoded->cbegin(), encoded->cend());
@@ -252,12 +322,14 @@ ssize_t AvroImpl::serialize (Schema *schema, const avro::GenericDatum *datum,
 ssize_t AvroImpl::deserialize (Schema **schemap, avro::GenericDatum **datump,
                                const void *payload, size_t size,
                                std::string &errstr) {
-  serdes_schema_t *ss;
+  serdes_schema_t *ss = NULL;
 
-  /* Read framing */
+  /* Read framing.
+   * The schema reference keeps the framed schema from being freed by
+   * a concurrent purge while decoding. */
   char c_errstr[256];
-  ssize_t r = serdes_framing_read(sd_, &payload, &size, &ss,
-                                  c_errstr, sizeof(c_errstr));
+  ssize_t r = serdes_framing_read_acquire(sd_, &payload, &size, &ss,
+                                          c_errstr, sizeof(c_errstr));
   if (r == -1) {
     errstr = c_errstr;
     return -1;
@@ -267,15 +339,19 @@ ssize_t AvroImpl::deserialize (Schema **schemap, avro::GenericDatum **datump,
   }
 
   Schema *schema = *schemap;
+  avro::ValidSchema *avro_schema;
   if (!schema) {
     schema = Serdes::Schema::get(dynamic_cast<HandleImpl*>(this),
                                  serdes_schema_id(ss), errstr);
-    if (!schema)
+    if (!schema) {
+      serdes_schema_release(ss);
       return -1;
+    }
+    avro_schema = static_cast<avro::ValidSchema*>(serdes_schema_object(ss));
+  } else {
+    avro_schema = schema->object();
   }
 
-  avro::ValidSchema *avro_schema = schema->object();
-
   /* Binary input stream */
   auto bin_is = avro::memoryInputStream((const uint8_t *)payload, size);
 
@@ -293,9 +369,14 @@ ssize_t AvroImpl::deserialize (Schema **schemap, avro::GenericDatum **datump,
   } catch (const avro::Exception &e) {
     errstr = std::string("Avro deserialization failed: ") + e.what();
     delete datum;
+    if (ss)
+      serdes_schema_release(ss);
     return -1;
   }
 
+  if (ss)
+    serdes_schema_release(ss);
+
   *schemap = schema;
   *datump = datum;
   return 0;
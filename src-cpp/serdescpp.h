@@ -16,6 +16,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include <avro/ValidSchema.hh>
 
@@ -53,6 +54,7 @@ std::string err2str (Serdes::ErrorCode err);
 
 /* Forward declarations */
 class Handle;
+class Cache;
 
 /**
  * Set optional log callback to use for serdes originated log messages.
@@ -94,11 +96,46 @@ public:
    * Set an optional log callback class for logs originating from libserdes.
    */
   virtual void set (LogCb *log_cb) = 0;
+
+  /**
+   * Attach handles created with this configuration to the shared schema
+   * cache `cache` (see Cache::create()), or to a private schema cache
+   * if `cache` is NULL (the default).
+   */
+  virtual void set (Cache *cache) = 0;
 };
 
 
 
 
+/**
+ * Schema cache that can be shared by multiple handles (see Conf::set(Cache*)),
+ * e.g., handles with different framing, so that each schema is only
+ * fetched, parsed and kept once.
+ * Schemas are then looked up in, fetched into and owned by the shared cache:
+ * the schema registry and schema cache configuration of the handles are
+ * ignored in favour of the cache's, while framing remains the handles'.
+ */
+class SERDES_EXPORT Cache {
+public:
+  virtual ~Cache () {};
+
+  /**
+   * Create a new shared schema cache.
+   * `conf` is an optional configuration object providing the schema
+   * registry and schema cache configuration.
+   * Log messages from the cache are passed to the configured LogCb
+   * with a NULL Handle.
+   *
+   * The Cache object may be deleted before the handles attached to it,
+   * its schemas are freed when the last attached handle is deleted.
+   *
+   * Returns a new Cache object, or NULL on error (see errstr for reason).
+   */
+  static Cache *create (const Conf *conf, std::string &errstr);
+};
+
+
 /**
  * Main Serdes handle.
  */
@@ -123,6 +160,19 @@ public:
    */
   virtual int schemas_purge (int max_age) = 0;
 
+  /**
+   * Load the schemas with the given `ids` and the latest schemas of
+   * the given `subjects` into the local schema cache, concurrently.
+   *
+   * Returns when all schemas are loaded (or failed to load) or
+   * `timeout_ms` has elapsed (-1 for no timeout).
+   *
+   * Returns the number of schemas loaded.
+   */
+  virtual int prefetch (const std::vector<int> &ids,
+                        const std::vector<std::string> &subjects,
+                        int timeout_ms) = 0;
+
   /**
    * Returns the serializer/deserializer framing size,
    * or 0 if no framing is configured.
@@ -154,6 +204,17 @@ public:
   static Schema *get (Handle *handle, const std::string &name,
                       std::string &errstr);
 
+  /**
+   * Same as get() but the returned object holds a reference to the
+   * schema which keeps it usable even if it is purged from the
+   * local cache (see Handle::schemas_purge()).
+   * The reference is released when the returned object is deleted,
+   * which must be done before the Handle is deleted.
+   */
+  static Schema *acquire (Handle *handle, int id, std::string &errstr);
+  static Schema *acquire (Handle *handle, const std::string &name,
+                          std::string &errstr);
+
   /**
    * Add schema definition to the local cache and stores the schema to remote
    * schema registry.
@@ -201,10 +262,33 @@ public:
    */
   virtual avro::ValidSchema *object () = 0;
 
+  /**
+   * Pin the schema in the local cache, exempting it from purging and
+   * eviction until unpinned, see serdes_schema_pin().
+   */
+  virtual void pin () = 0;
+
+  /**
+   * Remove a pin added with pin().
+   */
+  virtual void unpin () = 0;
+
+
+  /**
+   * Writes the serializer framing configured for `handle` to vector.
+   * Returns the number of bytes written.
+   */
+  virtual ssize_t framing_write (Handle *handle,
+                                 std::vector<char> &out) const = 0;
 
   /**
    * Writes framing to vector.
    * Returns the number of bytes written.
+   *
+   * Deprecated: this writes the framing of the handle that owns the
+   * schema, which for a schema of a shared cache (Cache) is the cache's
+   * rather than the handle it was looked up with.
+   * Use framing_write(handle, out) instead.
    */
   virtual ssize_t framing_write (std::vector<char> &out) const = 0;
 };
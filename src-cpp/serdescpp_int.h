@@ -35,6 +35,19 @@ namespace Serdes {
 
 
 
+  class CacheImpl : public Cache {
+ public:
+    ~CacheImpl () {
+      if (cache_)
+        serdes_cache_destroy(cache_);
+    }
+
+    CacheImpl (): cache_(NULL) {}
+
+    serdes_cache_t *cache_;
+  };
+
+
   class ConfImpl : public Conf {
  public:
     ~ConfImpl () {
@@ -64,6 +77,12 @@ namespace Serdes {
       log_cb_ = log_cb;
     }
 
+    void set (Cache *cache) {
+      serdes_conf_set_cache(conf_,
+                            cache ?
+                            dynamic_cast<CacheImpl*>(cache)->cache_ : NULL);
+    }
+
     serdes_conf_t *conf_;
     LogCb *log_cb_;
 
@@ -85,6 +104,20 @@ namespace Serdes {
       return serdes_schemas_purge(sd_, max_age);
     }
 
+    int prefetch (const std::vector<int> &ids,
+                  const std::vector<std::string> &subjects,
+                  int timeout_ms) {
+      std::vector<const char *> c_subjects;
+      for (size_t i = 0 ; i < subjects.size() ; i++)
+        c_subjects.push_back(subjects[i].c_str());
+
+      return serdes_schemas_prefetch(sd_,
+                                     ids.empty() ? NULL : &ids[0],
+                                     (int)ids.size(),
+                                     c_subjects.empty() ? NULL : &c_subjects[0],
+                                     (int)c_subjects.size(), timeout_ms);
+    }
+
     ssize_t serializer_framing_size () const {
       return serdes_serializer_framing_size(sd_);
     }
@@ -103,14 +136,20 @@ namespace Serdes {
   class SchemaImpl : public Schema {
  public:
     ~SchemaImpl () {
-      if (schema_) {
+      if (!schema_)
+        return;
+
+      if (refd_) {
+        serdes_schema_release(schema_);
+      } else {
         serdes_schema_set_opaque(schema_, NULL);
         serdes_schema_destroy(schema_);
       }
     }
 
-    SchemaImpl (): schema_(NULL) {}
-    SchemaImpl (serdes_schema_t *ss): schema_(ss) {}
+    SchemaImpl (): schema_(NULL), refd_(false) {}
+    SchemaImpl (serdes_schema_t *ss, bool refd = false):
+        schema_(ss), refd_(refd) {}
 
     static Schema *get (Handle *handle, int id, std::string &errstr);
     static Schema *get (Handle *handle, std::string &name, std::string &errstr);
@@ -141,6 +180,30 @@ namespace Serdes {
       return static_cast<avro::ValidSchema*>(serdes_schema_object(schema_));
     }
 
+    void pin () {
+      serdes_schema_pin(schema_);
+    }
+
+    void unpin () {
+      serdes_schema_unpin(schema_);
+    }
+
+
+    ssize_t framing_write (Handle *handle, std::vector<char> &out) const {
+      serdes_t *sd = dynamic_cast<HandleImpl*>(handle)->sd_;
+      ssize_t framing_size = serdes_serializer_framing_size(sd);
+      if (framing_size == 0)
+        return 0;
+
+      /* Make room for framing */
+      int pos = out.size();
+      out.resize(out.size() + framing_size);
+
+      /* Write framing: the handle's, which differs from the schema's
+       * handle's for schemas of a shared cache. */
+      return serdes_serializer_framing_write(sd, schema_, &out[pos],
+                                             framing_size);
+    }
 
     ssize_t framing_write (std::vector<char> &out) const {
       ssize_t framing_size = serdes_serializer_framing_size(serdes_schema_handle(schema_));
@@ -156,6 +219,7 @@ namespace Serdes {
     }
 
     serdes_schema_t *schema_;
+    bool refd_;  /* schema_ reference acquired with serdes_schema_acquire() */
   };
 
 
@@ -183,6 +247,12 @@ namespace Serdes {
       return HandleImpl::schemas_purge(max_age);
     }
 
+    int prefetch (const std::vector<int> &ids,
+                  const std::vector<std::string> &subjects,
+                  int timeout_ms) {
+      return HandleImpl::prefetch(ids, subjects, timeout_ms);
+    }
+
   };
 
 }
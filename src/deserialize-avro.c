@@ -62,12 +62,16 @@ serdes_err_t serdes_deserialize_avro (serdes_t *sd, avro_value_t *avro,
                                       const void *payload, size_t size,
                                       char *errstr, int errstr_size) {
         serdes_schema_t *ss;
+        serdes_err_t err;
         ssize_t r;
 
         /* "Schema-less" (we look up the schema for the application)
          * deserialization requires message framing so we can figure
-         * out the schema id. */
-        r = serdes_framing_read(sd, &payload, &size, &ss, errstr, errstr_size);
+         * out the schema id.
+         * The schema reference keeps it from being freed by a concurrent
+         * purge while deserializing. */
+        r = serdes_framing_read_acquire(sd, &payload, &size, &ss,
+                                        errstr, errstr_size);
         if (r == -1)
                 return SERDES_ERR_PAYLOAD_INVALID;
         else if (r == 0) {
@@ -80,6 +84,10 @@ serdes_err_t serdes_deserialize_avro (serdes_t *sd, avro_value_t *avro,
                 *schemap = ss;
 
         /* Deserialize payload to Avro object */
-        return serdes_schema_deserialize_avro(ss, avro, payload, size,
-                                              errstr, errstr_size);
+        err = serdes_schema_deserialize_avro(ss, avro, payload, size,
+                                             errstr, errstr_size);
+
+        serdes_schema_release(ss);
+
+        return err;
 }
@@ -0,0 +1,155 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ebr.h"
+
+
+/* This thread's reader counter slot, shared by all ebr_t instances. */
+_Thread_local int ebr_thread_slot = -1;
+
+static int ebr_next_slot = 0;
+
+
+int ebr_thread_slot_assign (void) {
+        ebr_thread_slot = __atomic_fetch_add(&ebr_next_slot, 1,
+                                             __ATOMIC_RELAXED) % EBR_SLOTS;
+        return ebr_thread_slot;
+}
+
+
+void ebr_init (ebr_t *ebr) {
+        memset(ebr, 0, sizeof(*ebr));
+        if (posix_memalign((void **)&ebr->slots, 64,
+                           EBR_SLOTS * sizeof(*ebr->slots)))
+                abort();
+        memset(ebr->slots, 0, EBR_SLOTS * sizeof(*ebr->slots));
+        mtx_init(&ebr->lock, mtx_plain);
+}
+
+
+/**
+ * Free a (detached) list of retired objects.
+ */
+static int ebr_free_list (ebr_limbo_t *el) {
+        int cnt = 0;
+
+        while (el) {
+                ebr_limbo_t *next = el->next;
+                el->free_cb(el->ptr, el->opaque);
+                free(el);
+                el = next;
+                cnt++;
+        }
+
+        return cnt;
+}
+
+
+void ebr_destroy (ebr_t *ebr) {
+        ebr_free_list(ebr->limbo);
+        ebr->limbo = NULL;
+        free(ebr->slots);
+        mtx_destroy(&ebr->lock);
+}
+
+
+void ebr_retire (ebr_t *ebr, void *ptr,
+                 void (*free_cb) (void *ptr, void *opaque), void *opaque) {
+        ebr_limbo_t *el = malloc(sizeof(*el));
+
+        el->ptr     = ptr;
+        el->free_cb = free_cb;
+        el->opaque  = opaque;
+
+        mtx_lock(&ebr->lock);
+        el->phase   = ebr->phase;
+        el->next    = ebr->limbo;
+        ebr->limbo  = el;
+        ebr->limbo_cnt++;
+        mtx_unlock(&ebr->lock);
+}
+
+
+/**
+ * Try to complete a phase: if no reader remains on the side of the
+ * next epoch, flip the epoch.
+ *
+ * Returns 1 if the phase completed, else 0.
+ *
+ * Locks: ebr->lock MUST be held.
+ */
+static int ebr_advance0 (ebr_t *ebr) {
+        int64_t epoch = __atomic_load_n(&ebr->epoch, __ATOMIC_SEQ_CST);
+        int next_side = (int)((epoch + 1) & 1);
+        int i;
+
+        /* Order the writer's prior unlinking of retired objects
+         * before the reader counter scan. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        for (i = 0 ; i < EBR_SLOTS ; i++)
+                if (__atomic_load_n(&ebr->slots[i].cnt[next_side],
+                                    __ATOMIC_SEQ_CST) > 0)
+                        return 0;
+
+        __atomic_store_n(&ebr->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+        ebr->phase++;
+
+        return 1;
+}
+
+
+int ebr_reclaim (ebr_t *ebr) {
+        ebr_limbo_t *el, **elp, *reclaim = NULL;
+        int cnt;
+
+        mtx_lock(&ebr->lock);
+        if (!ebr->limbo) {
+                mtx_unlock(&ebr->lock);
+                return 0;
+        }
+
+        /* Objects retired in phase N are safe once phase N+2 completed,
+         * two phases is thus all that is needed to free the entire limbo
+         * list as of now. */
+        if (ebr_advance0(ebr))
+                ebr_advance0(ebr);
+
+        /* The list is ordered newest first: find the first object that
+         * is safe to free and detach it and all older objects. */
+        for (elp = &ebr->limbo ; (el = *elp) ; elp = &el->next) {
+                if (el->phase + 2 <= ebr->phase) {
+                        reclaim = el;
+                        *elp = NULL;
+                        break;
+                }
+        }
+        mtx_unlock(&ebr->lock);
+
+        if (!reclaim)
+                return 0;
+
+        /* Free outside the lock since free callbacks may be slow. */
+        cnt = ebr_free_list(reclaim);
+
+        mtx_lock(&ebr->lock);
+        ebr->limbo_cnt -= cnt;
+        mtx_unlock(&ebr->lock);
+
+        return cnt;
+}
@@ -0,0 +1,121 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "tinycthread.h"
+
+
+/**
+ * Epoch-based reclamation (EBR) of memory shared with lock-free readers.
+ *
+ * Readers bracket their accesses with ebr_enter() and ebr_leave(),
+ * which only touch a per-thread reader counter (no locks).
+ * Writers unlink an object from the shared data structure and pass it
+ * to ebr_retire(), the object is freed by a later ebr_reclaim() once
+ * all readers that could have observed it have left.
+ *
+ * Reader counters are split in two sides selected by the epoch's parity.
+ * Reclamation advances the epoch one phase at a time: a phase may only
+ * complete (flipping the epoch) when no reader remains on the side new
+ * readers are about to enter. An object retired during phase N is
+ * unreachable to all readers once phase N+2 has completed.
+ */
+
+#define EBR_SLOTS  64   /* Number of reader counter slots, threads are
+                         * assigned a slot round-robin. */
+
+typedef struct ebr_limbo_s {
+        struct ebr_limbo_s *next;
+        void              *ptr;
+        void             (*free_cb) (void *ptr, void *opaque);
+        void              *opaque;
+        int64_t            phase;   /* ebr_t.phase at retire time */
+} ebr_limbo_t;
+
+/* Reader counters, one cache line per slot. */
+struct ebr_slot {
+        int64_t  cnt[2];            /* Active readers per epoch parity */
+        char     pad[64 - (2 * sizeof(int64_t))];
+};
+
+typedef struct ebr_s {
+        struct ebr_slot *slots;     /* EBR_SLOTS cache line aligned slots */
+
+        int64_t      epoch;         /* Current epoch (atomic) */
+
+        mtx_t        lock;          /* Protects below fields */
+        int64_t      phase;         /* Number of completed phases */
+        ebr_limbo_t *limbo;         /* Retired objects, newest first */
+        int          limbo_cnt;
+} ebr_t;
+
+
+extern _Thread_local int ebr_thread_slot;
+int ebr_thread_slot_assign (void);
+
+
+void ebr_init (ebr_t *ebr);
+
+/**
+ * Free all retired objects. There must be no active readers.
+ */
+void ebr_destroy (ebr_t *ebr);
+
+
+/**
+ * Enter read-side critical section.
+ * Returns a token that must be passed to ebr_leave().
+ */
+static __inline int ebr_enter (ebr_t *ebr) {
+        int slot = ebr_thread_slot;
+        int side;
+
+        if (slot == -1)
+                slot = ebr_thread_slot_assign();
+
+        side = (int)(__atomic_load_n(&ebr->epoch, __ATOMIC_SEQ_CST) & 1);
+        __atomic_fetch_add(&ebr->slots[slot].cnt[side], 1, __ATOMIC_SEQ_CST);
+
+        return (slot << 1) | side;
+}
+
+/**
+ * Leave read-side critical section.
+ */
+static __inline void ebr_leave (ebr_t *ebr, int token) {
+        __atomic_fetch_sub(&ebr->slots[token >> 1].cnt[token & 1], 1,
+                           __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Retire `ptr`: `free_cb(ptr, opaque)` will be called from a later
+ * ebr_reclaim() (or ebr_destroy()) when no reader can access it.
+ *
+ * The object must already be unreachable to new readers.
+ */
+void ebr_retire (ebr_t *ebr, void *ptr,
+                 void (*free_cb) (void *ptr, void *opaque), void *opaque);
+
+/**
+ * Advance the epoch as far as active readers allow and free
+ * retired objects that are no longer reachable. Never blocks on readers.
+ *
+ * Returns the number of objects freed.
+ */
+int ebr_reclaim (ebr_t *ebr);
@@ -53,9 +53,10 @@ static size_t serdes_framing_cp1_write (serdes_schema_t *ss, char *payload,
 }
 
 
-size_t serdes_framing_write (serdes_schema_t *ss, char *payload, size_t size) {
+size_t serdes_serializer_framing_write (serdes_t *sd, serdes_schema_t *ss,
+                                        char *payload, size_t size) {
 
-        switch (ss->ss_sd->sd_conf.serializer_framing)
+        switch (sd->sd_conf.serializer_framing)
         {
         case SERDES_FRAMING_CP1:
                 return serdes_framing_cp1_write(ss, payload, size);
@@ -64,6 +65,10 @@ size_t serdes_framing_write (serdes_schema_t *ss, char *payload, size_t size) {
         }
 }
 
+size_t serdes_framing_write (serdes_schema_t *ss, char *payload, size_t size) {
+        return serdes_serializer_framing_write(ss->ss_sd, ss, payload, size);
+}
+
 
 
 
@@ -123,9 +128,10 @@ static ssize_t serdes_framing_cp1_read (const void **payloadp, size_t *sizep,
 
 
 
-ssize_t serdes_framing_read (serdes_t *sd, const void **payloadp, size_t *sizep,
-                             serdes_schema_t **schemap,
-                             char *errstr, int errstr_size) {
+static ssize_t serdes_framing_read0 (serdes_t *sd,
+                                     const void **payloadp, size_t *sizep,
+                                     serdes_schema_t **schemap, int do_ref,
+                                     char *errstr, int errstr_size) {
         serdes_schema_t *schema = NULL;
         int schema_id = -1;
         ssize_t r;
@@ -153,12 +159,31 @@ ssize_t serdes_framing_read (serdes_t *sd, const void **payloadp, size_t *sizep,
         else if (r == 0)
                 return 0;  /* No framing */
 
-        if (!(schema = serdes_schema_get(sd, NULL, schema_id,
-                                         errstr, errstr_size)))
+        schema = serdes_schema_get_framed(sd, schema_id, do_ref,
+                                          errstr, errstr_size);
+        if (!schema)
                 return -1;
 
         if (schemap)
                 *schemap = schema;
+        else if (do_ref)
+                serdes_schema_release(schema);
 
         return r;
 }
+
+
+ssize_t serdes_framing_read (serdes_t *sd, const void **payloadp, size_t *sizep,
+                             serdes_schema_t **schemap,
+                             char *errstr, int errstr_size) {
+        return serdes_framing_read0(sd, payloadp, sizep, schemap,
+                                    0/*borrowed*/, errstr, errstr_size);
+}
+
+ssize_t serdes_framing_read_acquire (serdes_t *sd,
+                                     const void **payloadp, size_t *sizep,
+                                     serdes_schema_t **schemap,
+                                     char *errstr, int errstr_size) {
+        return serdes_framing_read0(sd, payloadp, sizep, schemap,
+                                    1/*ref*/, errstr, errstr_size);
+}
@@ -0,0 +1,177 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashidx.h"
+
+
+#define HASHIDX_MIN_SIZE  16
+
+/* Removed entries are replaced by a tombstone rather than shifting
+ * subsequent entries back, which would make concurrent readers miss
+ * entries. Tombstones are dropped when the table is rebuilt. */
+static char hashidx_tombstone;
+#define HASHIDX_TOMBSTONE ((void *)&hashidx_tombstone)
+
+
+/**
+ * Scramble the key bits (splitmix64 finalizer) since keys such as
+ * schema ids are typically sequential.
+ */
+static __inline size_t hashidx_hash (uint64_t key) {
+        key ^= key >> 30;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 27;
+        key *= 0x94d049bb133111ebULL;
+        key ^= key >> 31;
+        return (size_t)key;
+}
+
+
+void hashidx_init (hashidx_t *hi,
+                   void (*retire_cb) (void *ptr, void *opaque),
+                   void *retire_opaque) {
+        memset(hi, 0, sizeof(*hi));
+        hi->retire_cb     = retire_cb;
+        hi->retire_opaque = retire_opaque;
+}
+
+void hashidx_destroy (hashidx_t *hi) {
+        if (hi->tbl)
+                free(hi->tbl);
+        hi->tbl  = NULL;
+        hi->cnt  = 0;
+        hi->used = 0;
+}
+
+
+/**
+ * Insert into empty slot, the entry is published to readers
+ * once its value is set.
+ */
+static void hashidx_insert0 (struct hashidx_tbl *tbl,
+                             uint64_t key, void *val) {
+        size_t mask = tbl->size - 1;
+        size_t i = hashidx_hash(key) & mask;
+
+        while (tbl->slots[i].val)
+                i = (i + 1) & mask;
+
+        tbl->slots[i].key = key;
+        __atomic_store_n(&tbl->slots[i].val, val, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Rebuild the index into a new slot table, dropping tombstones,
+ * and retire the previous table.
+ */
+static void hashidx_rebuild (hashidx_t *hi) {
+        struct hashidx_tbl *old = hi->tbl, *tbl;
+        size_t size = HASHIDX_MIN_SIZE;
+        size_t i;
+
+        /* Size the table for at most 25% load after rebuild. */
+        while (size < (hi->cnt + 1) * 4)
+                size *= 2;
+
+        tbl = calloc(1, sizeof(*tbl) + size * sizeof(*tbl->slots));
+        tbl->size = size;
+
+        if (old) {
+                for (i = 0 ; i < old->size ; i++)
+                        if (old->slots[i].val &&
+                            old->slots[i].val != HASHIDX_TOMBSTONE)
+                                hashidx_insert0(tbl, old->slots[i].key,
+                                                old->slots[i].val);
+        }
+
+        __atomic_store_n(&hi->tbl, tbl, __ATOMIC_SEQ_CST);
+        hi->used = hi->cnt;
+
+        if (old) {
+                if (hi->retire_cb)
+                        hi->retire_cb(old, hi->retire_opaque);
+                else
+                        free(old);
+        }
+}
+
+
+void hashidx_insert (hashidx_t *hi, uint64_t key, void *val) {
+        /* Keep load factor (including tombstones) at or below 50%
+         * to keep probe sequences short. */
+        if (!hi->tbl || (hi->used + 1) * 2 > hi->tbl->size)
+                hashidx_rebuild(hi);
+
+        hashidx_insert0(hi->tbl, key, val);
+        hi->cnt++;
+        hi->used++;
+}
+
+
+int hashidx_remove (hashidx_t *hi, uint64_t key, const void *val) {
+        struct hashidx_tbl *tbl = hi->tbl;
+        size_t mask, i;
+
+        if (!hi->cnt)
+                return 0;
+
+        mask = tbl->size - 1;
+        for (i = hashidx_hash(key) & mask ; tbl->slots[i].val ;
+             i = (i + 1) & mask) {
+                if (tbl->slots[i].key == key && tbl->slots[i].val == val) {
+                        __atomic_store_n(&tbl->slots[i].val,
+                                         HASHIDX_TOMBSTONE, __ATOMIC_SEQ_CST);
+                        hi->cnt--;
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+
+void *hashidx_find (const hashidx_t *hi, uint64_t key, size_t *posp) {
+        const struct hashidx_tbl *tbl = __atomic_load_n(&hi->tbl,
+                                                        __ATOMIC_SEQ_CST);
+        size_t mask, i;
+
+        if (!tbl)
+                return NULL;
+
+        mask = tbl->size - 1;
+
+        /* The iterator position is the probe offset from the key's
+         * home slot at which to resume the search. */
+        for (i = *posp ; i < tbl->size ; i++) {
+                const struct hashidx_slot *slot =
+                        &tbl->slots[(hashidx_hash(key) + i) & mask];
+                void *val = __atomic_load_n(&slot->val, __ATOMIC_SEQ_CST);
+
+                if (!val)
+                        break;
+
+                if (val != HASHIDX_TOMBSTONE && slot->key == key) {
+                        *posp = i + 1;
+                        return val;
+                }
+        }
+
+        *posp = tbl->size;
+        return NULL;
+}
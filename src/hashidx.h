@@ -0,0 +1,94 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Open-addressing (linear probing) hash index mapping a 64-bit key
+ * to a non-NULL pointer.
+ *
+ * The same key may be inserted multiple times (with different values),
+ * use hashidx_find() iteratively to visit all values for a key.
+ *
+ * The index does not own the values and performs no locking:
+ * modifications must be serialized by the caller, but hashidx_find()
+ * may run concurrently with modifications, e.g., from a lock-free reader.
+ * Such a reader may miss entries being added or removed, and must
+ * protect itself from the slot table being freed by providing a
+ * `retire_cb` (see hashidx_init()) that defers freeing of replaced tables
+ * until no reader can access them.
+ */
+struct hashidx_tbl {
+        size_t    size;             /* Number of slots (power of two) */
+        struct hashidx_slot {
+                uint64_t  key;
+                void     *val;      /* NULL if slot is empty,
+                                     * HASHIDX_TOMBSTONE if removed */
+        } slots[];
+};
+
+typedef struct hashidx_s {
+        struct hashidx_tbl *tbl;    /* Current slot table, or NULL */
+        size_t    cnt;              /* Number of entries */
+        size_t    used;             /* Number of entries and tombstones */
+
+        /* Replaced slot tables are passed to retire_cb for freeing. */
+        void    (*retire_cb) (void *ptr, void *opaque);
+        void     *retire_opaque;
+} hashidx_t;
+
+
+/**
+ * Initialize an empty index.
+ *
+ * `retire_cb` (optional) is called with replaced slot tables that
+ * must be free(3):d when no reader can access them anymore.
+ * If NULL replaced tables are freed immediately.
+ */
+void hashidx_init (hashidx_t *hi,
+                   void (*retire_cb) (void *ptr, void *opaque),
+                   void *retire_opaque);
+
+/**
+ * Free resources associated with the index (but not the values).
+ */
+void hashidx_destroy (hashidx_t *hi);
+
+/**
+ * Insert `val` for `key`.
+ */
+void hashidx_insert (hashidx_t *hi, uint64_t key, void *val);
+
+/**
+ * Remove the entry matching both `key` and `val`.
+ * Returns 1 if the entry was found and removed, else 0.
+ */
+int hashidx_remove (hashidx_t *hi, uint64_t key, const void *val);
+
+/**
+ * Find a value for `key`.
+ *
+ * `*posp` is the iterator state and must be initialized to 0 before
+ * the first call, call again with the same `posp` to retrieve the
+ * next value for the same key.
+ *
+ * Returns the value, or NULL if there are no (more) values for `key`.
+ * The iterator is invalidated by hashidx_insert() and hashidx_remove().
+ */
+void *hashidx_find (const hashidx_t *hi, uint64_t key, size_t *posp);
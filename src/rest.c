@@ -17,6 +17,9 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <time.h>
+
+#include <sys/queue.h>
 
 #include <curl/curl.h>
 
@@ -161,7 +164,6 @@ int url_list_parse (url_list_t *ul, const char *urls) {
 
         ul->str     = strdup(urls);
         ul->cnt     = 0;
-        ul->idx     = 0;
         ul->max_len = 0;
         ul->urls    = NULL;
 
@@ -194,6 +196,8 @@ int url_list_parse (url_list_t *ul, const char *urls) {
 
         free(s_orig);
 
+        ul->health = calloc(ul->cnt > 0 ? ul->cnt : 1, sizeof(*ul->health));
+
         return ul->cnt;
 }
 
@@ -204,6 +208,8 @@ void url_list_clear (url_list_t *ul) {
                 free(ul->urls[i]);
         if (ul->urls)
                 free(ul->urls);
+        if (ul->health)
+                free(ul->health);
         if (ul->str)
                 free(ul->str);
 }
@@ -328,10 +334,8 @@ static size_t rest_curl_write_cb (char *ptr, size_t size, size_t nmemb,
  * (low level) REST requester.
  * The response will be updated with an error or the response payload.
  */
-static CURLcode rest_req_curl (CURL *curl, rest_response_t *rr) {
-        CURLcode ccode;
-
-        ccode = curl_easy_perform(curl);
+static void rest_req_curl_result (CURL *curl, rest_response_t *rr,
+                                  CURLcode ccode) {
         if (ccode != CURLE_OK) {
                 rest_response_set_result(rr, -1,
                                          "HTTP request failed: %s",
@@ -344,37 +348,455 @@ static CURLcode rest_req_curl (CURL *curl, rest_response_t *rr) {
                 else
                         rest_response_set_result(rr, rr->code, NULL);
         }
+}
+
+static CURLcode rest_req_curl (CURL *curl, rest_response_t *rr) {
+        CURLcode ccode;
+
+        ccode = curl_easy_perform(curl);
+        rest_req_curl_result(curl, rr, ccode);
 
         return ccode;
 }
 
 
+/**
+ * Write the URL of `url_path` on `ul`'s `idx`th URL to `dst`,
+ * of at least ul->max_len + strlen(url_path) + 1 bytes.
+ */
+static void rest_url_build (char *dst, const url_list_t *ul, int idx,
+                            const char *url_path) {
+        /*  Handle the '/' in url
+         *  When schema registry url is http://127.0.0.1:8081/,
+         *  it returns 404 error code. We need to remove the
+         *  the last redundant '/' in the url.
+         */
+        size_t url_len = strlen(ul->urls[idx]);
+        while (url_len > 0 && ul->urls[idx][url_len - 1] == '/')
+            url_len --;
+        sprintf(dst, "%.*s%s", (int)url_len, ul->urls[idx], url_path);
+}
+
+
+/**
+ * Monotonic clock in milliseconds.
+ */
+static int64_t rest_clock_ms (void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+/**
+ * URL health.
+ *
+ * A URL is taken out of rotation for URL_COOLDOWN_MS after
+ * URL_MAX_FAILS consecutive failed requests (retryable errors). Once the
+ * cooldown has passed a single request is let through to probe it:
+ * on success the URL is back in rotation, else it is out for another
+ * cooldown period.
+ * The state is shared by all threads using the URL list, lock-free.
+ */
+#define URL_MAX_FAILS    3
+#define URL_COOLDOWN_MS  10000
+
+/**
+ * Select the URL to try next among the URLs of `ul` not yet `tried`
+ * (one flag per URL): a URL due for its probe, else the fastest
+ * URL in rotation, URLs with unknown latency first so they get measured,
+ * else the URL out of rotation that is the closest to the end of its
+ * cooldown.
+ *
+ * Returns the URL's index, or -1 if all URLs have been tried.
+ */
+static int url_list_select (url_list_t *ul, const char *tried) {
+        int64_t now = rest_clock_ms();
+        int64_t best_ewma = INT64_MAX, first_up = INT64_MAX;
+        int best = -1, down = -1;
+        int i;
+
+        for (i = 0 ; i < ul->cnt ; i++) {
+                url_health_t *h = &ul->health[i];
+                int64_t down_until, ewma;
+
+                if (tried[i])
+                        continue;
+
+                down_until = __atomic_load_n(&h->down_until,
+                                             __ATOMIC_RELAXED);
+                if (down_until > now) {
+                        if (down_until < first_up) {
+                                first_up = down_until;
+                                down = i;
+                        }
+                        continue;
+                }
+
+                if (down_until > 0) {
+                        /* Cooldown is over: claim the probe, unless
+                         * another request beat us to it. */
+                        if (__atomic_compare_exchange_n(
+                                    &h->down_until, &down_until,
+                                    now + URL_COOLDOWN_MS, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                return i;
+                        if (down < 0) {
+                                first_up = down_until;
+                                down = i;
+                        }
+                        continue;
+                }
+
+                ewma = __atomic_load_n(&h->ewma_us, __ATOMIC_RELAXED);
+                if (ewma < best_ewma) {
+                        best_ewma = ewma;
+                        best = i;
+                }
+        }
+
+        return best != -1 ? best : down;
+}
+
+
+/**
+ * Update the health of `ul`'s `idx`th URL with the outcome of a request:
+ * `ok` if the URL responded (rest_response_retryable() is false), in
+ * `latency_us`.
+ */
+static void url_list_report (url_list_t *ul, int idx, int ok,
+                             int64_t latency_us) {
+        url_health_t *h = &ul->health[idx];
+        int64_t ewma, new_ewma;
+
+        if (!ok) {
+                if (__atomic_add_fetch(&h->fails, 1, __ATOMIC_RELAXED) >=
+                    URL_MAX_FAILS)
+                        __atomic_store_n(&h->down_until,
+                                         rest_clock_ms() + URL_COOLDOWN_MS,
+                                         __ATOMIC_RELAXED);
+                return;
+        }
+
+        if (__atomic_load_n(&h->fails, __ATOMIC_RELAXED) > 0)
+                __atomic_store_n(&h->fails, 0, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&h->down_until, __ATOMIC_RELAXED) > 0)
+                __atomic_store_n(&h->down_until, 0, __ATOMIC_RELAXED);
+
+        /* Latency EWMA with alpha 1/8, the first sample initializes it.
+         * Never 0 once known. */
+        if (latency_us < 1)
+                latency_us = 1;
+        ewma = __atomic_load_n(&h->ewma_us, __ATOMIC_RELAXED);
+        do {
+                new_ewma = ewma ? ewma + (latency_us - ewma) / 8 : latency_us;
+                if (new_ewma < 1)
+                        new_ewma = 1;
+        } while (!__atomic_compare_exchange_n(&h->ewma_us, &ewma, new_ewma,
+                                              0, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+}
+
+
+/**
+ * Returns the duration of the last transfer of `curl`, in microseconds.
+ */
+static int64_t rest_curl_latency_us (CURL *curl) {
+        double total_time = 0.0;
+
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
+
+        return (int64_t)(total_time * 1000000.0);
+}
+
+
+/**
+ * Max number of idle handles kept by a pool, handles released
+ * when it is full are closed.
+ */
+#define REST_POOL_MAX_IDLE  16
+
+/**
+ * Asynchronous request, performed by the pool's I/O thread.
+ */
+typedef struct rest_async_s {
+        TAILQ_ENTRY(rest_async_s) ra_link; /* rp_queue, or the I/O thread's
+                                            * list of active requests */
+        CURL               *ra_curl;
+        rest_response_t    *ra_rr;
+        url_list_t         *ra_ul;
+        char               *ra_url;       /* URL buffer */
+        char               *ra_url_path;  /* Appended to the URLs */
+        int                 ra_idx;       /* URL being tried */
+        char               *ra_tried;     /* URLs tried (per URL flag) */
+        int                 ra_active;    /* Added to rp_multi */
+        int                 ra_retry;     /* Retries so far */
+        int64_t             ra_retry_at;  /* Backing off until this time
+                                           * (rest_clock_ms()), else 0 */
+        rest_done_cb_t     *ra_done_cb;
+        void               *ra_opaque;
+} rest_async_t;
+
+
+struct rest_pool_s {
+        mtx_t               rp_lock;      /* Protects rp_idle*, rp_queue,
+                                           * rp_thrd_run and rp_cancel */
+        CURL               *rp_idle[REST_POOL_MAX_IDLE]; /* Idle handles,
+                                                          * most recently
+                                                          * used last */
+        int                 rp_idle_cnt;
+        struct curl_slist  *rp_hdrs;      /* Request headers, shared by
+                                           * all handles */
+        CURLSH             *rp_share;     /* DNS cache and TLS sessions
+                                           * shared by all handles */
+        mtx_t               rp_share_locks[CURL_LOCK_DATA_LAST]; /* Per
+                                           * shared data, for rp_share */
+
+        rest_conf_t         rp_conf;
+        unsigned int        rp_rand;      /* Backoff jitter PRNG state
+                                           * (atomic) */
+        CURLM              *rp_multi;     /* Drives async requests,
+                                           * created with the I/O thread */
+        thrd_t              rp_thrd;      /* I/O thread */
+        int                 rp_thrd_run;  /* I/O thread started */
+        cnd_t               rp_cnd;       /* Wakes up the idle I/O thread */
+        int                 rp_cancel;    /* rest_pool_cancel() called */
+        TAILQ_HEAD(, rest_async_s) rp_queue; /* Async requests waiting
+                                              * for the I/O thread */
+};
+
+
+static void rest_share_lock_cb (CURL *curl, curl_lock_data data,
+                                curl_lock_access access, void *opaque) {
+        rest_pool_t *pool = opaque;
+
+        mtx_lock(&pool->rp_share_locks[data]);
+}
+
+static void rest_share_unlock_cb (CURL *curl, curl_lock_data data,
+                                  void *opaque) {
+        rest_pool_t *pool = opaque;
+
+        mtx_unlock(&pool->rp_share_locks[data]);
+}
+
+
+rest_pool_t *rest_pool_new (const rest_conf_t *conf) {
+        rest_pool_t *pool;
+        int i;
+
+        /* Initialize rest, once */
+        rest_init();
+
+        pool = calloc(1, sizeof(*pool));
+        mtx_init(&pool->rp_lock, mtx_plain);
+        cnd_init(&pool->rp_cnd);
+        TAILQ_INIT(&pool->rp_queue);
+        pool->rp_conf = *conf;
+        pool->rp_rand = (unsigned int)time(NULL) ^
+                (unsigned int)(uintptr_t)pool;
+        if (!pool->rp_rand)
+                pool->rp_rand = 1;
+
+        /* Share what can be shared between the handles, used from
+         * multiple threads: libcurl serializes access through the
+         * lock callbacks. This is an optimization, carry on
+         * without it if not supported. */
+        for (i = 0 ; i < CURL_LOCK_DATA_LAST ; i++)
+                mtx_init(&pool->rp_share_locks[i], mtx_plain);
+
+        if ((pool->rp_share = curl_share_init())) {
+                curl_share_setopt(pool->rp_share, CURLSHOPT_LOCKFUNC,
+                                  rest_share_lock_cb);
+                curl_share_setopt(pool->rp_share, CURLSHOPT_UNLOCKFUNC,
+                                  rest_share_unlock_cb);
+                curl_share_setopt(pool->rp_share, CURLSHOPT_USERDATA, pool);
+                curl_share_setopt(pool->rp_share, CURLSHOPT_SHARE,
+                                  CURL_LOCK_DATA_DNS);
+                curl_share_setopt(pool->rp_share, CURLSHOPT_SHARE,
+                                  CURL_LOCK_DATA_SSL_SESSION);
+                /* Connections are not shared (CURL_LOCK_DATA_CONNECT):
+                 * libcurl does not support sharing them between
+                 * concurrent threads. Pooled handles keep their own. */
+        }
+
+        pool->rp_hdrs = curl_slist_append(pool->rp_hdrs, "Accept: application/vnd.schemaregistry.v1+json");
+        pool->rp_hdrs = curl_slist_append(pool->rp_hdrs, "Content-Type: application/vnd.schemaregistry.v1+json");
+        pool->rp_hdrs = curl_slist_append(pool->rp_hdrs, "Charsets: utf-8");
+
+        return pool;
+}
+
+
+void rest_pool_destroy (rest_pool_t *pool) {
+        int i;
+
+        /* Stop the I/O thread, if any, which returns its handles. */
+        rest_pool_cancel(pool);
+        if (pool->rp_multi)
+                curl_multi_cleanup(pool->rp_multi);
+        cnd_destroy(&pool->rp_cnd);
+
+        while (pool->rp_idle_cnt > 0)
+                curl_easy_cleanup(pool->rp_idle[--pool->rp_idle_cnt]);
+
+        /* No handles are left using the share. */
+        if (pool->rp_share)
+                curl_share_cleanup(pool->rp_share);
+        for (i = 0 ; i < CURL_LOCK_DATA_LAST ; i++)
+                mtx_destroy(&pool->rp_share_locks[i]);
+
+        curl_slist_free_all(pool->rp_hdrs);
+        mtx_destroy(&pool->rp_lock);
+        free(pool);
+}
+
+
+/**
+ * Returns the backoff in milliseconds before retry number `retry` (1..):
+ * the pool's retry_backoff_ms doubled for each retry, capped to
+ * retry_backoff_max_ms, of which a random half is used so that clients
+ * failing at the same time don't retry in lockstep.
+ */
+static int rest_retry_backoff_ms (rest_pool_t *pool, int retry) {
+        int64_t backoff = pool->rp_conf.retry_backoff_ms;
+        unsigned int x;
+
+        if (backoff <= 0)
+                return 0;
+
+        backoff <<= (retry - 1 < 30 ? retry - 1 : 30);
+        if (backoff > pool->rp_conf.retry_backoff_max_ms)
+                backoff = pool->rp_conf.retry_backoff_max_ms;
+
+        /* xorshift32: concurrent callers may get the same value,
+         * which does no harm. */
+        x = __atomic_load_n(&pool->rp_rand, __ATOMIC_RELAXED);
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        __atomic_store_n(&pool->rp_rand, x, __ATOMIC_RELAXED);
+
+        return (int)(backoff / 2 + x % (backoff / 2 + 1));
+}
+
+
+/**
+ * Set cURL option on a handle being set up, on failure the handle
+ * is closed (it is in an unknown state) and `rr` is returned with the
+ * error set.
+ */
+#define do_curl_setopt(curl,opt,val...) do {                            \
+                CURLcode _ccode = curl_easy_setopt(curl, opt, val);     \
+                if (_ccode != CURLE_OK) {                               \
+                        rest_response_set_result(rr, -1,                \
+                                                 "curl: setopt %s failed: %s", \
+                                                 #opt,                  \
+                                                 curl_easy_strerror(_ccode)); \
+                        curl_easy_cleanup(curl);                        \
+                        return rr;                                      \
+                }                                                       \
+         } while (0)
+
+
+/**
+ * Get an idle handle from the pool, or create a new one with
+ * the options common to all requests.
+ *
+ * Returns NULL with `rr` updated with the error on failure.
+ */
+static CURL *rest_pool_get (rest_pool_t *pool, rest_response_t *rr) {
+        CURL *curl = NULL;
+        const int debug = 0;
+
+        mtx_lock(&pool->rp_lock);
+        if (pool->rp_idle_cnt > 0)
+                curl = pool->rp_idle[--pool->rp_idle_cnt];
+        mtx_unlock(&pool->rp_lock);
+
+        if (curl)
+                return curl;
+
+        if (!(curl = curl_easy_init())) {
+                rest_response_set_result(rr, -1,
+                                         "curl: failed to create handle");
+                return NULL;
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_HTTPHEADER,
+                             pool->rp_hdrs) != CURLE_OK ||
+            (debug &&
+             curl_easy_setopt(curl, CURLOPT_VERBOSE, (long)1) != CURLE_OK) ||
+            curl_easy_setopt(curl, CURLOPT_USERAGENT,
+                             "libserdes") != CURLE_OK ||
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+                             rest_curl_write_cb) != CURLE_OK ||
+            /* Requests are performed from any thread */
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, (long)1) != CURLE_OK ||
+            /* Keep idle connections to the registry alive */
+            curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE,
+                             (long)1) != CURLE_OK ||
+            (pool->rp_conf.timeout_ms > 0 &&
+             curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS,
+                              (long)pool->rp_conf.timeout_ms) != CURLE_OK) ||
+            (pool->rp_conf.connect_timeout_ms > 0 &&
+             curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                              (long)pool->rp_conf.connect_timeout_ms) !=
+             CURLE_OK) ||
+            (pool->rp_share &&
+             curl_easy_setopt(curl, CURLOPT_SHARE,
+                              pool->rp_share) != CURLE_OK)) {
+                rest_response_set_result(rr, -1,
+                                         "curl: failed to set up handle");
+                curl_easy_cleanup(curl);
+                return NULL;
+        }
+
+        return curl;
+}
+
+
+/**
+ * Return a handle to the pool for reuse by the next request,
+ * it keeps its connection open.
+ */
+static void rest_pool_put (rest_pool_t *pool, CURL *curl) {
+        mtx_lock(&pool->rp_lock);
+        if (pool->rp_idle_cnt < REST_POOL_MAX_IDLE) {
+                pool->rp_idle[pool->rp_idle_cnt++] = curl;
+                curl = NULL;
+        }
+        mtx_unlock(&pool->rp_lock);
+
+        if (curl)
+                curl_easy_cleanup(curl);
+}
+
+
 /**
  * Perform 'cmd' (GET,POST,PUT,..) request to URLs on list 'ul'
  * by appending 'url_path_fmt' to each URL.
- * The URLs in 'ul' will be tried in a round-robin fashion until one
- * returns a succesful reply.
+ * The URLs in 'ul' will be tried, as selected by url_list_select(), until
+ * one returns a succesful reply or a terminal failure, and all of them
+ * again after a backoff, up to the pool's retries times, if they all
+ * failed with a retryable error.
  * For POST & PUT, 'payload' and 'size' is the transmitted payload.
  *
  * Returns a response handle which needs to be checked for error.
  */
-static rest_response_t *rest_req (url_list_t *ul, rest_cmd_t cmd,
+static rest_response_t *rest_req (rest_pool_t *pool, url_list_t *ul,
+                                  rest_cmd_t cmd,
                                   const void *payload, int size,
                                   const char *url_path_fmt, va_list ap) {
 
         CURL *curl;
-        CURLcode ccode;
         rest_response_t *rr;
-        struct curl_slist *hdrs = NULL;
         char *tmpurl;
-        int start_idx;
+        char *tried;
+        int retry = 0;
         char *url_path;
         int url_path_len;
         va_list ap2;
-        const int debug = 0;
-
-        /* Initialize rest, once */
-        rest_init();
 
         /* Construct URL suffix */
         va_copy(ap2, ap);
@@ -382,36 +804,19 @@ static rest_response_t *rest_req (url_list_t *ul, rest_cmd_t cmd,
         url_path = alloca(url_path_len+1);
         vsnprintf(url_path, url_path_len+1, url_path_fmt, ap2);
 
-        /* Create cURL handle */
-        curl = curl_easy_init();
-
         /* Response holder */
         rr = rest_response_new(0);
 
-#define do_curl_setopt(curl,opt,val...) do {                            \
-                CURLcode _ccode = curl_easy_setopt(curl, opt, val);     \
-                if (_ccode != CURLE_OK) {                               \
-                        rest_response_set_result(rr, -1,                \
-                                                 "curl: setopt %s failed: %s", \
-                                                 #opt,                  \
-                                                 curl_easy_strerror(_ccode)); \
-                        if (hdrs)                                       \
-                                curl_slist_free_all(hdrs);              \
-                        curl_easy_cleanup(curl);                        \
-                        return rr;                                      \
-                }                                                       \
-         } while (0)
+        if (ul->cnt == 0) {
+                rest_response_set_result(rr, -1, "No URLs configured");
+                return rr;
+        }
 
+        /* Pooled cURL handle, with the common options set */
+        if (!(curl = rest_pool_get(pool, rr)))
+                return rr;
 
         /* Set up cURL request */
-        hdrs = curl_slist_append(hdrs, "Accept: application/vnd.schemaregistry.v1+json");
-        hdrs = curl_slist_append(hdrs, "Content-Type: application/vnd.schemaregistry.v1+json");
-        hdrs = curl_slist_append(hdrs, "Charsets: utf-8");
-        do_curl_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
-        if (debug)
-                do_curl_setopt(curl, CURLOPT_VERBOSE, (long)1);
-        do_curl_setopt(curl, CURLOPT_USERAGENT, "libserdes");
-        do_curl_setopt(curl, CURLOPT_WRITEFUNCTION, rest_curl_write_cb);
         do_curl_setopt(curl, CURLOPT_WRITEDATA, rr);
 
         switch (cmd)
@@ -428,64 +833,476 @@ static rest_response_t *rest_req (url_list_t *ul, rest_cmd_t cmd,
         }
 
 
-        /* Try each URL in the URL list until one works. */
-        ccode = CURLE_URL_MALFORMAT;
+        /* Try each URL in the URL list until one works, or fails
+         * for good. */
         tmpurl = alloca(ul->max_len + 1 + strlen(url_path) + 1);
-        start_idx = ul->idx;
-        do {
-                /*  Handle the '/' in url
-                 *  When schema registry url is http://127.0.0.1:8081/,
-                 *  it returns 404 error code. We need to remove the
-                 *  the last redundant '/' in the url.
-                 */
-                size_t url_len = strlen(ul->urls[ul->idx]);
-                while (url_len > 0 && ul->urls[ul->idx][url_len - 1] == '/')
-                    url_len --;
-                sprintf(tmpurl, "%.*s%s", (int)url_len, ul->urls[ul->idx], url_path);
-                do_curl_setopt(curl, CURLOPT_URL, tmpurl);
-
-                rest_response_reset(rr);
-
-                /* Perform request */
-                ccode = rest_req_curl(curl, rr);
-                if (ccode == CURLE_OK)
+        tried = alloca(ul->cnt + 1);
+        while (1) {
+                struct timespec ts;
+                int backoff_ms;
+                int idx;
+
+                memset(tried, 0, ul->cnt);
+                while ((idx = url_list_select(ul, tried)) != -1) {
+                        tried[idx] = 1;
+                        rest_url_build(tmpurl, ul, idx, url_path);
+                        do_curl_setopt(curl, CURLOPT_URL, tmpurl);
+
+                        rest_response_reset(rr);
+
+                        /* Perform request */
+                        rest_req_curl(curl, rr);
+                        url_list_report(ul, idx, !rest_response_retryable(rr),
+                                        rest_curl_latency_us(curl));
+                        if (!rest_response_retryable(rr))
+                                break;
+                }
+
+                if (!rest_response_retryable(rr) ||
+                    retry >= pool->rp_conf.retries)
                         break;
 
-                /* Try next */
-                ul->idx = (ul->idx + 1) % ul->cnt;
-        } while (ul->idx != start_idx);
+                /* All URLs failed: retry after backoff. */
+                backoff_ms = rest_retry_backoff_ms(pool, ++retry);
+                ts.tv_sec  = backoff_ms / 1000;
+                ts.tv_nsec = (long)(backoff_ms % 1000) * 1000000;
+                thrd_sleep(&ts, NULL);
+        }
 
-        curl_slist_free_all(hdrs);
-        curl_easy_cleanup(curl);
+        /* The handle must not write to the response once returned. */
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+        rest_pool_put(pool, curl);
         return rr;
 }
 
 
 
-rest_response_t *rest_get (url_list_t *ul, const char *url_path_fmt, ...) {
+rest_response_t *rest_get (rest_pool_t *pool, url_list_t *ul,
+                           const char *url_path_fmt, ...) {
         rest_response_t *rr;
         va_list ap;
 
         va_start(ap, url_path_fmt);
-        rr = rest_req(ul, REST_GET, NULL, 0, url_path_fmt, ap);
+        rr = rest_req(pool, ul, REST_GET, NULL, 0, url_path_fmt, ap);
         va_end(ap);
 
         return rr;
 }
 
 
-rest_response_t *rest_post (url_list_t *ul,
+rest_response_t *rest_post (rest_pool_t *pool, url_list_t *ul,
                             const void *payload, int size,
                             const char *url_path_fmt, ...) {
         rest_response_t *rr;
         va_list ap;
 
         va_start(ap, url_path_fmt);
-        rr = rest_req(ul, REST_POST, payload, size, url_path_fmt, ap);
+        rr = rest_req(pool, ul, REST_POST, payload, size, url_path_fmt, ap);
         va_end(ap);
 
         return rr;
 }
 
 
+/**
+ * Asynchronous requests.
+ *
+ * Requests are queued on rp_queue for the pool's I/O thread, started on
+ * the first request, which adds them to rp_multi and drives them all
+ * concurrently from a single thread. Handles are taken from and returned
+ * to the pool as for blocking requests, but while added to rp_multi
+ * they use its connection cache.
+ */
+
+
+/**
+ * Finish an asynchronous request: return its handle to the pool and
+ * hand the response over to the request's callback.
+ */
+static void rest_async_done (rest_pool_t *pool, rest_async_t *ra) {
+        /* The handle must not refer to the request once returned. */
+        curl_easy_setopt(ra->ra_curl, CURLOPT_WRITEDATA, NULL);
+        curl_easy_setopt(ra->ra_curl, CURLOPT_PRIVATE, NULL);
+        rest_pool_put(pool, ra->ra_curl);
+
+        ra->ra_done_cb(ra->ra_rr, ra->ra_opaque);
+
+        free(ra->ra_url);
+        free(ra->ra_url_path);
+        free(ra->ra_tried);
+        free(ra);
+}
+
+
+/**
+ * Handle the completion of a transfer of `ra` with result `ccode`:
+ * on a retryable failure the next URL is tried, or all of them again
+ * after a backoff (ra_retry_at), as by rest_req(), else the response
+ * is set.
+ *
+ * Returns 1 if the request was restarted, else 0.
+ */
+static int rest_async_transfer_done (rest_pool_t *pool, rest_async_t *ra,
+                                     CURLcode ccode) {
+        url_list_t *ul = ra->ra_ul;
+
+        rest_req_curl_result(ra->ra_curl, ra->ra_rr, ccode);
+        url_list_report(ul, ra->ra_idx, !rest_response_retryable(ra->ra_rr),
+                        rest_curl_latency_us(ra->ra_curl));
+        if (!rest_response_retryable(ra->ra_rr))
+                return 0;
+
+        /* Try next */
+        if ((ra->ra_idx = url_list_select(ul, ra->ra_tried)) == -1) {
+                /* All URLs failed: retry after backoff. */
+                if (ra->ra_retry >= pool->rp_conf.retries)
+                        return 0;
+                ra->ra_retry_at = rest_clock_ms() +
+                        rest_retry_backoff_ms(pool, ++ra->ra_retry);
+                memset(ra->ra_tried, 0, ul->cnt);
+                ra->ra_idx = url_list_select(ul, ra->ra_tried);
+        }
+        ra->ra_tried[ra->ra_idx] = 1;
+
+        rest_url_build(ra->ra_url, ul, ra->ra_idx, ra->ra_url_path);
+        if (curl_easy_setopt(ra->ra_curl, CURLOPT_URL,
+                             ra->ra_url) != CURLE_OK)
+                return 0;
+
+        rest_response_reset(ra->ra_rr);
+        return 1;
+}
+
+
+/**
+ * I/O thread: adds queued requests to rp_multi and drives them until
+ * the pool is cancelled, which fails the remaining requests.
+ */
+static int rest_pool_io_main (void *arg) {
+        rest_pool_t *pool = arg;
+        TAILQ_HEAD(, rest_async_s) active;
+        rest_async_t *ra;
+        int active_cnt = 0;
+
+        TAILQ_INIT(&active);
+
+        mtx_lock(&pool->rp_lock);
+        while (!pool->rp_cancel) {
+                CURLMsg *msg;
+                int running, msgs_left;
+                int transfer_cnt = 0; /* Requests added to rp_multi */
+                int wait_ms = 1000;
+                int64_t now;
+
+                if (active_cnt == 0 && TAILQ_EMPTY(&pool->rp_queue)) {
+                        cnd_wait(&pool->rp_cnd, &pool->rp_lock);
+                        continue;
+                }
+
+                while ((ra = TAILQ_FIRST(&pool->rp_queue))) {
+                        TAILQ_REMOVE(&pool->rp_queue, ra, ra_link);
+                        TAILQ_INSERT_TAIL(&active, ra, ra_link);
+                        active_cnt++;
+                }
+                mtx_unlock(&pool->rp_lock);
+
+                now = rest_clock_ms();
+                TAILQ_FOREACH(ra, &active, ra_link) {
+                        if (!ra->ra_active) {
+                                if (ra->ra_retry_at > now) {
+                                        /* Backing off */
+                                        if (ra->ra_retry_at - now < wait_ms)
+                                                wait_ms = (int)
+                                                        (ra->ra_retry_at -
+                                                         now);
+                                        continue;
+                                }
+                                curl_multi_add_handle(pool->rp_multi,
+                                                      ra->ra_curl);
+                                ra->ra_active = 1;
+                                ra->ra_retry_at = 0;
+                        }
+                        transfer_cnt++;
+                }
+
+                if (transfer_cnt > 0)
+                        curl_multi_perform(pool->rp_multi, &running);
+
+                while ((msg = curl_multi_info_read(pool->rp_multi,
+                                                   &msgs_left))) {
+                        CURL *curl = msg->easy_handle;
+                        CURLcode ccode = msg->data.result;
+                        char *priv;
+
+                        if (msg->msg != CURLMSG_DONE)
+                                continue;
+
+                        /* `msg` is invalid once the handle is removed. */
+                        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+                        ra = (rest_async_t *)priv;
+                        curl_multi_remove_handle(pool->rp_multi, curl);
+                        ra->ra_active = 0;
+                        transfer_cnt--;
+
+                        if (rest_async_transfer_done(pool, ra, ccode)) {
+                                /* Re-added on next iteration, right away
+                                 * on the next URL. */
+                                if (!ra->ra_retry_at)
+                                        wait_ms = 0;
+                                else if (ra->ra_retry_at - now < wait_ms)
+                                        wait_ms = (int)(ra->ra_retry_at -
+                                                        now);
+                                continue;
+                        }
+
+                        TAILQ_REMOVE(&active, ra, ra_link);
+                        active_cnt--;
+                        rest_async_done(pool, ra);
+                }
+
+                if (active_cnt > 0 && wait_ms > 0) {
+                        if (transfer_cnt > 0) {
+                                /* Wait for socket activity, a timeout or
+                                 * a new request. */
+#if LIBCURL_VERSION_NUM >= 0x074200 /* 7.66.0 */
+                                curl_multi_poll(pool->rp_multi, NULL, 0,
+                                                wait_ms, NULL);
+#else
+                                curl_multi_wait(pool->rp_multi, NULL, 0,
+                                                wait_ms < 100 ?
+                                                wait_ms : 100, NULL);
+#endif
+                        } else {
+                                /* All requests are backing off:
+                                 * wait for the first retry or
+                                 * a new request. */
+                                mtx_lock(&pool->rp_lock);
+                                if (!pool->rp_cancel &&
+                                    TAILQ_EMPTY(&pool->rp_queue))
+                                        cnd_timedwait_ms(&pool->rp_cnd,
+                                                         &pool->rp_lock,
+                                                         wait_ms);
+                                continue;
+                        }
+                }
+
+                mtx_lock(&pool->rp_lock);
+        }
+
+        /* Cancelled: fail active and queued requests. */
+        TAILQ_CONCAT(&active, &pool->rp_queue, ra_link);
+        mtx_unlock(&pool->rp_lock);
+
+        while ((ra = TAILQ_FIRST(&active))) {
+                TAILQ_REMOVE(&active, ra, ra_link);
+                if (ra->ra_active)
+                        curl_multi_remove_handle(pool->rp_multi, ra->ra_curl);
+                rest_response_reset(ra->ra_rr);
+                rest_response_set_result(ra->ra_rr, -1,
+                                         "HTTP request cancelled");
+                rest_async_done(pool, ra);
+        }
+
+        return 0;
+}
+
+
+void rest_pool_cancel (rest_pool_t *pool) {
+        int thrd_run;
 
+        mtx_lock(&pool->rp_lock);
+        pool->rp_cancel = 1;
+        thrd_run = pool->rp_thrd_run;
+        pool->rp_thrd_run = 0;
+        cnd_signal(&pool->rp_cnd);
+        mtx_unlock(&pool->rp_lock);
+
+        if (!thrd_run)
+                return;
+
+#if LIBCURL_VERSION_NUM >= 0x074400 /* 7.68.0 */
+        curl_multi_wakeup(pool->rp_multi);
+#endif
+        thrd_join(pool->rp_thrd, NULL);
+}
+
+
+/**
+ * Queue an asynchronous request, see rest_req() for the arguments.
+ *
+ * Returns 0 if queued, else -1 (pool cancelled, I/O thread could not
+ * be started).
+ */
+static int rest_req_async (rest_pool_t *pool, url_list_t *ul,
+                           rest_cmd_t cmd,
+                           const void *payload, int size,
+                           rest_done_cb_t *done_cb, void *opaque,
+                           const char *url_path_fmt, va_list ap) {
+        rest_async_t *ra;
+        int url_path_len;
+        CURLcode ccode;
+        va_list ap2;
+
+        ra = calloc(1, sizeof(*ra));
+        ra->ra_ul        = ul;
+        ra->ra_done_cb   = done_cb;
+        ra->ra_opaque    = opaque;
+
+        /* Construct URL suffix */
+        va_copy(ap2, ap);
+        url_path_len = vsnprintf(NULL, 0, url_path_fmt, ap);
+        ra->ra_url_path = malloc(url_path_len+1);
+        vsnprintf(ra->ra_url_path, url_path_len+1, url_path_fmt, ap2);
+        va_end(ap2);
+
+        /* Response holder */
+        ra->ra_rr = rest_response_new(0);
+
+        ra->ra_url = malloc(ul->max_len + 1 + url_path_len + 1);
+        ra->ra_tried = calloc(ul->cnt + 1, 1);
+
+        if (ul->cnt == 0) {
+                /* Report the failure through the callback
+                 * like any other. */
+                rest_response_set_result(ra->ra_rr, -1,
+                                         "No URLs configured");
+                goto queue;
+        }
+
+        ra->ra_idx = url_list_select(ul, ra->ra_tried);
+        ra->ra_tried[ra->ra_idx] = 1;
+        rest_url_build(ra->ra_url, ul, ra->ra_idx, ra->ra_url_path);
+
+        /* Pooled cURL handle, with the common options set */
+        if (!(ra->ra_curl = rest_pool_get(pool, ra->ra_rr))) {
+                /* Report the failure through the callback
+                 * like any other. */
+                ccode = CURLE_OK;
+                goto queue;
+        }
+
+        /* Set up cURL request. The payload is copied since it
+         * must outlive the call. */
+        ccode = curl_easy_setopt(ra->ra_curl, CURLOPT_WRITEDATA, ra->ra_rr);
+        if (!ccode)
+                ccode = curl_easy_setopt(ra->ra_curl, CURLOPT_PRIVATE,
+                                         (char *)ra);
+        if (!ccode)
+                ccode = curl_easy_setopt(ra->ra_curl, CURLOPT_URL,
+                                         ra->ra_url);
+        switch (cmd)
+        {
+        case REST_GET:
+                if (!ccode)
+                        ccode = curl_easy_setopt(ra->ra_curl,
+                                                 CURLOPT_HTTPGET, 1L);
+                break;
+
+        case REST_POST:
+                if (!ccode)
+                        ccode = curl_easy_setopt(ra->ra_curl,
+                                                 CURLOPT_POST, 1L);
+                if (!ccode)
+                        ccode = curl_easy_setopt(ra->ra_curl,
+                                                 CURLOPT_POSTFIELDSIZE,
+                                                 (long)size);
+                if (!ccode)
+                        ccode = curl_easy_setopt(ra->ra_curl,
+                                                 CURLOPT_COPYPOSTFIELDS,
+                                                 payload);
+                break;
+        }
+
+        if (ccode != CURLE_OK) {
+                rest_response_set_result(ra->ra_rr, -1,
+                                         "curl: setopt failed: %s",
+                                         curl_easy_strerror(ccode));
+                curl_easy_cleanup(ra->ra_curl);
+                ra->ra_curl = NULL;
+        }
+
+ queue:
+        mtx_lock(&pool->rp_lock);
+
+        if (pool->rp_cancel)
+                goto fail;
+
+        if (!pool->rp_thrd_run) {
+                if (!pool->rp_multi) {
+                        if (!(pool->rp_multi = curl_multi_init()))
+                                goto fail;
+                        curl_multi_setopt(pool->rp_multi,
+                                          CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                                          (long)pool->rp_conf.max_async);
+                }
+
+                if (thrd_create(&pool->rp_thrd, rest_pool_io_main, pool) !=
+                    thrd_success)
+                        goto fail;
+                pool->rp_thrd_run = 1;
+        }
+
+        if (!ra->ra_curl) {
+                /* Set up failed: complete right away, outside the lock. */
+                mtx_unlock(&pool->rp_lock);
+                done_cb(ra->ra_rr, opaque);
+                free(ra->ra_url);
+                free(ra->ra_url_path);
+                free(ra->ra_tried);
+                free(ra);
+                return 0;
+        }
+
+        TAILQ_INSERT_TAIL(&pool->rp_queue, ra, ra_link);
+        cnd_signal(&pool->rp_cnd);
+        mtx_unlock(&pool->rp_lock);
+
+#if LIBCURL_VERSION_NUM >= 0x074400 /* 7.68.0 */
+        /* Interrupt the I/O thread's wait for socket activity. */
+        curl_multi_wakeup(pool->rp_multi);
+#endif
+
+        return 0;
+
+ fail:
+        mtx_unlock(&pool->rp_lock);
+        if (ra->ra_curl)
+                rest_pool_put(pool, ra->ra_curl);
+        rest_response_destroy(ra->ra_rr);
+        free(ra->ra_url);
+        free(ra->ra_url_path);
+        free(ra->ra_tried);
+        free(ra);
+        return -1;
+}
+
+
+int rest_get_async (rest_pool_t *pool, url_list_t *ul,
+                    rest_done_cb_t *done_cb, void *opaque,
+                    const char *url_path_fmt, ...) {
+        va_list ap;
+        int r;
+
+        va_start(ap, url_path_fmt);
+        r = rest_req_async(pool, ul, REST_GET, NULL, 0, done_cb, opaque,
+                           url_path_fmt, ap);
+        va_end(ap);
+
+        return r;
+}
+
+
+int rest_post_async (rest_pool_t *pool, url_list_t *ul,
+                     const void *payload, int size,
+                     rest_done_cb_t *done_cb, void *opaque,
+                     const char *url_path_fmt, ...) {
+        va_list ap;
+        int r;
+
+        va_start(ap, url_path_fmt);
+        r = rest_req_async(pool, ul, REST_POST, payload, size,
+                           done_cb, opaque, url_path_fmt, ap);
+        va_end(ap);
+
+        return r;
+}
@@ -15,6 +15,8 @@
  */
 #pragma once
 
+#include <stdint.h>
+
 
 /**
  * Supported HTTP commands
@@ -26,12 +28,27 @@ typedef enum {
 
 
 /**
- * List of URLs with built-in round-robin.
+ * Health of a URL, as seen by the requests to it.
+ * All fields are updated atomically.
+ */
+typedef struct url_health_s {
+        int64_t ewma_us;      /* Latency (EWMA) of successful requests,
+                               * 0 = unknown */
+        int     fails;        /* Consecutive failed requests */
+        int64_t down_until;   /* Out of rotation until this time
+                               * (rest clock, ms), 0 = in rotation */
+} url_health_t;
+
+
+/**
+ * List of URLs with built-in health-aware selection: requests go to the
+ * fastest URL in rotation, URLs are taken out of rotation for a cooldown
+ * period after consecutive failures.
  */
 typedef struct url_list_s {
         char **urls;          /* URLs */
+        url_health_t *health; /* Health of each URL in 'urls' */
         int    cnt;           /* Number of URLs in 'urls' */
-        int    idx;           /* Next URL to try */
         char  *str;           /* Original string (copy) */
         int    max_len;       /* Longest URL's length */
 } url_list_t;
@@ -50,6 +67,57 @@ int url_list_parse (url_list_t *ul, const char *urls);
 void url_list_clear (url_list_t *ul);
 
 
+/**
+ * Pool of reusable cURL handles, with their connections kept alive
+ * between requests. The handles share their DNS cache and TLS sessions.
+ * One per serdes handle (or shared schema cache).
+ */
+typedef struct rest_pool_s rest_pool_t;
+
+
+/**
+ * Request settings of a pool's requests.
+ */
+typedef struct rest_conf_s {
+        int max_async;             /* Max concurrent asynchronous
+                                    * requests */
+        int timeout_ms;            /* Max duration of a request to one URL,
+                                    * 0 = unlimited */
+        int connect_timeout_ms;    /* Max duration of connecting to a URL,
+                                    * 0 = libcurl's default */
+        int retries;               /* Retries of a request that failed
+                                    * with a retryable error on all URLs */
+        int retry_backoff_ms;      /* Backoff before the first retry,
+                                    * doubled for each following retry */
+        int retry_backoff_max_ms;  /* Max backoff */
+} rest_conf_t;
+
+
+/**
+ * Create a new, empty, pool: handles are created as needed.
+ *
+ * At most `conf->max_async` asynchronous requests (rest_get_async(), ..)
+ * are performed concurrently, others wait for a connection.
+ */
+rest_pool_t *rest_pool_new (const rest_conf_t *conf);
+
+
+/**
+ * Cancel asynchronous requests: requests in progress or queued fail
+ * and their callbacks are called before this returns, while new
+ * requests are refused.
+ */
+void rest_pool_cancel (rest_pool_t *pool);
+
+
+/**
+ * Destroy the pool, closing its handles' connections.
+ * There must be no blocking requests in progress, asynchronous
+ * requests are cancelled.
+ */
+void rest_pool_destroy (rest_pool_t *pool);
+
+
 /**
  * REST response object, contains the response code, payload, errors, etc.
  */
@@ -76,6 +144,14 @@ typedef struct rest_response_s {
 #define rest_response_failed(rr)  ((rr)->code < 100 || (rr)->code > 299)
 
 
+/**
+ * Check if a failed response may succeed if retried, on another URL or
+ * later: local failures (connection failures, timeouts, ..) and server
+ * errors (5xx). Other failures (e.g., 404) are terminal.
+ */
+#define rest_response_retryable(rr)  ((rr)->code == -1 || (rr)->code >= 500)
+
+
 /**
  * Writes the response error string to `errstr`.
  * Should only be used on rest_response_t where rest_response_failed()
@@ -93,23 +169,66 @@ void rest_response_destroy (rest_response_t *rr);
  * REST GET request.
  *
  * `ul` is a list of URLs to which `url_path_fmt + ...` will be appended.
- * The URLs will be tried in a round-robin fashion until one returns
- * a succesful response or all URLs have been exhausted.
+ * The URLs will be tried, fastest in rotation first, until one returns
+ * a succesful response, or a terminal failure, or all URLs have been
+ * exhausted. If all URLs failed with a retryable error
+ * (rest_response_retryable()) they are tried again, up to the pool's
+ * `retries` times, after an exponential backoff with jitter.
+ *
+ * The request is performed on a handle taken from `pool`, reusing
+ * its connection to the URL if still open.
  *
  * Returns a response object, use rest_response_failed() to check if
  * the response contains an error.
  *
  * This is a blocking call.
  */
-rest_response_t *rest_get (url_list_t *ul, const char *url_path_fmt, ...);
+rest_response_t *rest_get (rest_pool_t *pool, url_list_t *ul,
+                           const char *url_path_fmt, ...);
 
 
 /* REST PUT request.
  *
  * Same semantics as `rest_get()` but POSTs `payload` of `size` bytes.
  */
-rest_response_t *rest_post (url_list_t *ul,
+rest_response_t *rest_post (rest_pool_t *pool, url_list_t *ul,
                             const void *payload, int size,
                             const char *url_path_fmt, ...);
 
 
+/**
+ * Asynchronous request completion callback, called with the response
+ * (which the callback must destroy) by the pool's I/O thread.
+ * The callback should not block: it holds up other requests.
+ */
+typedef void (rest_done_cb_t) (rest_response_t *rr, void *opaque);
+
+
+/**
+ * Asynchronous REST GET request.
+ *
+ * Same semantics as rest_get() but the request is performed by the
+ * pool's I/O thread, concurrently with other asynchronous requests, and
+ * `done_cb` is called with the response and `opaque` once finished.
+ * `ul` must remain valid until then.
+ *
+ * Returns 0 if the request was queued, in which case `done_cb` is
+ * called exactly once (possibly before this returns if the request
+ * could not be set up), else -1 if the pool is cancelled or the I/O
+ * thread could not be started.
+ */
+int rest_get_async (rest_pool_t *pool, url_list_t *ul,
+                    rest_done_cb_t *done_cb, void *opaque,
+                    const char *url_path_fmt, ...);
+
+
+/**
+ * Asynchronous REST POST request.
+ *
+ * Same semantics as `rest_get_async()` but POSTs `payload` of `size`
+ * bytes, which is copied.
+ */
+int rest_post_async (rest_pool_t *pool, url_list_t *ul,
+                     const void *payload, int size,
+                     rest_done_cb_t *done_cb, void *opaque,
+                     const char *url_path_fmt, ...);
@@ -15,6 +15,8 @@
  */
 
 #include <ctype.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #include <jansson.h>
 
@@ -23,13 +25,61 @@
 
 
 
+static once_flag serdes_fingerprint_init_once = ONCE_FLAG_INIT;
+static uint64_t serdes_fingerprint_table[256];
+
+#define SERDES_FINGERPRINT_EMPTY 0xc15d213aa4d7a795ULL
+
+/**
+ * Once-per-runtime init of the CRC-64-AVRO lookup table.
+ */
+static void serdes_fingerprint_init_cb (void) {
+        int i, j;
+
+        for (i = 0 ; i < 256 ; i++) {
+                uint64_t fp = (uint64_t)i;
+                for (j = 0 ; j < 8 ; j++)
+                        fp = (fp >> 1) ^
+                                (SERDES_FINGERPRINT_EMPTY & -(fp & 1));
+                serdes_fingerprint_table[i] = fp;
+        }
+}
+
+/**
+ * Returns the 64-bit Rabin fingerprint (CRC-64-AVRO, as defined by the
+ * Avro specification) of `buf`.
+ */
+uint64_t serdes_fingerprint64 (const void *buf, size_t len) {
+        const unsigned char *p = buf;
+        uint64_t fp = SERDES_FINGERPRINT_EMPTY;
+
+        call_once(&serdes_fingerprint_init_once, serdes_fingerprint_init_cb);
+
+        while (len-- > 0)
+                fp = (fp >> 8) ^ serdes_fingerprint_table[(fp ^ *(p++)) & 0xff];
+
+        return fp;
+}
+
+
+
 /**
  * Update schema's timestamp of last use.
+ *
+ * The timestamp only changes once per second so the store is skipped
+ * when up to date, to avoid dirtying the schema's cache line from
+ * every thread on every lookup.
  */
 static __inline void serdes_schema_mark_used (serdes_schema_t *ss) {
-        mtx_lock(&ss->ss_lock);
-        ss->ss_t_last_used = time(NULL);
-        mtx_unlock(&ss->ss_lock);
+        int64_t now = serdes_clock_coarse();
+
+        if (__atomic_load_n(&ss->ss_t_last_used, __ATOMIC_RELAXED) != now)
+                __atomic_store_n(&ss->ss_t_last_used, now, __ATOMIC_RELAXED);
+
+        /* Lookups are lock-free and can't reorder the LRU list,
+         * flag the schema for a second chance at eviction instead. */
+        if (!__atomic_load_n(&ss->ss_lru_ref, __ATOMIC_RELAXED))
+                __atomic_store_n(&ss->ss_lru_ref, 1, __ATOMIC_RELAXED);
 }
 
 
@@ -51,40 +101,465 @@ static void serdes_schema_set_definition (serdes_schema_t *ss,
                 ss->ss_definition_len = len;
                 memcpy(ss->ss_definition, definition, len);
                 ss->ss_definition[len] = '\0';
+                ss->ss_fingerprint = serdes_fingerprint64(definition, len);
         }
 }
 
 
 /**
- * Destroy schema, sd_lock must be held.
+ * Estimated size of a parsed schema object relative to its definition,
+ * the object is opaque to us (see schema_load_cb).
  */
-void serdes_schema_destroy0 (serdes_schema_t *ss) {
+#define SERDES_SCHEMA_OBJ_SIZE_FACTOR 4
+
+/**
+ * Returns the schema's estimated memory usage for cache accounting:
+ * the schema itself, its definition and name, and the parsed object.
+ */
+static int64_t serdes_schema_size (const serdes_schema_t *ss) {
+        int64_t size = sizeof(*ss);
+
+        if (ss->ss_definition)
+                size += (ss->ss_definition_len + 1) *
+                        (1 + SERDES_SCHEMA_OBJ_SIZE_FACTOR);
+        if (ss->ss_name)
+                size += strlen(ss->ss_name) + 1;
+        if (ss->ss_errstr)
+                size += strlen(ss->ss_errstr) + 1;
+
+        return size;
+}
+
+
+/**
+ * Returns the sd_schemas_by_name index key for subject `name`.
+ */
+static __inline uint64_t serdes_schema_name_key (const char *name) {
+        return serdes_fingerprint64(name, strlen(name));
+}
+
+
+/**
+ * Returns true if schema id `id` is pinned by "schema.cache.pin.ids".
+ */
+static int serdes_conf_pinned_id (const serdes_t *sd, int id) {
+        int i;
+
+        for (i = 0 ; i < sd->sd_conf.pin_id_cnt ; i++)
+                if (sd->sd_conf.pin_ids[i] == id)
+                        return 1;
+
+        return 0;
+}
+
+/**
+ * Returns true if the latest schema of subject `name` is pinned by
+ * "schema.cache.pin.subjects".
+ */
+static int serdes_conf_pinned_subject (const serdes_t *sd, const char *name) {
+        int i;
+
+        for (i = 0 ; i < sd->sd_conf.pin_subject_cnt ; i++)
+                if (!strcmp(sd->sd_conf.pin_subjects[i], name))
+                        return 1;
+
+        return 0;
+}
+
+
+static void serdes_subject_free_cb (void *ptr, void *opaque) {
+        serdes_subject_t *sj = ptr;
+
+        free(sj->sj_name);
+        free(sj);
+}
+
+
+/**
+ * Remove subject from the subject "latest" index, the subject entry is
+ * retired since lock-free readers may still be looking at it.
+ *
+ * Locks: sd_lock MUST be held.
+ */
+static void serdes_subject_unset0 (serdes_subject_t *sj) {
+        serdes_schema_t *ss = sj->sj_ss;
+        serdes_t *sd = ss->ss_sd;
+
+        hashidx_remove(&sd->sd_schemas_by_name,
+                       serdes_schema_name_key(sj->sj_name), sj);
+        LIST_REMOVE(sj, sj_link);
+
+        if (serdes_conf_pinned_subject(sd, sj->sj_name))
+                serdes_schema_unpin(ss);
+
+        ebr_retire(&sd->sd_ebr, sj, serdes_subject_free_cb, NULL);
+}
+
+
+/**
+ * Returns the subject entry of `name` in the subject "latest" index,
+ * or NULL if there is none.
+ *
+ * Locks: sd_lock MUST be held, or the caller must be in a read-side
+ *        (EBR) section.
+ */
+static serdes_subject_t *serdes_subject_find (serdes_t *sd,
+                                              const char *name) {
+        serdes_subject_t *sj;
+        size_t pos = 0;
+
+        while ((sj = hashidx_find(&sd->sd_schemas_by_name,
+                                  serdes_schema_name_key(name), &pos))) {
+                if (!strcmp(sj->sj_name, name))
+                        return sj;
+        }
+
+        return NULL;
+}
+
+
+/**
+ * Register `ss` as the latest version of subject `name`, replacing
+ * any previous latest schema for the subject.
+ * The schema may be the latest version of other subjects as well.
+ *
+ * Locks: the schema's shard lock and sd_lock MUST be held.
+ */
+static void serdes_schema_set_latest0 (serdes_schema_t *ss, const char *name) {
+        serdes_t *sd = ss->ss_sd;
+        serdes_subject_t *sj;
+
+        if (sd->sd_conf.latest_ttl_ms == 0)
+                return;
+
+        if ((sj = serdes_subject_find(sd, name))) {
+                if (sj->sj_ss == ss) {
+                        /* Unchanged: renew */
+                        __atomic_store_n(&sj->sj_ts_latest, serdes_clock(),
+                                         __ATOMIC_RELAXED);
+                        return;
+                }
+                serdes_subject_unset0(sj);
+        }
+
+        if (!ss->ss_name) {
+                serdes_shard_t *sh = serdes_shard(sd, (uint64_t)ss->ss_id);
+
+                ss->ss_name = strdup(name);
+
+                /* Account for the name */
+                sh->sh_schema_bytes -= ss->ss_bytes;
+                ss->ss_bytes = serdes_schema_size(ss);
+                sh->sh_schema_bytes += ss->ss_bytes;
+        }
+
+        sj = calloc(1, sizeof(*sj));
+        sj->sj_name      = strdup(name);
+        sj->sj_ss        = ss;
+        sj->sj_ts_latest = serdes_clock();
+        LIST_INSERT_HEAD(&ss->ss_subjects, sj, sj_link);
+
+        if (serdes_conf_pinned_subject(sd, name))
+                serdes_schema_pin(ss);
+        hashidx_insert(&sd->sd_schemas_by_name,
+                       serdes_schema_name_key(name), sj);
+}
+
+
+/**
+ * Returns the shared parsed object with canonical form `canonical`,
+ * or NULL if there is none.
+ *
+ * Locks: sd_objs_lock MUST be held.
+ */
+static serdes_schema_obj_t *serdes_schema_obj_find0 (serdes_t *sd,
+                                                     const char *canonical,
+                                                     size_t canonical_len,
+                                                     uint64_t fingerprint) {
+        serdes_schema_obj_t *so;
+        size_t pos = 0;
+
+        while ((so = hashidx_find(&sd->sd_objs, fingerprint, &pos))) {
+                if (so->so_canonical_len == canonical_len &&
+                    !memcmp(so->so_canonical, canonical, canonical_len))
+                        return so;
+        }
+
+        return NULL;
+}
+
 
-        if (ss->ss_schema_obj)
+/**
+ * Share the schema's parsed object with later schemas of the same
+ * canonical form, taking ownership of `canonical`.
+ * If another thread has meanwhile parsed the same canonical form
+ * the schema's object is replaced by the shared one.
+ *
+ * Locks: sd_objs_lock MUST NOT be held.
+ */
+static void serdes_schema_obj_share (serdes_schema_t *ss, char *canonical,
+                                     size_t canonical_len,
+                                     uint64_t fingerprint) {
+        serdes_t *sd = ss->ss_sd;
+        serdes_schema_obj_t *so;
+
+        mtx_lock(&sd->sd_objs_lock);
+        if ((so = serdes_schema_obj_find0(sd, canonical, canonical_len,
+                                          fingerprint))) {
+                so->so_refcnt++;
+                mtx_unlock(&sd->sd_objs_lock);
+
+                sd->sd_conf.schema_unload_cb(ss, ss->ss_schema_obj,
+                                             sd->sd_conf.opaque);
+                ss->ss_schema_obj = so->so_obj;
+                ss->ss_obj = so;
+                free(canonical);
+                return;
+        }
+
+        so = calloc(1, sizeof(*so));
+        so->so_fingerprint   = fingerprint;
+        so->so_canonical     = canonical;
+        so->so_canonical_len = canonical_len;
+        so->so_obj           = ss->ss_schema_obj;
+        so->so_refcnt        = 1;
+        hashidx_insert(&sd->sd_objs, fingerprint, so);
+        mtx_unlock(&sd->sd_objs_lock);
+
+        ss->ss_obj = so;
+}
+
+
+/**
+ * Release the schema's reference to its shared parsed object,
+ * unloading the object when it is no longer used.
+ *
+ * Locks: sd_objs_lock MUST NOT be held.
+ */
+static void serdes_schema_obj_release (serdes_schema_t *ss) {
+        serdes_t *sd = ss->ss_sd;
+        serdes_schema_obj_t *so = ss->ss_obj;
+
+        mtx_lock(&sd->sd_objs_lock);
+        if (--so->so_refcnt > 0) {
+                mtx_unlock(&sd->sd_objs_lock);
+                return;
+        }
+        hashidx_remove(&sd->sd_objs, so->so_fingerprint, so);
+        mtx_unlock(&sd->sd_objs_lock);
+
+        sd->sd_conf.schema_unload_cb(ss, so->so_obj, sd->sd_conf.opaque);
+        free(so->so_canonical);
+        free(so);
+}
+
+
+/**
+ * Free schema and its resources, the schema must not be linked.
+ */
+static void serdes_schema_free (serdes_schema_t *ss) {
+
+        if (ss->ss_obj)
+                serdes_schema_obj_release(ss);
+        else if (ss->ss_schema_obj)
                 ss->ss_sd->sd_conf.schema_unload_cb(ss, ss->ss_schema_obj,
                                                     ss->ss_sd->sd_conf.opaque);
 
         serdes_schema_set_definition(ss, NULL, 0);
 
+        while (ss->ss_aliases) {
+                serdes_alias_t *sa = ss->ss_aliases;
+                ss->ss_aliases = sa->sa_next;
+                free(sa);
+        }
+
         if (ss->ss_name)
                 free(ss->ss_name);
 
-        if (ss->ss_linked)
-                LIST_REMOVE(ss, ss_link);
+        if (ss->ss_errstr)
+                free(ss->ss_errstr);
 
-        mtx_destroy(&ss->ss_lock);
         free(ss);
 }
 
+/**
+ * Purge queue.
+ *
+ * Each shard keeps its schemas in a binary min-heap ordered by
+ * ss_t_purgeq, a snapshot of ss_t_last_used taken when the schema was
+ * (re)queued. Lookups update ss_t_last_used without locking and never
+ * touch the queue, but since ss_t_last_used only moves forward a
+ * (non-pinned) schema unused since `expiry` always has
+ * ss_t_purgeq < expiry: purging only needs to look at the queue's head,
+ * re-queuing schemas that have been used since, rather than scan all
+ * cached schemas.
+ */
+
+static __inline void serdes_purgeq_set0 (serdes_shard_t *sh, int idx,
+                                         serdes_schema_t *ss) {
+        sh->sh_purgeq[idx] = ss;
+        ss->ss_purgeq_idx = idx;
+}
+
+/**
+ * Restore heap order from `idx`, whose key may have decreased or
+ * increased.
+ *
+ * Locks: the shard lock of `sh` MUST be held.
+ */
+static void serdes_purgeq_fix0 (serdes_shard_t *sh, int idx) {
+        serdes_schema_t *ss = sh->sh_purgeq[idx];
+        int cnt = sh->sh_schema_cnt;
+
+        while (idx > 0) {
+                int parent = (idx - 1) / 2;
+
+                if (sh->sh_purgeq[parent]->ss_t_purgeq <= ss->ss_t_purgeq)
+                        break;
+                serdes_purgeq_set0(sh, idx, sh->sh_purgeq[parent]);
+                idx = parent;
+        }
+
+        while (2 * idx + 1 < cnt) {
+                int child = 2 * idx + 1;
+
+                if (child + 1 < cnt &&
+                    sh->sh_purgeq[child + 1]->ss_t_purgeq <
+                    sh->sh_purgeq[child]->ss_t_purgeq)
+                        child++;
+                if (ss->ss_t_purgeq <= sh->sh_purgeq[child]->ss_t_purgeq)
+                        break;
+                serdes_purgeq_set0(sh, idx, sh->sh_purgeq[child]);
+                idx = child;
+        }
+
+        serdes_purgeq_set0(sh, idx, ss);
+}
+
+/**
+ * Queue schema that was just added to the shard (sh_schema_cnt
+ * already includes it).
+ *
+ * Locks: the shard lock of `sh` MUST be held.
+ */
+static void serdes_purgeq_insert0 (serdes_shard_t *sh, serdes_schema_t *ss) {
+        if (sh->sh_schema_cnt > sh->sh_purgeq_size) {
+                sh->sh_purgeq_size = sh->sh_purgeq_size ?
+                        sh->sh_purgeq_size * 2 : 64;
+                sh->sh_purgeq = realloc(sh->sh_purgeq,
+                                        sizeof(*sh->sh_purgeq) *
+                                        sh->sh_purgeq_size);
+        }
+
+        ss->ss_t_purgeq = __atomic_load_n(&ss->ss_t_last_used,
+                                          __ATOMIC_RELAXED);
+        serdes_purgeq_set0(sh, sh->sh_schema_cnt - 1, ss);
+        serdes_purgeq_fix0(sh, sh->sh_schema_cnt - 1);
+}
+
+/**
+ * Remove schema from the queue, before it is removed from the shard
+ * (sh_schema_cnt still includes it).
+ *
+ * Locks: the shard lock of `sh` MUST be held.
+ */
+static void serdes_purgeq_remove0 (serdes_shard_t *sh, serdes_schema_t *ss) {
+        int idx = ss->ss_purgeq_idx;
+        int last = sh->sh_schema_cnt - 1;
+
+        if (idx == last)
+                return;
+
+        serdes_purgeq_set0(sh, idx, sh->sh_purgeq[last]);
+        sh->sh_schema_cnt--; /* Exclude the removed schema while fixing */
+        serdes_purgeq_fix0(sh, idx);
+        sh->sh_schema_cnt++;
+}
+
+
+/**
+ * Acquire a reference to a schema.
+ *
+ * The caller must already hold a reference, or have found the schema
+ * in the cache while holding its shard lock or from a read-side (EBR)
+ * section.
+ */
+static __inline void serdes_schema_keep (serdes_schema_t *ss) {
+        __atomic_add_fetch(&ss->ss_refcnt, 1, __ATOMIC_RELAXED);
+}
+
+
+void serdes_schema_release (serdes_schema_t *ss) {
+        if (__atomic_sub_fetch(&ss->ss_refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+                serdes_schema_free(ss);
+}
+
+static void serdes_schema_release_cb (void *ptr, void *opaque) {
+        serdes_schema_release((serdes_schema_t *)ptr);
+}
+
+
+/**
+ * Destroy schema, the schema's shard lock must be held (if cached).
+ *
+ * A cached schema is unlinked from the cache and the cache's reference
+ * is retired rather than released since lock-free readers may still
+ * be looking at it (and acquiring references), it will be released
+ * by a later ebr_reclaim(). The schema is freed when its last
+ * reference is released.
+ *
+ * An unlinked schema has its reference released.
+ *
+ * Locks: sd_lock MUST NOT be held.
+ */
+void serdes_schema_destroy0 (serdes_schema_t *ss) {
+        serdes_t *sd = ss->ss_sd;
+        serdes_subject_t *sj;
+        serdes_alias_t *sa;
+        serdes_shard_t *sh;
+
+        if (!ss->ss_linked) {
+                serdes_schema_release(ss);
+                return;
+        }
+
+        sh = serdes_shard(sd, (uint64_t)ss->ss_id);
+
+        mtx_lock(&sd->sd_lock);
+        while ((sj = LIST_FIRST(&ss->ss_subjects)))
+                serdes_subject_unset0(sj);
+        if (ss->ss_definition)
+                hashidx_remove(&sd->sd_schemas_by_fp, ss->ss_fingerprint, ss);
+        for (sa = ss->ss_aliases ; sa ; sa = sa->sa_next)
+                hashidx_remove(&sd->sd_schemas_by_fp, sa->sa_fingerprint, ss);
+        mtx_unlock(&sd->sd_lock);
+
+        serdes_purgeq_remove0(sh, ss);
+        TAILQ_REMOVE(&sh->sh_schemas, ss, ss_link);
+        sh->sh_schema_cnt--;
+        sh->sh_schema_bytes -= ss->ss_bytes;
+        hashidx_remove(&sh->sh_schemas_by_id, (uint64_t)ss->ss_id, ss);
+        ss->ss_linked = 0;
+
+        /* Invalidate thread-local cache entries before retiring. */
+        serdes_gen_bump(sd);
+
+        ebr_retire(&sd->sd_ebr, ss, serdes_schema_release_cb, NULL);
+}
+
 
 /**
  * Public API
  */
 void serdes_schema_destroy (serdes_schema_t *ss) {
         serdes_t *sd = ss->ss_sd;
-        mtx_lock(&sd->sd_lock);
+        serdes_shard_t *sh = serdes_shard(sd, (uint64_t)ss->ss_id);
+
+        mtx_lock(&sh->sh_lock);
         serdes_schema_destroy0(ss);
-        mtx_unlock(&sd->sd_lock);
+        mtx_unlock(&sh->sh_lock);
+
+        ebr_reclaim(&sd->sd_ebr);
 }
 
 
@@ -120,8 +595,8 @@ static int serdes_schema_store (serdes_schema_t *ss,
         enc_len = strlen(enc);
 
         /* POST schema definition to remote schema registry */
-        rr = rest_post(&sd->sd_conf.schema_registry_urls, enc, enc_len,
-                       "/subjects/%s/versions", ss->ss_name);
+        rr = rest_post(sd->sd_rest, &sd->sd_conf.schema_registry_urls,
+                       enc, enc_len, "/subjects/%s/versions", ss->ss_name);
 
         free(enc);
         json_decref(json);
@@ -173,6 +648,10 @@ static int serdes_schema_load (serdes_schema_t *ss,
                                char *errstr, int errstr_size) {
         serdes_t *sd = ss->ss_sd;
         char *wrapped = NULL;
+        char *canonical;
+        size_t canonical_len;
+        uint64_t fingerprint = 0;
+        serdes_schema_obj_t *so = NULL;
 
         /* Left-trim schema definition */
         while (definition_len > 0 && isspace(*definition)) {
@@ -194,17 +673,47 @@ static int serdes_schema_load (serdes_schema_t *ss,
             ss->ss_name, ss->ss_id, wrapped ? " (wrapped)" : "",
             (int)definition_len, definition);
 
-        /* Parse schema */
-        ss->ss_schema_obj = sd->sd_conf.schema_load_cb(ss,
-                                                       definition, definition_len,
-                                                       errstr, errstr_size,
-                                                       sd->sd_conf.opaque);
-        if (!ss->ss_schema_obj) {
+        /* Schemas that only differ cosmetically (whitespace, attribute
+         * order, namespace notation, ..) share one parsed object. */
+        if ((canonical = serdes_schema_canonical(definition, definition_len,
+                                                 &canonical_len))) {
+                fingerprint = serdes_fingerprint64(canonical, canonical_len);
+
+                mtx_lock(&sd->sd_objs_lock);
+                if ((so = serdes_schema_obj_find0(sd, canonical,
+                                                  canonical_len,
+                                                  fingerprint)))
+                        so->so_refcnt++;
+                mtx_unlock(&sd->sd_objs_lock);
+        }
+
+        if (so) {
                 DBG(ss->ss_sd, "SCHEMA_LOAD",
-                    "Schema load of %s failed: %s", ss->ss_name, errstr);
-                if (wrapped)
-                        free(wrapped);
-                return -1;
+                    "Schema %s (%d) shares parsed object of canonical "
+                    "form %"PRIx64, ss->ss_name, ss->ss_id, fingerprint);
+                ss->ss_schema_obj = so->so_obj;
+                ss->ss_obj = so;
+                free(canonical);
+
+        } else {
+                /* Parse schema */
+                ss->ss_schema_obj = sd->sd_conf.schema_load_cb(
+                        ss, definition, definition_len,
+                        errstr, errstr_size, sd->sd_conf.opaque);
+                if (!ss->ss_schema_obj) {
+                        DBG(ss->ss_sd, "SCHEMA_LOAD",
+                            "Schema load of %s failed: %s",
+                            ss->ss_name, errstr);
+                        if (canonical)
+                                free(canonical);
+                        if (wrapped)
+                                free(wrapped);
+                        return -1;
+                }
+
+                if (canonical)
+                        serdes_schema_obj_share(ss, canonical, canonical_len,
+                                                fingerprint);
         }
 
         serdes_schema_set_definition(ss, definition, definition_len);
@@ -219,37 +728,19 @@ static int serdes_schema_load (serdes_schema_t *ss,
 
 
 /**
- * Fetch schema definition from schema registry.
+ * Load schema `ss` from the response `rr` to its fetch from the
+ * schema registry, which is destroyed.
  *
  * Returns -1 on failure.
  */
-static int serdes_schema_fetch (serdes_schema_t *ss,
-                                char *errstr, int errstr_size) {
-        serdes_t *sd = ss->ss_sd;
-        rest_response_t *rr;
+static int serdes_schema_fetch_read (serdes_schema_t *ss, rest_response_t *rr,
+                                     char *errstr, int errstr_size) {
         json_t *json, *json_schema;
         json_error_t err;
 
-        if (sd->sd_conf.schema_registry_urls.cnt == 0) {
-                snprintf(errstr, errstr_size,
-                         "Unable to load schema %d from registry: "
-                         "no 'schema.registry.url' configured",
-                         ss->ss_id);
-                return -1;
-        }
-
-        if (ss->ss_id != -1) {
-                /* GET schema definition by id from remote schema registry */
-                rr = rest_get(&sd->sd_conf.schema_registry_urls,
-                              "/schemas/ids/%d", ss->ss_id);
-        } else {
-                /* GET schema definition by name from remote schema registry */
-                rr = rest_get(&sd->sd_conf.schema_registry_urls,
-                              "/subjects/%s/versions/latest", ss->ss_name);
-        }
-
         if (rest_response_failed(rr)) {
                 rest_response_strerror(rr, errstr, errstr_size);
+                ss->ss_errcode = rr->code;
                 rest_response_destroy(rr);
                 return -1;
         }
@@ -319,48 +810,234 @@ static int serdes_schema_fetch (serdes_schema_t *ss,
 
 
 /**
- * Adds and loads a schema.
- *
- * If a schema object is returned it is guaranteed to be fully loaded
- * and usable, if the load fails NULL is returned and the error is set
- * in 'errstr'.
+ * Fetch schema definition from schema registry.
  *
- * Locks: sd->sd_lock MUST be held.
+ * Returns -1 on failure.
  */
-static serdes_schema_t *serdes_schema_add0 (serdes_t *sd,
-                                            const char *name, int id,
-                                            const void *definition,
-                                            int definition_len,
-                                            char *errstr, int errstr_size) {
-
-        serdes_schema_t *ss;
+static int serdes_schema_fetch (serdes_schema_t *ss,
+                                char *errstr, int errstr_size) {
+        serdes_t *sd = ss->ss_sd;
+        rest_response_t *rr;
 
-        if (id == -1 && !name) {
+        if (sd->sd_conf.schema_registry_urls.cnt == 0) {
                 snprintf(errstr, errstr_size,
-                         "Schema name or ID required");
-                return NULL;
+                         "Unable to load schema %d from registry: "
+                         "no 'schema.registry.url' configured",
+                         ss->ss_id);
+                return -1;
         }
 
-        ss = calloc(1, sizeof(*ss));
-        ss->ss_id = id;
-        ss->ss_sd = sd;
+        if (ss->ss_id != -1) {
+                /* GET schema definition by id from remote schema registry */
+                rr = rest_get(sd->sd_rest, &sd->sd_conf.schema_registry_urls,
+                              "/schemas/ids/%d", ss->ss_id);
+        } else {
+                /* GET schema definition by name from remote schema registry */
+                rr = rest_get(sd->sd_rest, &sd->sd_conf.schema_registry_urls,
+                              "/subjects/%s/versions/latest", ss->ss_name);
+        }
 
-        if (name)
-                ss->ss_name = strdup(name);
+        return serdes_schema_fetch_read(ss, rr, errstr, errstr_size);
+}
 
-        if (definition) {
-                if (!ss->ss_name) {
-                        snprintf(errstr, errstr_size, "Schema name required");
-                        free(ss);
-                        return NULL;
-                }
 
+/**
+ * Find cached schema by id.
+ *
+ * Locks: the id's shard lock MUST be held, or the caller must be in
+ *        a read-side (EBR) section.
+ */
+static serdes_schema_t *serdes_schema_find_by_id (serdes_t *sd, int id) {
+        size_t pos = 0;
+
+        return hashidx_find(&serdes_shard(sd, (uint64_t)id)->sh_schemas_by_id,
+                            (uint64_t)id, &pos);
+}
+
+
+/**
+ * How long the failed lookup of an id by a speculative prefetch is
+ * cached if "schema.cache.negative.ttl.ms" is not set.
+ */
+#define SERDES_SPECULATIVE_NEGATIVE_TTL_MS  10000
+
+/**
+ * Turn a schema whose fetch by id failed with `errstr` into a negative
+ * cache entry, if "schema.cache.negative.ttl.ms" is enabled or the fetch
+ * is `speculative`, and the registry reported the schema as unknown
+ * (4xx response).
+ * Other failures (connection errors, server errors) may be transient
+ * and are not cached.
+ *
+ * Returns 1 if `ss` is now a negative entry, else 0.
+ */
+static int serdes_schema_set_negative (serdes_schema_t *ss,
+                                       const char *errstr, int speculative) {
+        serdes_t *sd = ss->ss_sd;
+        int ttl_ms = sd->sd_conf.negative_ttl_ms;
+
+        if (ttl_ms == 0 && speculative)
+                ttl_ms = SERDES_SPECULATIVE_NEGATIVE_TTL_MS;
+
+        if (ttl_ms == 0 || ss->ss_id == -1 ||
+            ss->ss_errcode < 400 || ss->ss_errcode > 499)
+                return 0;
+
+        DBG(sd, "NEGATIVE",
+            "Caching failed %slookup of schema id %d (HTTP %ld) for %dms: %s",
+            speculative ? "speculative " : "",
+            ss->ss_id, ss->ss_errcode, ttl_ms, errstr);
+
+        ss->ss_errstr      = strdup(errstr);
+        ss->ss_ts_expiry   = serdes_clock() + ((int64_t)ttl_ms * 1000);
+        ss->ss_speculative = speculative;
+
+        return 1;
+}
+
+
+/**
+ * Returns true if `ss` is a negative cache entry that a lookup must not
+ * use: it has expired, or it was cached by a speculative prefetch (the id
+ * may have been registered since, a message using it was just read).
+ */
+static __inline int serdes_schema_negative_stale (const serdes_schema_t *ss) {
+        return ss->ss_errstr &&
+                (ss->ss_speculative || serdes_clock() >= ss->ss_ts_expiry);
+}
+
+
+/**
+ * Load schema by id from the shared memory segment or
+ * the persistent cache file, in that order.
+ *
+ * Returns 0 on success or -1 if the schema is not cached locally
+ * (or fails to load).
+ */
+static int serdes_schema_local_load (serdes_schema_t *ss) {
+        serdes_t *sd = ss->ss_sd;
+        char *name, *definition;
+        int definition_len;
+        char errstr[256];
+        const char *fac;
+
+        if (sd->sd_shm &&
+            schema_shm_get(sd->sd_shm, ss->ss_id,
+                           &name, &definition, &definition_len))
+                fac = "CACHESHM";
+        else if (sd->sd_file &&
+                 schema_file_get(sd->sd_file, ss->ss_id,
+                                 &name, &definition, &definition_len))
+                fac = "CACHEFILE";
+        else
+                return -1;
+
+        if (serdes_schema_load(ss, definition, definition_len,
+                               errstr, sizeof(errstr)) == -1) {
+                serdes_log(sd, LOG_WARNING, fac,
+                           "Failed to load cached schema %d: %s",
+                           ss->ss_id, errstr);
+                if (name)
+                        free(name);
+                free(definition);
+                return -1;
+        }
+
+        if (!ss->ss_name) {
+                ss->ss_name = name;
+                name = NULL;
+        }
+
+        if (name)
+                free(name);
+        free(definition);
+
+        DBG(sd, fac, "Loaded schema %s (%d) from local cache",
+            ss->ss_name ? ss->ss_name : "(unknown-name)", ss->ss_id);
+
+        return 0;
+}
+
+
+/**
+ * Allocate a new (unlinked, unloaded) schema.
+ */
+static serdes_schema_t *serdes_schema_alloc (serdes_t *sd,
+                                             const char *name, int id) {
+        serdes_schema_t *ss;
+
+        ss = calloc(1, sizeof(*ss));
+        ss->ss_id = id;
+        ss->ss_sd = sd;
+        ss->ss_refcnt = 1; /* Caller's reference, becomes the cache's
+                            * reference when linked. */
+
+        if (name)
+                ss->ss_name = strdup(name);
+
+        return ss;
+}
+
+
+/**
+ * Add a loaded schema to the shared memory segment and the persistent
+ * cache file, if configured.
+ */
+static void serdes_schema_local_put (serdes_schema_t *ss) {
+        serdes_t *sd = ss->ss_sd;
+
+        if (sd->sd_shm)
+                schema_shm_put(sd->sd_shm, ss->ss_id, ss->ss_name,
+                               ss->ss_definition, ss->ss_definition_len,
+                               ss->ss_fingerprint);
+
+        if (sd->sd_file)
+                schema_file_put(sd->sd_file, ss->ss_id, ss->ss_name,
+                                ss->ss_definition, ss->ss_definition_len,
+                                ss->ss_fingerprint);
+}
+
+
+/**
+ * Creates a new (unlinked) schema and loads it from `definition`,
+ * storing it at the schema registry if no `id` is provided,
+ * or fetches and loads it from the schema registry if there is
+ * no `definition`.
+ *
+ * If a schema object is returned it is guaranteed to be fully loaded
+ * and usable, if the load fails NULL is returned and the error is set
+ * in 'errstr'.
+ * A failed fetch by id may return a negative entry instead (`ss_errstr`
+ * set), see serdes_schema_set_negative().
+ *
+ * This is a blocking call.
+ *
+ * Locks: no shard lock nor sd_lock may be held.
+ */
+static serdes_schema_t *serdes_schema_resolve (serdes_t *sd,
+                                               const char *name, int id,
+                                               const void *definition,
+                                               int definition_len,
+                                               char *errstr, int errstr_size) {
+
+        serdes_schema_t *ss;
+
+        ss = serdes_schema_alloc(sd, name, id);
+
+        if (definition) {
                 if (serdes_schema_load(ss, definition, definition_len,
                                        errstr, errstr_size) == -1) {
                         serdes_schema_destroy0(ss);
                         return NULL;
                 }
 
+                /* Another process may already have registered it. */
+                if (ss->ss_id == -1 && sd->sd_shm && ss->ss_name)
+                        ss->ss_id = schema_shm_find(sd->sd_shm, ss->ss_name,
+                                                    ss->ss_definition,
+                                                    ss->ss_definition_len,
+                                                    ss->ss_fingerprint);
+
                 if (ss->ss_id == -1) {
                         if (serdes_schema_store(ss, errstr, errstr_size) == -1) {
                                 serdes_schema_destroy0(ss);
@@ -368,101 +1045,730 @@ static serdes_schema_t *serdes_schema_add0 (serdes_t *sd,
                         }
                 }
 
+        } else if (id != -1 && serdes_schema_local_load(ss) == 0) {
+                /* Loaded from shared memory or persistent cache file,
+                 * copied to the other one below. */
+
         } else {
                 /* Fetch schema from registry, if any. */
                 if (serdes_schema_fetch(ss, errstr, errstr_size) == -1) {
+                        if (serdes_schema_set_negative(ss, errstr,
+                                                       0/*not speculative*/))
+                                return ss;
                         serdes_schema_destroy0(ss);
                         return NULL;
                 }
         }
 
-        mtx_init(&ss->ss_lock, mtx_plain);
+        serdes_schema_local_put(ss);
+
+        return ss;
+}
+
+
+/**
+ * Index `definition` as an alias of cached schema `ss`, unless it is
+ * the schema's definition, so that adding the same definition again
+ * finds `ss` rather than registering it again.
+ *
+ * Locks: the schema's shard lock and sd_lock MUST be held.
+ */
+static void serdes_schema_alias0 (serdes_schema_t *ss,
+                                  const char *definition, int definition_len,
+                                  uint64_t fp) {
+        serdes_t *sd = ss->ss_sd;
+        serdes_alias_t *sa;
+
+        if (ss->ss_definition_len == definition_len &&
+            !memcmp(ss->ss_definition, definition, definition_len))
+                return;
+
+        for (sa = ss->ss_aliases ; sa ; sa = sa->sa_next)
+                if (sa->sa_definition_len == definition_len &&
+                    !memcmp(sa->sa_definition, definition, definition_len))
+                        return; /* Already aliased */
+
+        sa = malloc(sizeof(*sa) + definition_len);
+        sa->sa_fingerprint = fp;
+        sa->sa_definition_len = definition_len;
+        memcpy(sa->sa_definition, definition, definition_len);
+        sa->sa_next = ss->ss_aliases;
+
+        /* Publish to lock-free readers, see
+         * serdes_schema_find_by_definition(). */
+        __atomic_store_n(&ss->ss_aliases, sa, __ATOMIC_RELEASE);
+        hashidx_insert(&sd->sd_schemas_by_fp, fp, ss);
+}
+
 
-        LIST_INSERT_HEAD(&sd->sd_schemas, ss, ss_link);
+/**
+ * Adds a resolved schema to its shard of the cache.
+ *
+ * If a schema with the same id is already cached (e.g., a subject's
+ * latest schema was previously fetched by id) the new schema is destroyed
+ * and the cached schema is returned instead, unless the cached schema
+ * is a negative entry which is replaced.
+ *
+ * Locks: the shard lock of `sh`, the schema's shard, MUST be held,
+ *        sd_lock MUST NOT be held.
+ */
+static serdes_schema_t *serdes_schema_link0 (serdes_t *sd, serdes_shard_t *sh,
+                                             serdes_schema_t *ss) {
+        serdes_schema_t *ss2;
+
+        if ((ss2 = serdes_schema_find_by_id(sd, ss->ss_id))) {
+                if (!ss2->ss_errstr || ss->ss_errstr) {
+                        serdes_schema_destroy0(ss);
+                        return ss2;
+                }
+
+                serdes_schema_destroy0(ss2);
+        }
+
+        /* Count linking as a use: schemas that were not looked up
+         * (speculatively prefetched, loaded from the local schema cache)
+         * are otherwise purged on the next serdes_schemas_purge(). */
+        ss->ss_t_last_used = serdes_clock_coarse();
+
+        TAILQ_INSERT_HEAD(&sh->sh_schemas, ss, ss_link);
+        ss->ss_bytes = serdes_schema_size(ss);
+        sh->sh_schema_cnt++;
+        serdes_purgeq_insert0(sh, ss);
+        sh->sh_schema_bytes += ss->ss_bytes;
+        hashidx_insert(&sh->sh_schemas_by_id, (uint64_t)ss->ss_id, ss);
+        if (ss->ss_definition) {
+                mtx_lock(&sd->sd_lock);
+                hashidx_insert(&sd->sd_schemas_by_fp, ss->ss_fingerprint, ss);
+                mtx_unlock(&sd->sd_lock);
+        }
         ss->ss_linked = 1;
 
+        if (serdes_conf_pinned_id(sd, ss->ss_id))
+                serdes_schema_pin(ss);
+
         return ss;
 }
 
 
-static serdes_schema_t *serdes_schema_find_by_id (serdes_t *sd, int id,
-                                                  int do_lock) {
+/**
+ * Evict least recently used schemas until shard `sh` is within its share
+ * of the configured "schema.cache.max.count" and "schema.cache.max.bytes".
+ *
+ * This is a second-chance (CLOCK) approximation of LRU: schemas are
+ * evicted from the tail of sh_schemas, unless they have been used since
+ * they were last considered, in which case they are moved to the head.
+ * `keep` (the schema just added), pinned schemas and at least one schema
+ * are never evicted.
+ *
+ * Locks: the shard lock of `sh` MUST be held.
+ */
+static void serdes_schemas_evict0 (serdes_t *sd, serdes_shard_t *sh,
+                                   serdes_schema_t *keep) {
+        const struct serdes_conf_s *conf = &sd->sd_conf;
+        int max_count = (conf->max_count + sd->sd_shard_cnt - 1) /
+                sd->sd_shard_cnt;
+        int64_t max_bytes = (conf->max_bytes + sd->sd_shard_cnt - 1) /
+                sd->sd_shard_cnt;
+        int chances = sh->sh_schema_cnt;
+        int skipped = 0;
         serdes_schema_t *ss;
 
-        if (do_lock)
+        while (sh->sh_schema_cnt > 1 &&
+               ((max_count > 0 && sh->sh_schema_cnt > max_count) ||
+                (max_bytes > 0 && sh->sh_schema_bytes > max_bytes))) {
+                ss = TAILQ_LAST(&sh->sh_schemas, serdes_schema_head);
+
+                if (ss == keep ||
+                    __atomic_load_n(&ss->ss_pinned, __ATOMIC_RELAXED) > 0) {
+                        /* Stop once all remaining schemas are exempt. */
+                        if (++skipped > sh->sh_schema_cnt)
+                                break;
+                        TAILQ_REMOVE(&sh->sh_schemas, ss, ss_link);
+                        TAILQ_INSERT_HEAD(&sh->sh_schemas, ss, ss_link);
+                        continue;
+                }
+
+                /* Give recently used schemas a second chance, but bound
+                 * the passes since lookups may keep flagging schemas. */
+                if (chances > 0 &&
+                    __atomic_exchange_n(&ss->ss_lru_ref, 0,
+                                        __ATOMIC_RELAXED)) {
+                        TAILQ_REMOVE(&sh->sh_schemas, ss, ss_link);
+                        TAILQ_INSERT_HEAD(&sh->sh_schemas, ss, ss_link);
+                        chances--;
+                        continue;
+                }
+
+                DBG(sd, "EVICT", "Evicting schema %s (%d) from shard "
+                    "of %d schemas, %"PRId64" bytes",
+                    ss->ss_name ? ss->ss_name : "(unknown-name)",
+                    ss->ss_id, sh->sh_schema_cnt, sh->sh_schema_bytes);
+
+                serdes_schema_destroy0(ss);
+        }
+}
+
+
+/**
+ * Add resolved schema `ss` to the cache, as the latest schema of
+ * subject `latest_name` unless NULL, and evict schemas from its shard
+ * as needed.
+ *
+ * `definition` (unless NULL) is the added definition that `ss` was
+ * resolved from: the cached schema may have another definition, e.g.,
+ * when the registry returned the id of a schema already cached by id,
+ * in which case `definition` is indexed as an alias of it.
+ *
+ * Returns the cached schema, see serdes_schema_link0(), which the
+ * caller may only use from a read-side (EBR) section.
+ *
+ * Locks: no shard lock nor sd_lock may be held.
+ */
+static serdes_schema_t *serdes_schema_cache (serdes_t *sd,
+                                             serdes_schema_t *ss,
+                                             const char *latest_name,
+                                             const char *definition,
+                                             int definition_len,
+                                             uint64_t fp) {
+        serdes_shard_t *sh = serdes_shard(sd, (uint64_t)ss->ss_id);
+
+        mtx_lock(&sh->sh_lock);
+        ss = serdes_schema_link0(sd, sh, ss);
+        if (latest_name) {
                 mtx_lock(&sd->sd_lock);
-        LIST_FOREACH(ss, &sd->sd_schemas, ss_link)
-                if (ss->ss_id == id)
-                        break;
-        if (do_lock)
+                serdes_schema_set_latest0(ss, latest_name);
+                mtx_unlock(&sd->sd_lock);
+        }
+        if (definition && !ss->ss_errstr) {
+                mtx_lock(&sd->sd_lock);
+                serdes_schema_alias0(ss, definition, definition_len, fp);
                 mtx_unlock(&sd->sd_lock);
+        }
+        serdes_schemas_evict0(sd, sh, ss);
+        mtx_unlock(&sh->sh_lock);
 
         return ss;
 }
 
+
+/**
+ * Find cached schema by definition.
+ *
+ * Locks: the caller must be in a read-side (EBR) section.
+ */
 static serdes_schema_t *
 serdes_schema_find_by_definition (serdes_t *sd,
                                   const char *definition, int definition_len,
-                                  int do_lock) {
+                                  uint64_t fp) {
         serdes_schema_t *ss;
+        const serdes_alias_t *sa;
+        size_t pos = 0;
 
-        if (do_lock)
-                mtx_lock(&sd->sd_lock);
-        LIST_FOREACH(ss, &sd->sd_schemas, ss_link) {
+        /* Confirm the (unlikely) fingerprint collisions with
+         * a full compare, of the schema's definition or its aliases. */
+        while ((ss = hashidx_find(&sd->sd_schemas_by_fp, fp, &pos))) {
                 if (ss->ss_definition_len == definition_len &&
                     !memcmp(ss->ss_definition, definition, definition_len))
                         break;
+
+                for (sa = __atomic_load_n(&ss->ss_aliases, __ATOMIC_ACQUIRE) ;
+                     sa ; sa = sa->sa_next)
+                        if (sa->sa_definition_len == definition_len &&
+                            !memcmp(sa->sa_definition, definition,
+                                    definition_len))
+                                return ss;
         }
-        if (do_lock)
-                mtx_unlock(&sd->sd_lock);
 
         return ss;
 }
 
-serdes_schema_t *serdes_schema_add (serdes_t *sd, const char *name, int id,
-                                    const void *definition, int definition_len,
-                                    char *errstr, int errstr_size) {
+/**
+ * Find the cached latest schema for subject `name`, unless its
+ * "schema.cache.latest.ttl.ms" has expired, in which case it is
+ * refetched from the registry and replaced once resolved.
+ *
+ * Locks: the caller must be in a read-side (EBR) section.
+ */
+static serdes_schema_t *serdes_schema_find_latest (serdes_t *sd,
+                                                   const char *name) {
+        serdes_subject_t *sj;
+
+        if (!(sj = serdes_subject_find(sd, name)))
+                return NULL;
+
+        if (sd->sd_conf.latest_ttl_ms > 0 &&
+            serdes_clock() -
+            __atomic_load_n(&sj->sj_ts_latest, __ATOMIC_RELAXED) >
+            (int64_t)sd->sd_conf.latest_ttl_ms * 1000)
+                return NULL; /* Expired */
+
+        return sj->sj_ss;
+}
+
+
+
+/**
+ * Thread-local direct-mapped cache (L1) of schema ids in front of
+ * the shards' sh_schemas_by_id, enabled by "schema.cache.thread.size".
+ *
+ * The entries are shared by all handles used by the thread: an entry
+ * is only valid for a handle if it was created with the handle's
+ * current sd_gen, which is bumped when a schema is removed from the cache.
+ */
+#define SERDES_L1_SIZE_MAX 256
+
+struct serdes_l1_entry {
+        serdes_t        *sd;
+        uint64_t         gen;
         serdes_schema_t *ss;
+        int              id;
+};
 
-        if (definition && definition_len == -1)
-                definition_len = strlen(definition);
+static _Thread_local struct serdes_l1_entry *serdes_l1;
+static once_flag serdes_l1_init_once = ONCE_FLAG_INIT;
+static tss_t serdes_l1_tss;
 
-        mtx_lock(&sd->sd_lock);
-        if (!(ss = serdes_schema_find_by_definition(sd, definition,
-                                                    definition_len,
-                                                    0/*no-lock*/)))
-                ss = serdes_schema_add0(sd, name, id,
-                                        definition, definition_len,
-                                        errstr, errstr_size);
-        mtx_unlock(&sd->sd_lock);
+static void serdes_l1_init_cb (void) {
+        /* Frees the thread's L1 array on thread exit. */
+        tss_create(&serdes_l1_tss, free);
+}
+
+/**
+ * Returns the calling thread's L1 entry for `id`.
+ */
+static __inline struct serdes_l1_entry *serdes_l1_entry (serdes_t *sd,
+                                                         int id) {
+        if (!serdes_l1) {
+                call_once(&serdes_l1_init_once, serdes_l1_init_cb);
+                serdes_l1 = calloc(SERDES_L1_SIZE_MAX, sizeof(*serdes_l1));
+                tss_set(serdes_l1_tss, serdes_l1);
+        }
+
+        return &serdes_l1[(unsigned int)id &
+                          (sd->sd_conf.thread_cache_size - 1)];
+}
+
+
+void serdes_gen_bump (serdes_t *sd) {
+        static uint64_t serdes_gen_global;
+
+        __atomic_store_n(&sd->sd_gen,
+                         __atomic_add_fetch(&serdes_gen_global, 1,
+                                            __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Lock-free lookup of a cached schema by id, this is the per-message
+ * path of serdes_framing_read().
+ *
+ * Locks: the caller must be in a read-side (EBR) section.
+ */
+static serdes_schema_t *serdes_schema_find_by_id_lockfree (serdes_t *sd,
+                                                           int id) {
+        struct serdes_l1_entry *l1 = NULL;
+        serdes_schema_t *ss;
+        uint64_t gen;
+
+        /* Read the generation before looking up the schema: an entry
+         * added to the L1 is then invalidated by any removal that
+         * the lookup may have raced with. */
+        gen = __atomic_load_n(&sd->sd_gen, __ATOMIC_SEQ_CST);
+
+        if (sd->sd_conf.thread_cache_size > 0) {
+                l1 = serdes_l1_entry(sd, id);
+                if (l1->sd == sd && l1->gen == gen && l1->id == id)
+                        return l1->ss;
+        }
+
+        if ((ss = serdes_schema_find_by_id(sd, id)) && l1) {
+                l1->sd  = sd;
+                l1->gen = gen;
+                l1->ss  = ss;
+                l1->id  = id;
+        }
 
-        if (ss)
-                serdes_schema_mark_used(ss);
         return ss;
 }
 
 
+/**
+ * Lock-free lookup of a cached schema by `definition`, `id` or `name`
+ * (in that order of precedence).
+ *
+ * Locks: the caller must be in a read-side (EBR) section.
+ */
+static serdes_schema_t *serdes_schema_find (serdes_t *sd,
+                                            const char *name, int id,
+                                            const char *definition,
+                                            int definition_len, uint64_t fp) {
+        if (definition)
+                return serdes_schema_find_by_definition(sd, definition,
+                                                        definition_len, fp);
+        else if (id != -1)
+                return serdes_schema_find_by_id_lockfree(sd, id);
+        else
+                return serdes_schema_find_latest(sd, name);
+}
+
+
+/**
+ * In-flight registry request (fetch, or load and store) for a single
+ * cache key: a definition, an id or a subject name.
+ * Concurrent requests for the same key wait for the in-flight request
+ * to finish rather than issuing their own.
+ *
+ * Requests are tracked by the shard of their key, see serdes_shard().
+ * The key fields point to the requester's arguments which remain valid
+ * for as long as the request is on the sh_inflight list.
+ */
+struct serdes_inflight_s {
+        LIST_ENTRY(serdes_inflight_s) sif_link; /* sh_inflight list */
+        const char      *sif_definition;     /* Definition being added */
+        int              sif_definition_len;
+        uint64_t         sif_fp;             /* sif_definition fingerprint */
+        int              sif_id;             /* Schema id being fetched */
+        const char      *sif_name;           /* Subject being fetched */
+
+        cnd_t            sif_cnd;            /* Signalled when done */
+        int              sif_refcnt;         /* Requester + waiters */
+        int              sif_done;           /* Request finished */
+        serdes_schema_t *sif_ss;             /* Resolved schema (with a
+                                              * reference) or NULL */
+        char             sif_errstr[512];    /* Error string if !sif_ss */
+};
 
 
-serdes_schema_t *serdes_schema_get (serdes_t *sd, const char *name, int id,
-                                    char *errstr, int errstr_size) {
+/**
+ * Find in-flight request for the given key in the key's shard `sh`.
+ *
+ * Locks: the shard lock of `sh` MUST be held.
+ */
+static serdes_inflight_t *serdes_inflight_find0 (serdes_shard_t *sh,
+                                                 const char *name, int id,
+                                                 const char *definition,
+                                                 int definition_len,
+                                                 uint64_t fp) {
+        serdes_inflight_t *sif;
+
+        LIST_FOREACH(sif, &sh->sh_inflight, sif_link) {
+                if (definition) {
+                        if (sif->sif_definition &&
+                            sif->sif_fp == fp &&
+                            sif->sif_definition_len == definition_len &&
+                            !memcmp(sif->sif_definition, definition,
+                                    definition_len))
+                                break;
+                } else if (sif->sif_definition) {
+                        continue;
+                } else if (id != -1) {
+                        if (sif->sif_id == id)
+                                break;
+                } else if (sif->sif_id == -1 &&
+                           !strcmp(sif->sif_name, name))
+                        break;
+        }
+
+        return sif;
+}
+
+
+/**
+ * Create and link a new in-flight request for the given key
+ * in the key's shard `sh`.
+ *
+ * Locks: the shard lock of `sh` MUST be held.
+ */
+static serdes_inflight_t *serdes_inflight_new0 (serdes_shard_t *sh,
+                                                const char *name, int id,
+                                                const char *definition,
+                                                int definition_len,
+                                                uint64_t fp) {
+        serdes_inflight_t *sif;
+
+        sif = calloc(1, sizeof(*sif));
+        sif->sif_definition     = definition;
+        sif->sif_definition_len = definition_len;
+        sif->sif_fp             = fp;
+        sif->sif_id             = id;
+        sif->sif_name           = name;
+        sif->sif_refcnt         = 1;
+        cnd_init(&sif->sif_cnd);
+
+        LIST_INSERT_HEAD(&sh->sh_inflight, sif, sif_link);
+
+        return sif;
+}
+
+
+/**
+ * Drop a reference to an in-flight request, freeing it on last reference.
+ *
+ * Locks: the request's shard lock MUST be held.
+ */
+static void serdes_inflight_unref0 (serdes_inflight_t *sif) {
+        if (--sif->sif_refcnt > 0)
+                return;
+
+        if (sif->sif_ss)
+                serdes_schema_release(sif->sif_ss);
+        cnd_destroy(&sif->sif_cnd);
+        free(sif);
+}
+
+
+/**
+ * Wait for in-flight request to finish and return its result,
+ * with a reference for the caller: the schema may already have been
+ * evicted from the cache by the time the waiter wakes up.
+ * On failure NULL is returned and the request's error is written
+ * to `errstr`.
+ *
+ * Locks: the shard lock of `sh` MUST be held, it is released
+ *        while waiting.
+ */
+static serdes_schema_t *serdes_inflight_wait0 (serdes_shard_t *sh,
+                                               serdes_inflight_t *sif,
+                                               char *errstr, int errstr_size) {
         serdes_schema_t *ss;
 
-        mtx_lock(&sd->sd_lock);
-        if ((ss = serdes_schema_find_by_id(sd, id, 0/*no-lock*/))) {
-                mtx_unlock(&sd->sd_lock);
+        sif->sif_refcnt++;
+        while (!sif->sif_done)
+                cnd_wait(&sif->sif_cnd, &sh->sh_lock);
+
+        if ((ss = sif->sif_ss))
+                serdes_schema_keep(ss);
+        else
+                snprintf(errstr, errstr_size, "%s", sif->sif_errstr);
+
+        serdes_inflight_unref0(sif);
+
+        return ss;
+}
+
+
+/**
+ * Finish an in-flight request with the resolved schema `ss`, or
+ * with the error in `errstr` if `ss` is NULL, and wake up any waiters.
+ * The request acquires a reference to `ss` for its waiters, the caller
+ * must be in a read-side (EBR) section.
+ *
+ * Locks: the shard lock of `sh` MUST be held.
+ */
+static void serdes_inflight_done0 (serdes_shard_t *sh, serdes_inflight_t *sif,
+                                   serdes_schema_t *ss, const char *errstr) {
+        LIST_REMOVE(sif, sif_link);
+
+        if (ss)
+                serdes_schema_keep(ss);
+        sif->sif_ss   = ss;
+        if (!ss)
+                snprintf(sif->sif_errstr, sizeof(sif->sif_errstr),
+                         "%s", errstr);
+        sif->sif_done = 1;
+        cnd_broadcast(&sif->sif_cnd);
+
+        serdes_inflight_unref0(sif);
+}
+
+
+/**
+ * serdes_schema_get0() speculation modes.
+ */
+#define SERDES_SPEC_NONE    0  /* Plain lookup */
+#define SERDES_SPEC_MISS    1  /* Prefetch the following ids if the id
+                                * had to be fetched */
+
+static void serdes_prefetch_speculate (serdes_t *sd, int id);
+
+
+/**
+ * Common implementation of serdes_schema_add() and serdes_schema_get():
+ * look up the schema in the cache by `definition`, `id` or `name`
+ * (in that order of precedence), else resolve and cache it.
+ *
+ * Cached schemas are found without locking. On a miss concurrent
+ * requests for the same key share a single in-flight request, tracked
+ * by the key's shard. Registry I/O is performed without holding any lock.
+ *
+ * If `do_ref` is set a reference is acquired for the caller on the
+ * returned schema, which must be released with serdes_schema_release().
+ *
+ * `spec` is one of SERDES_SPEC_..
+ */
+static serdes_schema_t *serdes_schema_get0 (serdes_t *sd,
+                                            const char *name, int id,
+                                            const char *definition,
+                                            int definition_len, int do_ref,
+                                            int spec,
+                                            char *errstr, int errstr_size) {
+        serdes_shard_t *sh = NULL;
+        serdes_schema_t *ss, *ss_waited = NULL;
+        serdes_inflight_t *sif;
+        uint64_t fp = 0, key;
+        int token, speculate = 0;
+
+        sd = serdes_cache_sd(sd);
+
+        if (id == -1 && !name) {
+                snprintf(errstr, errstr_size,
+                         "Schema name or ID required");
+                return NULL;
+        }
+
+        if (definition) {
+                if (!name) {
+                        snprintf(errstr, errstr_size, "Schema name required");
+                        return NULL;
+                }
+
+                fp = serdes_fingerprint64(definition, definition_len);
+        }
+
+        /* The read-side section keeps the schema from being freed
+         * by a concurrent eviction or purge until we are done with it. */
+        token = ebr_enter(&sd->sd_ebr);
+
+        ss = serdes_schema_find(sd, name, id, definition, definition_len, fp);
+
+        if (!ss || serdes_schema_negative_stale(ss)) {
+                if (definition)
+                        key = fp;
+                else if (id != -1)
+                        key = (uint64_t)id;
+                else
+                        key = serdes_schema_name_key(name);
+                sh = serdes_shard(sd, key);
+
+                mtx_lock(&sh->sh_lock);
+
+                /* Look up again now that in-flight requests for the
+                 * key can't finish behind our back. */
+                ss = serdes_schema_find(sd, name, id,
+                                        definition, definition_len, fp);
+
+                if (ss && serdes_schema_negative_stale(ss)) {
+                        /* Expired or speculative negative entry (by id,
+                         * thus in this shard): refetch from registry */
+                        serdes_schema_destroy0(ss);
+                        ss = NULL;
+                }
+
+                if (!ss) {
+                        if ((sif = serdes_inflight_find0(sh, name, id,
+                                                         definition,
+                                                         definition_len,
+                                                         fp))) {
+                                /* Wait for the in-flight request, which
+                                 * hands us a reference: don't hold up
+                                 * reclamation during its registry I/O. */
+                                ebr_leave(&sd->sd_ebr, token);
+                                ss = ss_waited =
+                                        serdes_inflight_wait0(sh, sif, errstr,
+                                                              errstr_size);
+                                token = ebr_enter(&sd->sd_ebr);
+
+                        } else {
+                                sif = serdes_inflight_new0(sh, name, id,
+                                                           definition,
+                                                           definition_len,
+                                                           fp);
+                                mtx_unlock(&sh->sh_lock);
+
+                                /* Don't hold up reclamation
+                                 * during registry I/O. */
+                                ebr_leave(&sd->sd_ebr, token);
+
+                                ss = serdes_schema_resolve(sd, name, id,
+                                                           definition,
+                                                           definition_len,
+                                                           errstr,
+                                                           errstr_size);
+
+                                token = ebr_enter(&sd->sd_ebr);
+                                if (ss)
+                                        ss = serdes_schema_cache(
+                                                sd, ss,
+                                                !definition && id == -1 ?
+                                                name : NULL,
+                                                definition, definition_len,
+                                                fp);
+
+                                /* The id was not cached: the following
+                                 * ids are likely to be next. */
+                                speculate = spec == SERDES_SPEC_MISS &&
+                                        ss && !ss->ss_errstr;
+
+                                mtx_lock(&sh->sh_lock);
+                                serdes_inflight_done0(sh, sif, ss, errstr);
+                        }
+                }
+
+                mtx_unlock(&sh->sh_lock);
+        }
+
+        if (ss) {
                 serdes_schema_mark_used(ss);
-                return ss;
+
+                if (ss->ss_errstr) {
+                        /* Negative entry: fail with the cached error */
+                        snprintf(errstr, errstr_size, "%s", ss->ss_errstr);
+                        ss = NULL;
+                } else if (do_ref)
+                        serdes_schema_keep(ss);
         }
 
-        ss = serdes_schema_add0(sd, name, id, NULL, 0,
-                                errstr, errstr_size);
-        mtx_unlock(&sd->sd_lock);
+        ebr_leave(&sd->sd_ebr, token);
+
+        if (ss_waited)
+                serdes_schema_release(ss_waited);
+
+        /* Free schemas and index tables replaced by the insert, if any. */
+        if (sh)
+                ebr_reclaim(&sd->sd_ebr);
+
+        if (speculate)
+                serdes_prefetch_speculate(sd, id);
 
         return ss; /* May be NULL */
 }
 
 
+serdes_schema_t *serdes_schema_add (serdes_t *sd, const char *name, int id,
+                                    const void *definition, int definition_len,
+                                    char *errstr, int errstr_size) {
+
+        if (definition && definition_len == -1)
+                definition_len = strlen(definition);
+
+        return serdes_schema_get0(sd, name, id, definition, definition_len,
+                                  0/*borrowed*/, SERDES_SPEC_NONE,
+                                  errstr, errstr_size);
+}
+
+
+serdes_schema_t *serdes_schema_get (serdes_t *sd, const char *name, int id,
+                                    char *errstr, int errstr_size) {
+        return serdes_schema_get0(sd, name, id, NULL, 0, 0/*borrowed*/,
+                                  SERDES_SPEC_NONE, errstr, errstr_size);
+}
+
+
+serdes_schema_t *serdes_schema_acquire (serdes_t *sd, const char *name, int id,
+                                        char *errstr, int errstr_size) {
+        return serdes_schema_get0(sd, name, id, NULL, 0, 1/*ref*/,
+                                  SERDES_SPEC_NONE, errstr, errstr_size);
+}
+
+
+serdes_schema_t *serdes_schema_get_framed (serdes_t *sd, int id, int do_ref,
+                                           char *errstr, int errstr_size) {
+        return serdes_schema_get0(sd, NULL, id, NULL, 0, do_ref,
+                                  SERDES_SPEC_MISS, errstr, errstr_size);
+}
+
+
 int serdes_schema_id (serdes_schema_t *schema) {
         return schema->ss_id;
 }
@@ -486,28 +1792,676 @@ serdes_t *serdes_schema_handle (serdes_schema_t *schema) {
 
 
 
-int serdes_schemas_purge (serdes_t *serdes, int max_age) {
-        serdes_schema_t *next, *ss;
-        time_t expiry = time(NULL) - max_age;
-        int cnt = 0;
+/**
+ * Shared state of a serdes_schemas_prefetch() call and its worker threads.
+ * The lookup keys are copied since workers may outlive a timed out call.
+ */
+typedef struct serdes_prefetch_s {
+        serdes_t  *sp_sd;
+        int       *sp_ids;
+        int        sp_id_cnt;
+        char     **sp_subjects;
+        int        sp_subject_cnt;
+
+        int        sp_next;        /* Next lookup to perform (atomic) */
+        int        sp_abort;       /* Call timed out, stop (atomic) */
+
+        mtx_t      sp_lock;        /* Protects below fields */
+        cnd_t      sp_cnd;         /* Signalled when all lookups are done */
+        int        sp_done;        /* Finished lookups */
+        int        sp_loaded;      /* Successful lookups */
+        int        sp_refcnt;      /* Caller + workers */
+} serdes_prefetch_t;
+
+
+static serdes_prefetch_t *serdes_prefetch_new (serdes_t *sd) {
+        serdes_prefetch_t *sp;
+
+        sp = calloc(1, sizeof(*sp));
+        sp->sp_sd = sd;
+        mtx_init(&sp->sp_lock, mtx_plain);
+        cnd_init(&sp->sp_cnd);
+        sp->sp_refcnt = 1;
+
+        return sp;
+}
+
+
+static void serdes_prefetch_unref (serdes_prefetch_t *sp) {
+        int i;
+
+        mtx_lock(&sp->sp_lock);
+        if (--sp->sp_refcnt > 0) {
+                mtx_unlock(&sp->sp_lock);
+                return;
+        }
+        mtx_unlock(&sp->sp_lock);
+
+        for (i = 0 ; i < sp->sp_subject_cnt ; i++)
+                free(sp->sp_subjects[i]);
+        free(sp->sp_subjects);
+        free(sp->sp_ids);
+        cnd_destroy(&sp->sp_cnd);
+        mtx_destroy(&sp->sp_lock);
+        free(sp);
+}
+
+
+/**
+ * Prefetch worker: performs lookups until all are claimed,
+ * the call has timed out or the handle is being destroyed.
+ */
+static int serdes_prefetch_worker (void *arg) {
+        serdes_prefetch_t *sp = arg;
+        serdes_t *sd = sp->sp_sd;
+        int total = sp->sp_id_cnt + sp->sp_subject_cnt;
+        serdes_schema_t *ss;
+        char errstr[512];
+        int i;
+
+        while (!__atomic_load_n(&sp->sp_abort, __ATOMIC_RELAXED) &&
+               !__atomic_load_n(&sd->sd_terminate, __ATOMIC_RELAXED) &&
+               (i = __atomic_fetch_add(&sp->sp_next, 1,
+                                       __ATOMIC_RELAXED)) < total) {
+                if (i < sp->sp_id_cnt)
+                        ss = serdes_schema_get0(sd, NULL, sp->sp_ids[i],
+                                                NULL, 0, 0/*borrowed*/,
+                                                SERDES_SPEC_NONE,
+                                                errstr, sizeof(errstr));
+                else
+                        ss = serdes_schema_get0(sd,
+                                                sp->sp_subjects[i -
+                                                                sp->sp_id_cnt],
+                                                -1, NULL, 0, 0/*borrowed*/,
+                                                SERDES_SPEC_NONE,
+                                                errstr, sizeof(errstr));
+
+                if (!ss)
+                        DBG(sd, "PREFETCH", "Prefetch failed: %s", errstr);
+
+                mtx_lock(&sp->sp_lock);
+                sp->sp_done++;
+                if (ss)
+                        sp->sp_loaded++;
+                if (sp->sp_done == total)
+                        cnd_broadcast(&sp->sp_cnd);
+                mtx_unlock(&sp->sp_lock);
+        }
+
+        serdes_prefetch_unref(sp);
+
+        mtx_lock(&sd->sd_lock);
+        sd->sd_prefetch_workers--;
+        cnd_broadcast(&sd->sd_prefetch_cnd);
+        mtx_unlock(&sd->sd_lock);
+
+        return 0;
+}
+
+
+/**
+ * Prefetch worker thread, nobody joins it: serdes_destroy() waits
+ * for sd_prefetch_workers instead.
+ */
+static int serdes_prefetch_thread_main (void *arg) {
+        /* tinycthread requires the thread itself to detach
+         * for its exit value not to leak. */
+        thrd_detach(thrd_current());
+
+        return serdes_prefetch_worker(arg);
+}
+
+
+/**
+ * Start up to `thread_cnt` worker threads for `sp`.
+ *
+ * Returns the number of threads started.
+ */
+static int serdes_prefetch_start (serdes_prefetch_t *sp, int thread_cnt) {
+        serdes_t *sd = sp->sp_sd;
+        int i;
+
+        for (i = 0 ; i < thread_cnt ; i++) {
+                thrd_t thr;
+
+                mtx_lock(&sp->sp_lock);
+                sp->sp_refcnt++;
+                mtx_unlock(&sp->sp_lock);
+
+                mtx_lock(&sd->sd_lock);
+                sd->sd_prefetch_workers++;
+                mtx_unlock(&sd->sd_lock);
+
+                if (thrd_create(&thr, serdes_prefetch_thread_main, sp) !=
+                    thrd_success) {
+                        mtx_lock(&sd->sd_lock);
+                        sd->sd_prefetch_workers--;
+                        mtx_unlock(&sd->sd_lock);
+                        serdes_prefetch_unref(sp);
+                        break;
+                }
+        }
+
+        return i;
+}
+
+
+/**
+ * Finish the speculative prefetch of schema `id` with the resolved
+ * schema `ss` (possibly a negative entry), or NULL and `errstr`.
+ */
+static void serdes_prefetch_speculate_done (serdes_t *sd, int id,
+                                            serdes_schema_t *ss,
+                                            const char *errstr) {
+        serdes_shard_t *sh = serdes_shard(sd, (uint64_t)id);
+        int token;
+
+        token = ebr_enter(&sd->sd_ebr);
+
+        if (ss)
+                ss = serdes_schema_cache(sd, ss, NULL, NULL, 0, 0);
+        else
+                DBG(sd, "PREFETCH", "Speculative prefetch of schema %d "
+                    "failed: %s", id, errstr);
+
+        mtx_lock(&sh->sh_lock);
+        serdes_inflight_done0(sh, serdes_inflight_find0(sh, NULL, id,
+                                                        NULL, 0, 0),
+                              ss, errstr);
+        mtx_unlock(&sh->sh_lock);
+
+        ebr_leave(&sd->sd_ebr, token);
+        ebr_reclaim(&sd->sd_ebr);
+
+        __atomic_sub_fetch(&sd->sd_speculating, 1, __ATOMIC_RELEASE);
 
-        mtx_lock(&serdes->sd_lock);
-        next = LIST_FIRST(&serdes->sd_schemas);
-        while (next) {
-                ss = next;
-                next = LIST_NEXT(next, ss_link);
+        mtx_lock(&sd->sd_lock);
+        sd->sd_prefetch_workers--;
+        cnd_broadcast(&sd->sd_prefetch_cnd);
+        mtx_unlock(&sd->sd_lock);
+}
+
+
+/**
+ * Registry response to the speculative prefetch of schema `opaque`,
+ * called by the registry I/O thread.
+ */
+static void serdes_prefetch_speculate_cb (rest_response_t *rr, void *opaque) {
+        serdes_schema_t *ss = opaque;
+        serdes_t *sd = ss->ss_sd;
+        int id = ss->ss_id;
+        char errstr[512];
 
-                if (ss->ss_t_last_used < expiry) {
+        if (serdes_schema_fetch_read(ss, rr, errstr, sizeof(errstr)) == -1) {
+                if (!serdes_schema_set_negative(ss, errstr,
+                                                1/*speculative*/)) {
                         serdes_schema_destroy0(ss);
-                        cnt++;
+                        ss = NULL;
                 }
+        } else
+                serdes_schema_local_put(ss);
+
+        serdes_prefetch_speculate_done(sd, id, ss, errstr);
+}
+
+
+/**
+ * Fetch schema `id`, claimed by serdes_prefetch_speculate(), from the
+ * local schema cache files or queue its registry request.
+ *
+ * Returns -1 if the registry request could not be queued.
+ */
+static int serdes_prefetch_speculate_fetch (serdes_t *sd, int id) {
+        serdes_schema_t *ss;
+
+        ss = serdes_schema_alloc(sd, NULL, id);
+
+        if (serdes_schema_local_load(ss) == 0) {
+                serdes_schema_local_put(ss);
+                serdes_prefetch_speculate_done(sd, id, ss, NULL);
+                return 0;
+        }
+
+        if (rest_get_async(sd->sd_rest, &sd->sd_conf.schema_registry_urls,
+                           serdes_prefetch_speculate_cb, ss,
+                           "/schemas/ids/%d", id) == -1) {
+                serdes_schema_destroy0(ss);
+                serdes_prefetch_speculate_done(
+                        sd, id, NULL, "Schema registry request not queued");
+                return -1;
         }
-        mtx_unlock(&serdes->sd_lock);
+
+        return 0;
+}
+
+
+/**
+ * Speculative prefetch thread: loads or queues the ids claimed by
+ * serdes_prefetch_speculate(), off the lookup's thread since
+ * local cache file I/O is blocking. Nobody joins it.
+ */
+static int serdes_prefetch_speculate_main (void *arg) {
+        serdes_prefetch_t *sp = arg;
+        serdes_t *sd = sp->sp_sd;
+        int i, failed = 0;
+
+        thrd_detach(thrd_current());
+
+        for (i = 0 ; i < sp->sp_id_cnt ; i++) {
+                if (failed ||
+                    __atomic_load_n(&sd->sd_terminate, __ATOMIC_RELAXED))
+                        serdes_prefetch_speculate_done(
+                                sd, sp->sp_ids[i], NULL,
+                                "Speculative prefetch aborted");
+                else if (serdes_prefetch_speculate_fetch(sd,
+                                                         sp->sp_ids[i]) == -1)
+                        failed = 1;
+        }
+
+        serdes_prefetch_unref(sp);
+
+        mtx_lock(&sd->sd_lock);
+        sd->sd_prefetch_workers--;
+        cnd_broadcast(&sd->sd_prefetch_cnd);
+        mtx_unlock(&sd->sd_lock);
+
+        return 0;
+}
+
+
+/**
+ * Prefetch ids `id`+1..`id`+"schema.prefetch.window" in the background,
+ * unless a speculative prefetch is already in progress: registry ids are
+ * allocated sequentially and new schemas tend to show up in bursts.
+ *
+ * The ids are claimed here, as in-flight requests that lookups of the ids
+ * wait for, and handed to a prefetch thread that loads them from the
+ * local schema cache files or has them fetched concurrently by the
+ * registry I/O thread (see rest_get_async()).
+ * Ids that are not registered (yet) are negatively cached,
+ * see serdes_schema_set_negative(), so that subsequent misses don't
+ * prefetch them again until the negative entries expire.
+ */
+static void serdes_prefetch_speculate (serdes_t *sd, int id) {
+        int window = sd->sd_conf.prefetch_window;
+        serdes_prefetch_t *sp;
+        thrd_t thr;
+        int i, expected = 0;
+
+        if (window == 0 || sd->sd_conf.schema_registry_urls.cnt == 0 ||
+            !__atomic_compare_exchange_n(&sd->sd_speculating, &expected, 1,
+                                         0, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED))
+                return;
+
+        sp = serdes_prefetch_new(sd);
+        sp->sp_ids = malloc(sizeof(*sp->sp_ids) * window);
+
+        for (i = 1 ; i <= window && id <= INT_MAX - i ; i++) {
+                serdes_shard_t *sh = serdes_shard(sd, (uint64_t)(id + i));
+                serdes_schema_t *ss;
+
+                /* Skip ids that are already cached, or negatively cached
+                 * (until the entry expires), or being fetched. */
+                mtx_lock(&sh->sh_lock);
+                if ((ss = serdes_schema_find_by_id(sd, id + i)) &&
+                    ss->ss_errstr && serdes_clock() >= ss->ss_ts_expiry) {
+                        serdes_schema_destroy0(ss);
+                        ss = NULL;
+                }
+                if (ss ||
+                    serdes_inflight_find0(sh, NULL, id + i, NULL, 0, 0)) {
+                        mtx_unlock(&sh->sh_lock);
+                        continue;
+                }
+                serdes_inflight_new0(sh, NULL, id + i, NULL, 0, 0);
+                mtx_unlock(&sh->sh_lock);
+
+                __atomic_add_fetch(&sd->sd_speculating, 1, __ATOMIC_RELAXED);
+                mtx_lock(&sd->sd_lock);
+                sd->sd_prefetch_workers++;
+                mtx_unlock(&sd->sd_lock);
+
+                sp->sp_ids[sp->sp_id_cnt++] = id + i;
+        }
+
+        /* Expired negative entries destroyed above */
+        ebr_reclaim(&sd->sd_ebr);
+
+        if (sp->sp_id_cnt > 0) {
+                DBG(sd, "PREFETCH",
+                    "Speculatively prefetching %d schema id(s) following "
+                    "id %d", sp->sp_id_cnt, id);
+
+                mtx_lock(&sd->sd_lock);
+                sd->sd_prefetch_workers++;
+                mtx_unlock(&sd->sd_lock);
+
+                if (thrd_create(&thr, serdes_prefetch_speculate_main, sp) ==
+                    thrd_success)
+                        sp = NULL;
+                else {
+                        mtx_lock(&sd->sd_lock);
+                        sd->sd_prefetch_workers--;
+                        mtx_unlock(&sd->sd_lock);
+
+                        for (i = 0 ; i < sp->sp_id_cnt ; i++)
+                                serdes_prefetch_speculate_done(
+                                        sd, sp->sp_ids[i], NULL,
+                                        "Failed to start speculative "
+                                        "prefetch thread");
+                }
+        }
+
+        if (sp)
+                serdes_prefetch_unref(sp);
+
+        __atomic_sub_fetch(&sd->sd_speculating, 1, __ATOMIC_RELEASE);
+}
+
+
+int serdes_schemas_prefetch (serdes_t *sd,
+                             const int *ids, int id_cnt,
+                             const char **subjects, int subject_cnt,
+                             int timeout_ms) {
+        serdes_prefetch_t *sp;
+        int64_t abs_timeout = serdes_clock() + ((int64_t)timeout_ms * 1000);
+        int total = id_cnt + subject_cnt;
+        int i, loaded;
+
+        sd = serdes_cache_sd(sd);
+
+        if (total == 0)
+                return 0;
+
+        sp = serdes_prefetch_new(sd);
+        if (id_cnt > 0) {
+                sp->sp_ids = malloc(sizeof(*sp->sp_ids) * id_cnt);
+                memcpy(sp->sp_ids, ids, sizeof(*sp->sp_ids) * id_cnt);
+                sp->sp_id_cnt = id_cnt;
+        }
+        if (subject_cnt > 0) {
+                sp->sp_subjects = malloc(sizeof(*sp->sp_subjects) *
+                                         subject_cnt);
+                for (i = 0 ; i < subject_cnt ; i++)
+                        sp->sp_subjects[i] = strdup(subjects[i]);
+                sp->sp_subject_cnt = subject_cnt;
+        }
+
+        if (serdes_prefetch_start(sp, total <
+                                  sd->sd_conf.prefetch_concurrency ?
+                                  total :
+                                  sd->sd_conf.prefetch_concurrency) == 0) {
+                /* No worker thread: perform the lookups serially. */
+                sp->sp_refcnt++;
+                mtx_lock(&sd->sd_lock);
+                sd->sd_prefetch_workers++;
+                mtx_unlock(&sd->sd_lock);
+                serdes_prefetch_worker(sp);
+        }
+
+        mtx_lock(&sp->sp_lock);
+        while (sp->sp_done < total) {
+                int remains_ms = -1;
+
+                if (timeout_ms >= 0) {
+                        remains_ms = (int)((abs_timeout - serdes_clock()) /
+                                           1000);
+                        if (remains_ms <= 0)
+                                break;
+                }
+
+                if (remains_ms == -1)
+                        cnd_wait(&sp->sp_cnd, &sp->sp_lock);
+                else
+                        cnd_timedwait_ms(&sp->sp_cnd, &sp->sp_lock,
+                                         remains_ms);
+        }
+        loaded = sp->sp_loaded;
+        mtx_unlock(&sp->sp_lock);
+
+        /* Stop workers of a timed out call from starting new lookups. */
+        __atomic_store_n(&sp->sp_abort, 1, __ATOMIC_RELAXED);
+
+        serdes_prefetch_unref(sp);
+
+        return loaded;
+}
+
+
+/**
+ * Revalidate the cached latest schema of subject `name` with the
+ * schema registry. Lookups keep returning the cached schema without
+ * blocking until it is replaced by the new version, if any.
+ *
+ * Locks: sd_lock MUST NOT be held.
+ */
+static void serdes_schema_refresh_latest (serdes_t *sd, const char *name) {
+        serdes_shard_t *sh = serdes_shard(sd, serdes_schema_name_key(name));
+        serdes_inflight_t *sif;
+        serdes_schema_t *ss;
+        char errstr[512];
+        int token;
+
+        mtx_lock(&sh->sh_lock);
+        if (serdes_inflight_find0(sh, name, -1, NULL, 0, 0)) {
+                /* Already being fetched by a lookup */
+                mtx_unlock(&sh->sh_lock);
+                return;
+        }
+        sif = serdes_inflight_new0(sh, name, -1, NULL, 0, 0);
+        mtx_unlock(&sh->sh_lock);
+
+        ss = serdes_schema_resolve(sd, name, -1, NULL, 0,
+                                   errstr, sizeof(errstr));
+
+        token = ebr_enter(&sd->sd_ebr);
+
+        if (ss) {
+                /* Swap in the new version, or just renew the
+                 * cached one if unchanged. */
+                ss = serdes_schema_cache(sd, ss, name, NULL, 0, 0);
+        } else
+                serdes_log(sd, LOG_WARNING, "REFRESH",
+                           "Failed to refresh latest schema of "
+                           "subject %s: %s", name, errstr);
+
+        mtx_lock(&sh->sh_lock);
+        serdes_inflight_done0(sh, sif, ss, errstr);
+        mtx_unlock(&sh->sh_lock);
+
+        ebr_leave(&sd->sd_ebr, token);
+
+        ebr_reclaim(&sd->sd_ebr);
+}
+
+
+/**
+ * Background refresher thread: revalidates the cached latest schemas
+ * about every "schema.cache.latest.refresh.ms".
+ */
+static int serdes_refresh_main (void *arg) {
+        serdes_t *sd = arg;
+        int64_t interval = (int64_t)sd->sd_conf.latest_refresh_ms * 1000;
+
+        mtx_lock(&sd->sd_lock);
+        while (__atomic_load_n(&sd->sd_refresh_run, __ATOMIC_RELAXED)) {
+                serdes_schema_t *ss;
+                char **names = NULL;
+                int cnt = 0, size = 0, i;
+                int64_t now;
+
+                cnd_timedwait_ms(&sd->sd_refresh_cnd, &sd->sd_lock,
+                                 sd->sd_conf.latest_refresh_ms);
+                if (!__atomic_load_n(&sd->sd_refresh_run, __ATOMIC_RELAXED))
+                        break;
+                mtx_unlock(&sd->sd_lock);
+
+                /* Collect the subjects due for revalidation:
+                 * those not renewed in the last half interval. */
+                now = serdes_clock();
+                for (i = 0 ; i < sd->sd_shard_cnt ; i++) {
+                        serdes_shard_t *sh = &sd->sd_shards[i];
+
+                        mtx_lock(&sh->sh_lock);
+                        mtx_lock(&sd->sd_lock);
+                        TAILQ_FOREACH(ss, &sh->sh_schemas, ss_link) {
+                                serdes_subject_t *sj;
+
+                                LIST_FOREACH(sj, &ss->ss_subjects, sj_link) {
+                                        if (now - sj->sj_ts_latest <
+                                            interval / 2)
+                                                continue;
+
+                                        if (cnt == size) {
+                                                size = size ? size * 2 : 16;
+                                                names = realloc(
+                                                        names,
+                                                        sizeof(*names) *
+                                                        size);
+                                        }
+                                        names[cnt++] = strdup(sj->sj_name);
+                                }
+                        }
+                        mtx_unlock(&sd->sd_lock);
+                        mtx_unlock(&sh->sh_lock);
+                }
+
+                for (i = 0 ; i < cnt ; i++) {
+                        if (__atomic_load_n(&sd->sd_refresh_run,
+                                            __ATOMIC_RELAXED))
+                                serdes_schema_refresh_latest(sd, names[i]);
+                        free(names[i]);
+                }
+                if (names)
+                        free(names);
+
+                mtx_lock(&sd->sd_lock);
+        }
+        mtx_unlock(&sd->sd_lock);
+
+        return 0;
+}
+
+
+int serdes_refresh_start (serdes_t *sd, char *errstr, int errstr_size) {
+        __atomic_store_n(&sd->sd_refresh_run, 1, __ATOMIC_RELAXED);
+
+        if (thrd_create(&sd->sd_refresh_thrd, serdes_refresh_main, sd) !=
+            thrd_success) {
+                __atomic_store_n(&sd->sd_refresh_run, 0, __ATOMIC_RELAXED);
+                snprintf(errstr, errstr_size,
+                         "Failed to create schema refresh thread");
+                return -1;
+        }
+
+        return 0;
+}
+
+
+void serdes_refresh_stop (serdes_t *sd) {
+        mtx_lock(&sd->sd_lock);
+        if (!__atomic_load_n(&sd->sd_refresh_run, __ATOMIC_RELAXED)) {
+                mtx_unlock(&sd->sd_lock);
+                return;
+        }
+        __atomic_store_n(&sd->sd_refresh_run, 0, __ATOMIC_RELAXED);
+        cnd_signal(&sd->sd_refresh_cnd);
+        mtx_unlock(&sd->sd_lock);
+
+        thrd_join(sd->sd_refresh_thrd, NULL);
+}
+
+
+/**
+ * Max number of purge queue entries processed per shard lock hold.
+ */
+#define SERDES_PURGE_BATCH 256
+
+/**
+ * Max number of purge queue entries processed per shard and
+ * serdes_schemas_purge() call: the queue's head is where the next
+ * call resumes.
+ */
+#define SERDES_PURGE_BUDGET (16 * SERDES_PURGE_BATCH)
+
+int serdes_schemas_purge (serdes_t *serdes, int max_age) {
+        int64_t expiry = serdes_clock_coarse() - max_age;
+        int cnt = 0, i;
+
+        serdes = serdes_cache_sd(serdes);
+
+        /* One shard and one batch at a time, the lock is released
+         * between batches to let lookups and inserts through. */
+        for (i = 0 ; i < serdes->sd_shard_cnt ; i++) {
+                serdes_shard_t *sh = &serdes->sd_shards[i];
+                int budget = SERDES_PURGE_BUDGET;
+                int done = 0;
+
+                mtx_lock(&sh->sh_lock);
+                while (!done) {
+                        int batch;
+
+                        for (batch = 0 ; batch < SERDES_PURGE_BATCH ;
+                             batch++) {
+                                serdes_schema_t *ss;
+                                int64_t t;
+
+                                if (budget-- == 0 ||
+                                    sh->sh_schema_cnt == 0 ||
+                                    sh->sh_purgeq[0]->ss_t_purgeq >= expiry) {
+                                        done = 1;
+                                        break;
+                                }
+
+                                ss = sh->sh_purgeq[0];
+                                t = __atomic_load_n(&ss->ss_t_last_used,
+                                                    __ATOMIC_RELAXED);
+
+                                if (t < expiry &&
+                                    !__atomic_load_n(&ss->ss_pinned,
+                                                     __ATOMIC_RELAXED)) {
+                                        serdes_schema_destroy0(ss);
+                                        cnt++;
+                                } else {
+                                        /* Used since queued: re-queue by
+                                         * its last use.
+                                         * Pinned: re-queue past this
+                                         * purge's expiry, to be looked at
+                                         * again by later purges. */
+                                        ss->ss_t_purgeq = t < expiry ?
+                                                expiry : t;
+                                        serdes_purgeq_fix0(sh, 0);
+                                }
+                        }
+
+                        if (!done) {
+                                /* A plain unlock+lock would likely
+                                 * reacquire the lock before any
+                                 * waiter gets it. */
+                                mtx_unlock(&sh->sh_lock);
+                                thrd_yield();
+                                mtx_lock(&sh->sh_lock);
+                        }
+                }
+                mtx_unlock(&sh->sh_lock);
+        }
+
+        ebr_reclaim(&serdes->sd_ebr);
 
         return cnt;
 }
 
 
+void serdes_schema_pin (serdes_schema_t *schema) {
+        __atomic_add_fetch(&schema->ss_pinned, 1, __ATOMIC_RELAXED);
+}
+
+void serdes_schema_unpin (serdes_schema_t *schema) {
+        __atomic_sub_fetch(&schema->ss_pinned, 1, __ATOMIC_RELAXED);
+}
+
+
 void serdes_schema_set_opaque (serdes_schema_t *schema, void *opaque) {
         schema->ss_opaque = opaque;
 }
@@ -0,0 +1,417 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <jansson.h>
+
+#include "serdes_int.h"
+
+
+/**
+ * Avro schema canonical form.
+ *
+ * This is the Avro Parsing Canonical Form ("Schema Resolution" section
+ * of the Avro specification) applied to the JSON definition:
+ *  - [PRIMITIVES] `{"type":"int"}` is written as `"int"`,
+ *  - [FULLNAMES]  names of named types and references to them are
+ *                 replaced by their fullnames and `namespace` is dropped,
+ *  - [ORDER]      attributes are written in the order name, type, fields,
+ *                 symbols, items, values, size,
+ *  - [STRINGS], [INTEGERS], [WHITESPACE]: JSON is written compact with
+ *                 minimal escaping,
+ * with one exception: [STRIP] only strips `doc`, all other attributes
+ * (`default`, `aliases`, `logicalType`, `order`, custom properties..)
+ * are retained, sorted by name, after the attributes above.
+ * They are not part of the Parsing Canonical Form since they don't
+ * affect how data is written, but they do affect the parsed schema
+ * object (e.g., reader defaults), so schemas with the same canonical form
+ * may share a parsed schema object.
+ */
+
+
+typedef struct canon_buf_s {
+        char   *buf;
+        size_t  len;
+        size_t  size;
+} canon_buf_t;
+
+
+static void canon_write (canon_buf_t *cb, const char *s, size_t len) {
+        if (cb->len + len + 1 > cb->size) {
+                while (cb->len + len + 1 > cb->size)
+                        cb->size = cb->size ? cb->size * 2 : 256;
+                cb->buf = realloc(cb->buf, cb->size);
+        }
+
+        memcpy(cb->buf + cb->len, s, len);
+        cb->len += len;
+        cb->buf[cb->len] = '\0';
+}
+
+static __inline void canon_puts (canon_buf_t *cb, const char *s) {
+        canon_write(cb, s, strlen(s));
+}
+
+
+/**
+ * Write JSON string literal, only escaping what JSON requires.
+ */
+static void canon_write_string (canon_buf_t *cb, const char *s) {
+        const char *begin = s;
+
+        canon_puts(cb, "\"");
+
+        for ( ; *s ; s++) {
+                char esc[8];
+
+                if (*s != '"' && *s != '\\' && (unsigned char)*s >= 0x20)
+                        continue;
+
+                canon_write(cb, begin, (size_t)(s - begin));
+                begin = s + 1;
+
+                switch (*s)
+                {
+                case '"':
+                        canon_puts(cb, "\\\"");
+                        break;
+                case '\\':
+                        canon_puts(cb, "\\\\");
+                        break;
+                case '\b':
+                        canon_puts(cb, "\\b");
+                        break;
+                case '\f':
+                        canon_puts(cb, "\\f");
+                        break;
+                case '\n':
+                        canon_puts(cb, "\\n");
+                        break;
+                case '\r':
+                        canon_puts(cb, "\\r");
+                        break;
+                case '\t':
+                        canon_puts(cb, "\\t");
+                        break;
+                default:
+                        snprintf(esc, sizeof(esc), "\\u%04x",
+                                 (unsigned char)*s);
+                        canon_puts(cb, esc);
+                        break;
+                }
+        }
+
+        canon_write(cb, begin, (size_t)(s - begin));
+        canon_puts(cb, "\"");
+}
+
+
+/**
+ * Write any JSON value (default values, custom properties, ..)
+ * in compact form with sorted object keys.
+ */
+static int canon_write_value (canon_buf_t *cb, const json_t *value) {
+        char *str;
+
+        if (!(str = json_dumps(value, JSON_COMPACT|JSON_SORT_KEYS|
+                               JSON_ENCODE_ANY)))
+                return -1;
+
+        canon_puts(cb, str);
+        free(str);
+
+        return 0;
+}
+
+
+static int canon_is_primitive (const char *type) {
+        static const char *primitives[] = {
+                "null", "boolean", "int", "long", "float", "double",
+                "bytes", "string", NULL
+        };
+        int i;
+
+        for (i = 0 ; primitives[i] ; i++)
+                if (!strcmp(type, primitives[i]))
+                        return 1;
+
+        return 0;
+}
+
+static int canon_is_named (const char *type) {
+        return !strcmp(type, "record") || !strcmp(type, "error") ||
+                !strcmp(type, "enum") || !strcmp(type, "fixed");
+}
+
+static int canon_is_complex (const char *type) {
+        return canon_is_named(type) ||
+                !strcmp(type, "array") || !strcmp(type, "map");
+}
+
+
+/**
+ * Returns the fullname (free() when done) of `name` in namespace `ns`.
+ */
+static char *canon_fullname (const char *name, const char *ns) {
+        char *fullname;
+
+        if (strchr(name, '.') || !ns || !*ns)
+                return strdup(name);
+
+        fullname = malloc(strlen(ns) + 1 + strlen(name) + 1);
+        sprintf(fullname, "%s.%s", ns, name);
+
+        return fullname;
+}
+
+
+/**
+ * Attribute order: the Parsing Canonical Form's, then anything else
+ * by name.
+ */
+static int canon_attr_rank (const char *key) {
+        static const char *order[] = {
+                "name", "type", "fields", "symbols", "items", "values",
+                "size", NULL
+        };
+        int i;
+
+        for (i = 0 ; order[i] ; i++)
+                if (!strcmp(key, order[i]))
+                        return i;
+
+        return i;
+}
+
+static int canon_attr_cmp (const void *_a, const void *_b) {
+        const char *a = *(const char * const *)_a;
+        const char *b = *(const char * const *)_b;
+        int r;
+
+        if ((r = canon_attr_rank(a) - canon_attr_rank(b)))
+                return r;
+
+        return strcmp(a, b);
+}
+
+
+static int canon_write_schema (canon_buf_t *cb, json_t *schema,
+                               const char *ns);
+
+
+/**
+ * Write record field, named type or other complex type object.
+ *
+ * `fullname` is the fullname of a named type, NULL for fields and
+ * unnamed types, and `ns` the namespace of the object's attributes.
+ */
+static int canon_write_object (canon_buf_t *cb, json_t *obj,
+                               int is_field, const char *fullname,
+                               const char *ns) {
+        const char **keys;
+        size_t cnt = 0, i;
+        void *iter;
+        int r = 0;
+
+        keys = malloc(sizeof(*keys) * (json_object_size(obj) + 1));
+
+        for (iter = json_object_iter(obj) ; iter ;
+             iter = json_object_iter_next(obj, iter)) {
+                const char *key = json_object_iter_key(iter);
+
+                if (!strcmp(key, "doc") || !strcmp(key, "namespace"))
+                        continue;
+
+                keys[cnt++] = key;
+        }
+
+        qsort(keys, cnt, sizeof(*keys), canon_attr_cmp);
+
+        canon_puts(cb, "{");
+
+        for (i = 0 ; r == 0 && i < cnt ; i++) {
+                json_t *value = json_object_get(obj, keys[i]);
+
+                if (i > 0)
+                        canon_puts(cb, ",");
+                canon_write_string(cb, keys[i]);
+                canon_puts(cb, ":");
+
+                if (!strcmp(keys[i], "name") && fullname) {
+                        canon_write_string(cb, fullname);
+
+                } else if (!strcmp(keys[i], "type") &&
+                           (is_field || !json_is_string(value))) {
+                        r = canon_write_schema(cb, value, ns);
+
+                } else if (!is_field && !strcmp(keys[i], "fields")) {
+                        size_t j;
+
+                        if (!json_is_array(value)) {
+                                r = -1;
+                                break;
+                        }
+
+                        canon_puts(cb, "[");
+                        for (j = 0 ; r == 0 && j < json_array_size(value) ;
+                             j++) {
+                                json_t *field = json_array_get(value, j);
+
+                                if (!json_is_object(field)) {
+                                        r = -1;
+                                        break;
+                                }
+
+                                if (j > 0)
+                                        canon_puts(cb, ",");
+                                r = canon_write_object(cb, field, 1, NULL,
+                                                       ns);
+                        }
+                        canon_puts(cb, "]");
+
+                } else if (!is_field && (!strcmp(keys[i], "items") ||
+                                         !strcmp(keys[i], "values"))) {
+                        r = canon_write_schema(cb, value, ns);
+
+                } else
+                        r = canon_write_value(cb, value);
+        }
+
+        canon_puts(cb, "}");
+
+        free(keys);
+
+        return r;
+}
+
+
+/**
+ * Write schema `schema` defined in namespace `ns`.
+ */
+static int canon_write_schema (canon_buf_t *cb, json_t *schema,
+                               const char *ns) {
+        json_t *type, *name, *jns;
+        const char *inner_ns, *dot;
+        char *fullname, *nsbuf;
+        int r;
+
+        if (json_is_string(schema)) {
+                /* Primitive or reference to a named type */
+                const char *str = json_string_value(schema);
+
+                if (canon_is_primitive(str)) {
+                        canon_write_string(cb, str);
+                        return 0;
+                }
+
+                fullname = canon_fullname(str, ns);
+                canon_write_string(cb, fullname);
+                free(fullname);
+                return 0;
+
+        } else if (json_is_array(schema)) {
+                /* Union */
+                size_t i;
+
+                canon_puts(cb, "[");
+                for (i = 0 ; i < json_array_size(schema) ; i++) {
+                        if (i > 0)
+                                canon_puts(cb, ",");
+                        if (canon_write_schema(cb,
+                                               json_array_get(schema, i),
+                                               ns) == -1)
+                                return -1;
+                }
+                canon_puts(cb, "]");
+                return 0;
+
+        } else if (!json_is_object(schema))
+                return -1;
+
+        if (!(type = json_object_get(schema, "type")))
+                return -1;
+
+        if (json_is_string(type) &&
+            !canon_is_complex(json_string_value(type))) {
+                size_t attr_cnt = json_object_size(schema);
+
+                if (json_object_get(schema, "doc"))
+                        attr_cnt--;
+
+                /* Simple form of primitive or reference without
+                 * other attributes. */
+                if (attr_cnt == 1)
+                        return canon_write_schema(cb, type, ns);
+        }
+
+        if (!json_is_string(type) ||
+            !canon_is_named(json_string_value(type)))
+                return canon_write_object(cb, schema, 0, NULL, ns);
+
+        /* Named type: resolve fullname, which provides the namespace
+         * for its fields, items, etc. */
+        if (!(name = json_object_get(schema, "name")) ||
+            !json_is_string(name))
+                return -1;
+
+        if ((jns = json_object_get(schema, "namespace")) &&
+            json_is_string(jns))
+                ns = json_string_value(jns);
+
+        fullname = canon_fullname(json_string_value(name), ns);
+
+        if ((dot = strrchr(fullname, '.'))) {
+                nsbuf = strndup(fullname, (size_t)(dot - fullname));
+                inner_ns = nsbuf;
+        } else {
+                nsbuf = NULL;
+                inner_ns = "";
+        }
+
+        r = canon_write_object(cb, schema, 0, fullname, inner_ns);
+
+        if (nsbuf)
+                free(nsbuf);
+        free(fullname);
+
+        return r;
+}
+
+
+char *serdes_schema_canonical (const char *definition, size_t definition_len,
+                               size_t *canonical_lenp) {
+        canon_buf_t cb = { NULL, 0, 0 };
+        json_error_t err;
+        json_t *json;
+        int r;
+
+        if (!(json = json_loadb(definition, definition_len,
+                                JSON_DECODE_ANY, &err)))
+                return NULL;
+
+        r = canon_write_schema(&cb, json, "");
+
+        json_decref(json);
+
+        if (r == -1) {
+                if (cb.buf)
+                        free(cb.buf);
+                return NULL;
+        }
+
+        *canonical_lenp = cb.len;
+
+        return cb.buf;
+}
@@ -0,0 +1,370 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "serdes_int.h"
+#include "schema-file.h"
+
+
+#define SCHEMA_FILE_ALIGN(len)  (((len) + 7) & ~(size_t)7)
+
+struct schema_file_s {
+        mtx_t       sf_lock;        /* Protects all fields */
+        int         sf_fd;
+        size_t      sf_size;        /* End of last valid record */
+        hashidx_t   sf_index;       /* Record offsets by schema id */
+};
+
+
+uint64_t schema_file_rec_checksum (const struct schema_file_rec *rec) {
+        size_t off = offsetof(struct schema_file_rec, fingerprint);
+
+        return serdes_fingerprint64((const char *)rec + off,
+                                    sizeof(*rec) - off +
+                                    (size_t)rec->name_len +
+                                    (size_t)rec->definition_len);
+}
+
+
+struct schema_file_rec *schema_file_rec_new (int id, const char *name,
+                                             const char *definition,
+                                             int definition_len,
+                                             uint64_t fingerprint) {
+        struct schema_file_rec *rec;
+        size_t name_len = name ? strlen(name) : 0;
+        size_t len;
+
+        len = SCHEMA_FILE_ALIGN(sizeof(*rec) + name_len + definition_len);
+
+        rec = calloc(1, len);
+        rec->magic          = SCHEMA_FILE_REC_MAGIC;
+        rec->len            = (uint32_t)len;
+        rec->fingerprint    = fingerprint;
+        rec->id             = id;
+        rec->name_len       = (uint32_t)name_len;
+        rec->definition_len = (uint32_t)definition_len;
+        memcpy(rec + 1, name, name_len);
+        memcpy((char *)(rec + 1) + name_len, definition, definition_len);
+        rec->checksum       = schema_file_rec_checksum(rec);
+
+        return rec;
+}
+
+
+/**
+ * Returns the offset of the record for `id`, or 0 if not indexed.
+ *
+ * Locks: sf_lock MUST be held.
+ */
+static size_t schema_file_find0 (schema_file_t *sf, int id) {
+        size_t pos = 0;
+
+        return (size_t)(uintptr_t)hashidx_find(&sf->sf_index,
+                                               (uint64_t)id, &pos);
+}
+
+/**
+ * Index the record at `off`, replacing any previous record for the id.
+ *
+ * Locks: sf_lock MUST be held.
+ */
+static void schema_file_index0 (schema_file_t *sf, int id, size_t off) {
+        size_t prev;
+
+        if ((prev = schema_file_find0(sf, id)))
+                hashidx_remove(&sf->sf_index, (uint64_t)id,
+                               (void *)(uintptr_t)prev);
+        hashidx_insert(&sf->sf_index, (uint64_t)id, (void *)(uintptr_t)off);
+}
+
+
+/**
+ * Read the header of the record at `off` into `rec`.
+ *
+ * Records are read rather than mapped: another process may truncate
+ * the file (dropping a torn record, see schema_file_put()) and reading
+ * a mapped page past the end of the file raises SIGBUS.
+ *
+ * Returns 1 if the header is valid, 0 if it is incomplete or corrupt,
+ * or -1 on read error.
+ */
+static int schema_file_rec_hdr (schema_file_t *sf, size_t off,
+                                struct schema_file_rec *rec) {
+        ssize_t r;
+
+        if ((r = pread(sf->sf_fd, rec, sizeof(*rec), (off_t)off)) == -1)
+                return -1;
+
+        return r == (ssize_t)sizeof(*rec) &&
+                rec->magic == SCHEMA_FILE_REC_MAGIC &&
+                rec->len == SCHEMA_FILE_ALIGN(sizeof(*rec) +
+                                              (size_t)rec->name_len +
+                                              (size_t)rec->definition_len);
+}
+
+
+/**
+ * Index records appended (by any process) since the last scan.
+ * Scanning stops at the first incomplete or corrupt record header,
+ * e.g., from a process that crashed while appending.
+ *
+ * Returns 0 with the current file size in `*sizep`, or -1 if the file
+ * could not be scanned, in which case the file size is unknown and
+ * records beyond sf_size may be valid.
+ *
+ * Locks: sf_lock and a flock() MUST be held.
+ */
+static int schema_file_scan0 (schema_file_t *sf, size_t *sizep) {
+        struct schema_file_rec rec;
+        struct stat st;
+        size_t size, off = sf->sf_size;
+        int r;
+
+        if (fstat(sf->sf_fd, &st) == -1)
+                return -1;
+
+        size = (size_t)st.st_size;
+
+        while (off + sizeof(rec) <= size) {
+                if ((r = schema_file_rec_hdr(sf, off, &rec)) == -1)
+                        return -1;
+
+                if (!r || rec.len > size - off)
+                        break;
+
+                schema_file_index0(sf, rec.id, off);
+                off += rec.len;
+        }
+
+        sf->sf_size = off;
+        *sizep = size;
+
+        return 0;
+}
+
+
+/**
+ * Returns a copy (free(3) when done) of the (scanned) record at `off`
+ * if it is valid and its checksum matches, else NULL.
+ *
+ * Locks: sf_lock MUST be held.
+ */
+static struct schema_file_rec *schema_file_rec_read0 (schema_file_t *sf,
+                                                      size_t off) {
+        struct schema_file_rec hdr, *rec;
+
+        if (off >= sf->sf_size ||
+            schema_file_rec_hdr(sf, off, &hdr) != 1 ||
+            hdr.len > sf->sf_size - off)
+                return NULL;
+
+        rec = malloc(hdr.len);
+        if (pread(sf->sf_fd, rec, hdr.len, (off_t)off) != (ssize_t)hdr.len ||
+            memcmp(rec, &hdr, sizeof(hdr)) ||
+            rec->checksum != schema_file_rec_checksum(rec)) {
+                free(rec);
+                return NULL;
+        }
+
+        return rec;
+}
+
+
+/**
+ * Returns true if a valid record for `id` is indexed.
+ *
+ * Locks: sf_lock MUST be held.
+ */
+static int schema_file_has0 (schema_file_t *sf, int id) {
+        struct schema_file_rec *rec;
+        size_t off;
+        int valid;
+
+        if (!(off = schema_file_find0(sf, id)) ||
+            !(rec = schema_file_rec_read0(sf, off)))
+                return 0;
+
+        valid = rec->id == id;
+        free(rec);
+
+        return valid;
+}
+
+
+schema_file_t *schema_file_open (const char *path,
+                                 char *errstr, int errstr_size) {
+        schema_file_t *sf;
+        struct schema_file_hdr hdr;
+        struct stat st;
+        size_t size;
+        int fd;
+
+        if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644)) == -1) {
+                snprintf(errstr, errstr_size,
+                         "Failed to open schema cache file %s: %s",
+                         path, strerror(errno));
+                return NULL;
+        }
+
+        if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+                snprintf(errstr, errstr_size,
+                         "Failed to lock schema cache file %s: %s",
+                         path, strerror(errno));
+                close(fd);
+                return NULL;
+        }
+
+        if (st.st_size == 0) {
+                /* New file */
+                hdr.magic   = SCHEMA_FILE_MAGIC;
+                hdr.version = SCHEMA_FILE_VERSION;
+                if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+                        snprintf(errstr, errstr_size,
+                                 "Failed to write schema cache file %s: %s",
+                                 path, strerror(errno));
+                        close(fd);
+                        return NULL;
+                }
+
+        } else if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                   hdr.magic != SCHEMA_FILE_MAGIC ||
+                   hdr.version != SCHEMA_FILE_VERSION) {
+                snprintf(errstr, errstr_size,
+                         "%s is not a schema cache file "
+                         "(or has an unsupported version)", path);
+                close(fd);
+                return NULL;
+        }
+
+        sf = calloc(1, sizeof(*sf));
+        mtx_init(&sf->sf_lock, mtx_plain);
+        hashidx_init(&sf->sf_index, NULL, NULL);
+        sf->sf_fd   = fd;
+        sf->sf_size = sizeof(hdr);
+
+        if (schema_file_scan0(sf, &size) == -1) {
+                snprintf(errstr, errstr_size,
+                         "Failed to read schema cache file %s: %s",
+                         path, strerror(errno));
+                flock(fd, LOCK_UN);
+                schema_file_close(sf);
+                return NULL;
+        }
+
+        flock(fd, LOCK_UN);
+
+        return sf;
+}
+
+
+void schema_file_close (schema_file_t *sf) {
+        close(sf->sf_fd);
+        hashidx_destroy(&sf->sf_index);
+        mtx_destroy(&sf->sf_lock);
+        free(sf);
+}
+
+
+int schema_file_get (schema_file_t *sf, int id,
+                     char **namep, char **definitionp, int *definition_lenp) {
+        struct schema_file_rec *rec = NULL;
+        const char *data;
+        size_t off, size;
+
+        mtx_lock(&sf->sf_lock);
+
+        if (!(off = schema_file_find0(sf, id)) &&
+            flock(sf->sf_fd, LOCK_SH) != -1) {
+                /* Pick up records appended by other processes */
+                if (schema_file_scan0(sf, &size) == 0)
+                        off = schema_file_find0(sf, id);
+                flock(sf->sf_fd, LOCK_UN);
+        }
+
+        if (off)
+                rec = schema_file_rec_read0(sf, off);
+
+        mtx_unlock(&sf->sf_lock);
+
+        if (!rec || rec->id != id) {
+                if (rec)
+                        free(rec);
+                return 0;
+        }
+
+        data = (const char *)(rec + 1);
+
+        if (rec->name_len > 0)
+                *namep = strndup(data, rec->name_len);
+        else
+                *namep = NULL;
+
+        *definitionp = strndup(data + rec->name_len, rec->definition_len);
+        *definition_lenp = (int)rec->definition_len;
+
+        free(rec);
+
+        return 1;
+}
+
+
+void schema_file_put (schema_file_t *sf, int id, const char *name,
+                      const char *definition, int definition_len,
+                      uint64_t fingerprint) {
+        struct schema_file_rec *rec;
+        size_t size;
+
+        rec = schema_file_rec_new(id, name, definition, definition_len,
+                                  fingerprint);
+
+        mtx_lock(&sf->sf_lock);
+
+        if (schema_file_has0(sf, id))
+                goto done; /* Already cached */
+
+        if (flock(sf->sf_fd, LOCK_EX) == -1)
+                goto done;
+
+        /* Another process may have appended it meanwhile.
+         * Don't append unless all records have been seen: what lies
+         * beyond sf_size would be taken for a torn record. */
+        if (schema_file_scan0(sf, &size) == -1)
+                goto unlock;
+        if (schema_file_has0(sf, id))
+                goto unlock;
+
+        /* Drop any torn record at the end of the file. */
+        if (size > sf->sf_size && ftruncate(sf->sf_fd, sf->sf_size) == -1)
+                goto unlock;
+
+        /* A partially written record is dropped by the next append. */
+        if (pwrite(sf->sf_fd, rec, rec->len, sf->sf_size) ==
+            (ssize_t)rec->len) {
+                schema_file_index0(sf, id, sf->sf_size);
+                sf->sf_size += rec->len;
+        }
+
+ unlock:
+        flock(sf->sf_fd, LOCK_UN);
+ done:
+        mtx_unlock(&sf->sf_lock);
+        free(rec);
+}
@@ -0,0 +1,110 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Persistent schema cache file ("schema.cache.path").
+ *
+ * The file is a header followed by append-only schema records, it is
+ * indexed by schema id when opened but records are only read and
+ * checksummed when looked up.
+ * Multiple processes may share the same file, appends are serialized
+ * with flock(2).
+ *
+ * All integers are in host byte order: the file is not portable
+ * between architectures.
+ */
+
+#define SCHEMA_FILE_MAGIC      0x43534453  /* "SDSC" */
+#define SCHEMA_FILE_VERSION    1
+#define SCHEMA_FILE_REC_MAGIC  0x52534453  /* "SDSR" */
+
+struct schema_file_hdr {
+        uint32_t magic;           /* SCHEMA_FILE_MAGIC */
+        uint32_t version;         /* SCHEMA_FILE_VERSION */
+};
+
+/**
+ * Schema record, followed by the name and the definition
+ * (not nul-terminated) and padding to 8 bytes.
+ */
+struct schema_file_rec {
+        uint32_t magic;           /* SCHEMA_FILE_REC_MAGIC */
+        uint32_t len;             /* Record length, including this header
+                                   * and padding */
+        uint64_t checksum;        /* CRC-64-AVRO of the record following
+                                   * this field (excluding padding) */
+        uint64_t fingerprint;     /* CRC-64-AVRO of the definition */
+        int32_t  id;              /* Schema id */
+        uint32_t name_len;        /* Subject name length, 0 if unknown */
+        uint32_t definition_len;  /* Definition length */
+        uint32_t reserved;
+};
+
+
+/**
+ * Returns a new record (free(3) when done) for the given schema.
+ */
+struct schema_file_rec *schema_file_rec_new (int id, const char *name,
+                                             const char *definition,
+                                             int definition_len,
+                                             uint64_t fingerprint);
+
+/**
+ * Returns the checksum of record `rec`, compare to `rec->checksum`.
+ */
+uint64_t schema_file_rec_checksum (const struct schema_file_rec *rec);
+
+
+
+typedef struct schema_file_s schema_file_t;
+
+
+/**
+ * Open (or create) the schema cache file at `path` and index its records.
+ *
+ * Returns the file handle, or NULL on failure in which case a
+ * human readable error is written to `errstr`.
+ */
+schema_file_t *schema_file_open (const char *path,
+                                 char *errstr, int errstr_size);
+
+void schema_file_close (schema_file_t *sf);
+
+
+/**
+ * Look up schema `id`.
+ *
+ * On success 1 is returned and `*namep` (NULL if unknown) and
+ * `*definitionp` are set to nul-terminated copies that the caller
+ * must free, with the definition's length in `*definition_lenp`.
+ * Returns 0 if the schema is not found or its record is corrupt.
+ */
+int schema_file_get (schema_file_t *sf, int id,
+                     char **namep, char **definitionp, int *definition_lenp);
+
+
+/**
+ * Append schema `id` to the file, unless it is already there.
+ * Failures are silently ignored (the file is only a cache).
+ */
+void schema_file_put (schema_file_t *sf, int id, const char *name,
+                      const char *definition, int definition_len,
+                      uint64_t fingerprint);
@@ -0,0 +1,341 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "serdes_int.h"
+#include "schema-shm.h"
+
+
+#define SCHEMA_SHM_ALIGN(len)  (((len) + 7) & ~(size_t)7)
+
+struct schema_shm_s {
+        mtx_t                  shm_lock;     /* Serializes this process'
+                                              * writers, flock() serializes
+                                              * processes. */
+        int                    shm_fd;
+        struct schema_shm_hdr *shm_hdr;      /* Mapped segment */
+        size_t                 shm_size;     /* Mapped size */
+        uint64_t              *shm_id_slots; /* Id index */
+        uint64_t              *shm_fp_slots; /* Fingerprint index */
+};
+
+
+static __inline uint32_t schema_shm_hash_id (int id) {
+        return (uint32_t)(((uint64_t)(uint32_t)id *
+                           0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+
+/**
+ * Returns the record at `off` in the segment, or NULL if out of bounds
+ * or if its header is invalid (corrupt or foreign segment): a returned
+ * record's name and definition are within the segment.
+ */
+static const struct schema_file_rec *schema_shm_rec (schema_shm_t *shm,
+                                                     uint64_t off) {
+        const struct schema_file_rec *rec;
+
+        if (off < shm->shm_hdr->data_off || (off & 7) ||
+            off > shm->shm_size - sizeof(*rec))
+                return NULL;
+
+        rec = (const struct schema_file_rec *)((const char *)shm->shm_hdr +
+                                               off);
+        if (rec->magic != SCHEMA_FILE_REC_MAGIC ||
+            rec->len != SCHEMA_SHM_ALIGN(sizeof(*rec) +
+                                         (size_t)rec->name_len +
+                                         (size_t)rec->definition_len) ||
+            rec->len > shm->shm_size - off)
+                return NULL;
+
+        return rec;
+}
+
+
+/**
+ * Probe `slots` from `hash` for a record matching `match(rec, opaque)`.
+ * If `emptyp` is non-NULL it is set to the first empty slot on a miss.
+ */
+static const struct schema_file_rec *
+schema_shm_probe (schema_shm_t *shm, uint64_t *slots, uint32_t hash,
+                  int (*match) (const struct schema_file_rec *rec,
+                                const void *opaque),
+                  const void *opaque, uint64_t **emptyp) {
+        uint32_t mask = shm->shm_hdr->slot_cnt - 1;
+        uint32_t i;
+
+        for (i = 0 ; i <= mask ; i++) {
+                uint64_t *slot = &slots[(hash + i) & mask];
+                const struct schema_file_rec *rec;
+                uint64_t off;
+
+                /* Acquire: the record is written before its slot. */
+                if (!(off = __atomic_load_n(slot, __ATOMIC_ACQUIRE))) {
+                        if (emptyp)
+                                *emptyp = slot;
+                        return NULL;
+                }
+
+                if ((rec = schema_shm_rec(shm, off)) && match(rec, opaque))
+                        return rec;
+        }
+
+        return NULL;
+}
+
+
+static int schema_shm_match_id (const struct schema_file_rec *rec,
+                                const void *opaque) {
+        return rec->id == *(const int *)opaque;
+}
+
+/**
+ * Fingerprint lookup key.
+ */
+struct schema_shm_fp_key {
+        uint64_t    fingerprint;
+        const char *name;
+        size_t      name_len;
+        const char *definition;
+        int         definition_len;
+};
+
+static int schema_shm_match_fp (const struct schema_file_rec *rec,
+                                const void *opaque) {
+        const struct schema_shm_fp_key *key = opaque;
+        const char *data = (const char *)(rec + 1);
+
+        return rec->fingerprint == key->fingerprint &&
+                rec->name_len == key->name_len &&
+                rec->definition_len == (uint32_t)key->definition_len &&
+                !memcmp(data, key->name, key->name_len) &&
+                !memcmp(data + key->name_len, key->definition,
+                        key->definition_len);
+}
+
+
+
+schema_shm_t *schema_shm_open (const char *name, size_t size,
+                               char *errstr, int errstr_size) {
+        schema_shm_t *shm;
+        struct schema_shm_hdr *hdr;
+        struct stat st;
+        uint32_t slot_cnt;
+        int fd, init = 0;
+        void *map;
+
+        if ((fd = shm_open(name, O_RDWR|O_CREAT, 0644)) == -1) {
+                snprintf(errstr, errstr_size,
+                         "Failed to open shared memory schema cache %s: %s",
+                         name, strerror(errno));
+                return NULL;
+        }
+
+        if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+                snprintf(errstr, errstr_size,
+                         "Failed to lock shared memory schema cache %s: %s",
+                         name, strerror(errno));
+                close(fd);
+                return NULL;
+        }
+
+        if (st.st_size == 0) {
+                /* New segment */
+                if (ftruncate(fd, size) == -1) {
+                        snprintf(errstr, errstr_size,
+                                 "Failed to size shared memory schema "
+                                 "cache %s to %zu bytes: %s",
+                                 name, size, strerror(errno));
+                        close(fd);
+                        return NULL;
+                }
+                init = 1;
+        } else
+                size = (size_t)st.st_size; /* Use existing size */
+
+        map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                snprintf(errstr, errstr_size,
+                         "Failed to map shared memory schema cache %s: %s",
+                         name, strerror(errno));
+                close(fd);
+                return NULL;
+        }
+
+        hdr = map;
+
+        if (init) {
+                /* Dedicate about 1/32 of the segment to the indexes. */
+                for (slot_cnt = 16 ; (size_t)slot_cnt * 2 * 512 <= size ;
+                     slot_cnt *= 2)
+                        ;
+
+                hdr->version  = SCHEMA_SHM_VERSION;
+                hdr->size     = size;
+                hdr->slot_cnt = slot_cnt;
+                hdr->rec_cnt  = 0;
+                hdr->data_off = SCHEMA_SHM_ALIGN(sizeof(*hdr) +
+                                                 2 * sizeof(uint64_t) *
+                                                 slot_cnt);
+                hdr->data_end = hdr->data_off;
+                __atomic_store_n(&hdr->magic, SCHEMA_SHM_MAGIC,
+                                 __ATOMIC_RELEASE);
+
+        } else if (size < sizeof(*hdr) ||
+                   __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) !=
+                   SCHEMA_SHM_MAGIC ||
+                   hdr->version != SCHEMA_SHM_VERSION ||
+                   hdr->size != size ||
+                   !hdr->slot_cnt || (hdr->slot_cnt & (hdr->slot_cnt - 1)) ||
+                   hdr->data_off < sizeof(*hdr) +
+                   2 * sizeof(uint64_t) * (uint64_t)hdr->slot_cnt ||
+                   hdr->data_end > size) {
+                snprintf(errstr, errstr_size,
+                         "%s is not a shared memory schema cache "
+                         "(or has an unsupported version)", name);
+                munmap(map, size);
+                close(fd);
+                return NULL;
+        }
+
+        flock(fd, LOCK_UN);
+
+        shm = calloc(1, sizeof(*shm));
+        mtx_init(&shm->shm_lock, mtx_plain);
+        shm->shm_fd       = fd;
+        shm->shm_hdr      = hdr;
+        shm->shm_size     = size;
+        shm->shm_id_slots = (uint64_t *)(hdr + 1);
+        shm->shm_fp_slots = shm->shm_id_slots + hdr->slot_cnt;
+
+        return shm;
+}
+
+
+void schema_shm_close (schema_shm_t *shm) {
+        munmap(shm->shm_hdr, shm->shm_size);
+        close(shm->shm_fd);
+        mtx_destroy(&shm->shm_lock);
+        free(shm);
+}
+
+
+int schema_shm_get (schema_shm_t *shm, int id,
+                    char **namep, char **definitionp, int *definition_lenp) {
+        const struct schema_file_rec *rec;
+        const char *data;
+
+        if (!(rec = schema_shm_probe(shm, shm->shm_id_slots,
+                                     schema_shm_hash_id(id),
+                                     schema_shm_match_id, &id, NULL)) ||
+            rec->checksum != schema_file_rec_checksum(rec))
+                return 0;
+
+        data = (const char *)(rec + 1);
+
+        if (rec->name_len > 0)
+                *namep = strndup(data, rec->name_len);
+        else
+                *namep = NULL;
+
+        *definitionp = strndup(data + rec->name_len, rec->definition_len);
+        *definition_lenp = (int)rec->definition_len;
+
+        return 1;
+}
+
+
+int schema_shm_find (schema_shm_t *shm, const char *name,
+                     const char *definition, int definition_len,
+                     uint64_t fingerprint) {
+        const struct schema_file_rec *rec;
+        struct schema_shm_fp_key key = {
+                .fingerprint    = fingerprint,
+                .name           = name,
+                .name_len       = strlen(name),
+                .definition     = definition,
+                .definition_len = definition_len
+        };
+
+        if (!(rec = schema_shm_probe(shm, shm->shm_fp_slots,
+                                     (uint32_t)fingerprint,
+                                     schema_shm_match_fp, &key, NULL)))
+                return -1;
+
+        return rec->id;
+}
+
+
+void schema_shm_put (schema_shm_t *shm, int id, const char *name,
+                     const char *definition, int definition_len,
+                     uint64_t fingerprint) {
+        struct schema_shm_hdr *hdr = shm->shm_hdr;
+        struct schema_file_rec *rec;
+        uint64_t *id_slot = NULL, *fp_slot = NULL;
+        uint64_t off;
+
+        if (schema_shm_probe(shm, shm->shm_id_slots, schema_shm_hash_id(id),
+                             schema_shm_match_id, &id, NULL))
+                return; /* Already cached */
+
+        rec = schema_file_rec_new(id, name, definition, definition_len,
+                                  fingerprint);
+
+        mtx_lock(&shm->shm_lock);
+        if (flock(shm->shm_fd, LOCK_EX) == -1)
+                goto done;
+
+        /* Another writer may have added it meanwhile. */
+        if (schema_shm_probe(shm, shm->shm_id_slots, schema_shm_hash_id(id),
+                             schema_shm_match_id, &id, &id_slot))
+                goto unlock;
+
+        /* Keep index load at or below 50%, and the records within
+         * the (mapped) segment. */
+        if (!id_slot || hdr->rec_cnt >= hdr->slot_cnt / 2 ||
+            hdr->data_end < hdr->data_off ||
+            hdr->data_end > shm->shm_size ||
+            rec->len > shm->shm_size - hdr->data_end)
+                goto unlock;
+
+        schema_shm_probe(shm, shm->shm_fp_slots, (uint32_t)fingerprint,
+                         schema_shm_match_fp, &(struct schema_shm_fp_key){
+                                 .fingerprint = fingerprint },
+                         &fp_slot);
+        if (!fp_slot)
+                goto unlock;
+
+        off = hdr->data_end;
+        memcpy((char *)hdr + off, rec, rec->len);
+        hdr->data_end += rec->len;
+        hdr->rec_cnt++;
+
+        /* Publish the record to lock-free readers. */
+        __atomic_store_n(id_slot, off, __ATOMIC_RELEASE);
+        __atomic_store_n(fp_slot, off, __ATOMIC_RELEASE);
+
+ unlock:
+        flock(shm->shm_fd, LOCK_UN);
+ done:
+        mtx_unlock(&shm->shm_lock);
+        free(rec);
+}
@@ -0,0 +1,97 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "schema-file.h"
+
+
+/**
+ * Shared-memory schema cache ("schema.cache.shm.name").
+ *
+ * A POSIX shared memory segment shared by all processes on the host,
+ * holding schema definitions in the same record format as the
+ * persistent cache file (struct schema_file_rec) indexed by id and by
+ * definition fingerprint.
+ *
+ * The segment is append-only: records and index slots are never modified
+ * once published, which allows lock-free lookups. Writers are serialized
+ * with flock(2). When the segment is full new schemas are not added.
+ * The segment outlives the processes using it and must be removed
+ * with shm_unlink(3) (e.g., `rm /dev/shm/<name>`) to be reset or resized.
+ */
+
+#define SCHEMA_SHM_MAGIC    0x4d534453  /* "SDSM" */
+#define SCHEMA_SHM_VERSION  1
+
+struct schema_shm_hdr {
+        uint32_t magic;           /* SCHEMA_SHM_MAGIC, set last */
+        uint32_t version;         /* SCHEMA_SHM_VERSION */
+        uint64_t size;            /* Segment size */
+        uint32_t slot_cnt;        /* Slots per index (power of two) */
+        uint32_t rec_cnt;         /* Number of records */
+        uint64_t data_off;        /* Offset of first record */
+        uint64_t data_end;        /* End of last record */
+        /* Followed by the id index and the fingerprint index:
+         * slot_cnt record offsets each, 0 for an empty slot. */
+};
+
+
+typedef struct schema_shm_s schema_shm_t;
+
+
+/**
+ * Open (or create with `size` bytes) the shared memory segment `name`.
+ *
+ * Returns the segment handle, or NULL on failure in which case a
+ * human readable error is written to `errstr`.
+ */
+schema_shm_t *schema_shm_open (const char *name, size_t size,
+                               char *errstr, int errstr_size);
+
+void schema_shm_close (schema_shm_t *shm);
+
+
+/**
+ * Look up schema `id`.
+ *
+ * On success 1 is returned and `*namep` (NULL if unknown) and
+ * `*definitionp` are set to nul-terminated copies that the caller
+ * must free, with the definition's length in `*definition_lenp`.
+ * Returns 0 if not found.
+ */
+int schema_shm_get (schema_shm_t *shm, int id,
+                    char **namep, char **definitionp, int *definition_lenp);
+
+/**
+ * Look up the id of the schema with `definition` registered under
+ * subject `name`.
+ *
+ * Returns the schema id, or -1 if not found.
+ */
+int schema_shm_find (schema_shm_t *shm, const char *name,
+                     const char *definition, int definition_len,
+                     uint64_t fingerprint);
+
+/**
+ * Add schema `id` to the segment, unless it is already there or
+ * the segment is full.
+ */
+void schema_shm_put (schema_shm_t *shm, int id, const char *name,
+                     const char *definition, int definition_len,
+                     uint64_t fingerprint);
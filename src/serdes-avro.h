@@ -53,6 +53,16 @@ serdes_err_t serdes_schema_serialize_avro (serdes_schema_t *schema,
                                            void **payloadp, size_t *sizep,
                                            char *errstr, int errstr_size);
 
+/**
+ * Same as serdes_schema_serialize_avro() but using the serializer framing
+ * configured for handle `serdes` rather than for the schema's handle,
+ * which differ for schemas of a shared cache (see serdes_cache_new()).
+ */
+serdes_err_t serdes_serialize_avro (serdes_t *serdes, serdes_schema_t *schema,
+                                    avro_value_t *avro,
+                                    void **payloadp, size_t *sizep,
+                                    char *errstr, int errstr_size);
+
 /**
  * Deserialize `payload` of `size` bytes using `schema`.
  *
@@ -75,7 +85,8 @@ serdes_err_t serdes_schema_deserialize_avro (serdes_schema_t *schema,
  * Payload must be framed according the the `deserialize.framing` configuration
  *  property (see `serdes_conf_set()`) to allow lookup and load of the schema.
  *
- * The schema used is returned in `*schemap` (optional).
+ * The schema used is returned in `*schemap` (optional), it is owned
+ * by the local cache (see `serdes_schema_get()`).
  *
  * Same error semantics as `serdes_schema_deserialize_avro()`
  */
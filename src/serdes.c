@@ -16,7 +16,10 @@
 
 #include "serdes_int.h"
 
+#include <ctype.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <inttypes.h>
 
 const char *serdes_err2str (serdes_err_t err) {
         switch (err)
@@ -47,8 +50,71 @@ const char *serdes_err2str (serdes_err_t err) {
 }
 
 
+/**
+ * Free list of `cnt` strings.
+ */
+static void serdes_strv_destroy (char **strv, int cnt) {
+        int i;
+
+        for (i = 0 ; i < cnt ; i++)
+                free(strv[i]);
+        if (strv)
+                free(strv);
+}
+
+/**
+ * Split comma separated list `val` into `*strvp` (NULL if empty),
+ * trimming whitespace and skipping empty elements.
+ * Returns the number of elements.
+ */
+static int serdes_strv_split (const char *val, char ***strvp) {
+        char **strv = NULL;
+        int cnt = 0;
+
+        while (*val) {
+                const char *end;
+                size_t len;
+
+                while (isspace((unsigned char)*val))
+                        val++;
+                if (!(end = strchr(val, ',')))
+                        end = val + strlen(val);
+
+                for (len = (size_t)(end - val) ;
+                     len > 0 && isspace((unsigned char)val[len-1]) ; len--)
+                        ;
+
+                if (len > 0) {
+                        strv = realloc(strv, sizeof(*strv) * (cnt + 1));
+                        strv[cnt++] = strndup(val, len);
+                }
+
+                val = *end ? end + 1 : end;
+        }
+
+        *strvp = strv;
+        return cnt;
+}
+
+
 static void serdes_conf_destroy0 (serdes_conf_t *sconf) {
         url_list_clear(&sconf->schema_registry_urls);
+        if (sconf->cache_path) {
+                free(sconf->cache_path);
+                sconf->cache_path = NULL;
+        }
+        if (sconf->shm_name) {
+                free(sconf->shm_name);
+                sconf->shm_name = NULL;
+        }
+        if (sconf->pin_ids) {
+                free(sconf->pin_ids);
+                sconf->pin_ids = NULL;
+                sconf->pin_id_cnt = 0;
+        }
+        serdes_strv_destroy(sconf->pin_subjects, sconf->pin_subject_cnt);
+        sconf->pin_subjects = NULL;
+        sconf->pin_subject_cnt = 0;
 }
 
 void serdes_conf_destroy (serdes_conf_t *sconf) {
@@ -69,6 +135,49 @@ static void serdes_conf_copy0 (serdes_conf_t *dst, const serdes_conf_t *src) {
         dst->serializer_framing   = src->serializer_framing;
         dst->deserializer_framing = src->deserializer_framing;
         dst->debug   = src->debug;
+        dst->request_timeout_ms = src->request_timeout_ms;
+        dst->connect_timeout_ms = src->connect_timeout_ms;
+        dst->retries = src->retries;
+        dst->retry_backoff_ms = src->retry_backoff_ms;
+        dst->retry_backoff_max_ms = src->retry_backoff_max_ms;
+        dst->latest_ttl_ms = src->latest_ttl_ms;
+        dst->thread_cache_size = src->thread_cache_size;
+        dst->latest_refresh_ms = src->latest_refresh_ms;
+        dst->negative_ttl_ms = src->negative_ttl_ms;
+        dst->prefetch_concurrency = src->prefetch_concurrency;
+        dst->prefetch_window = src->prefetch_window;
+        if (dst->cache_path)
+                free(dst->cache_path);
+        dst->cache_path = src->cache_path ? strdup(src->cache_path) : NULL;
+        if (dst->shm_name)
+                free(dst->shm_name);
+        dst->shm_name = src->shm_name ? strdup(src->shm_name) : NULL;
+        dst->shm_size = src->shm_size;
+        dst->max_count = src->max_count;
+        dst->max_bytes = src->max_bytes;
+        dst->shard_cnt = src->shard_cnt;
+        if (dst->pin_ids)
+                free(dst->pin_ids);
+        dst->pin_ids = NULL;
+        dst->pin_id_cnt = src->pin_id_cnt;
+        if (src->pin_id_cnt > 0) {
+                dst->pin_ids = malloc(sizeof(*dst->pin_ids) *
+                                      src->pin_id_cnt);
+                memcpy(dst->pin_ids, src->pin_ids,
+                       sizeof(*dst->pin_ids) * src->pin_id_cnt);
+        }
+        serdes_strv_destroy(dst->pin_subjects, dst->pin_subject_cnt);
+        dst->pin_subjects = NULL;
+        dst->pin_subject_cnt = src->pin_subject_cnt;
+        if (src->pin_subject_cnt > 0) {
+                int i;
+
+                dst->pin_subjects = malloc(sizeof(*dst->pin_subjects) *
+                                           src->pin_subject_cnt);
+                for (i = 0 ; i < src->pin_subject_cnt ; i++)
+                        dst->pin_subjects[i] = strdup(src->pin_subjects[i]);
+        }
+        dst->cache = src->cache;
         dst->schema_load_cb = src->schema_load_cb;
         dst->schema_unload_cb = src->schema_unload_cb;
         dst->log_cb  = src->log_cb;
@@ -83,6 +192,44 @@ serdes_conf_t *serdes_conf_copy (const serdes_conf_t *src) {
 }
 
 
+/**
+ * Parse integer configuration value `val` in the range `min`..`max`
+ * into `*dstp`.
+ */
+static serdes_err_t serdes_conf_set_int64 (const char *name, const char *val,
+                                           int64_t min, int64_t max,
+                                           int64_t *dstp,
+                                           char *errstr, int errstr_size) {
+        char *end;
+        long long v;
+
+        v = strtoll(val, &end, 10);
+        if (!*val || *end || v < min || v > max) {
+                snprintf(errstr, errstr_size,
+                         "Invalid value for %s, expected integer "
+                         "in range %"PRId64"..%"PRId64, name, min, max);
+                return SERDES_ERR_CONF_INVALID;
+        }
+
+        *dstp = (int64_t)v;
+        return SERDES_ERR_OK;
+}
+
+static serdes_err_t serdes_conf_set_int (const char *name, const char *val,
+                                         int min, int max, int *dstp,
+                                         char *errstr, int errstr_size) {
+        serdes_err_t err;
+        int64_t v;
+
+        if ((err = serdes_conf_set_int64(name, val, min, max, &v,
+                                         errstr, errstr_size)))
+                return err;
+
+        *dstp = (int)v;
+        return SERDES_ERR_OK;
+}
+
+
 serdes_err_t serdes_conf_set (serdes_conf_t *sconf,
                               const char *name, const char *val,
                               char *errstr, int errstr_size) {
@@ -125,6 +272,151 @@ serdes_err_t serdes_conf_set (serdes_conf_t *sconf,
                                  "all, none", name);
                         return SERDES_ERR_CONF_INVALID;
                 }
+
+        } else if (!strcmp(name, "schema.registry.request.timeout.ms")) {
+                return serdes_conf_set_int(name, val, 0, INT_MAX,
+                                           &sconf->request_timeout_ms,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.registry.connect.timeout.ms")) {
+                return serdes_conf_set_int(name, val, 0, INT_MAX,
+                                           &sconf->connect_timeout_ms,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.registry.retries")) {
+                return serdes_conf_set_int(name, val, 0, 100,
+                                           &sconf->retries,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.registry.retry.backoff.ms")) {
+                return serdes_conf_set_int(name, val, 0, 3600*1000,
+                                           &sconf->retry_backoff_ms,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.registry.retry.backoff.max.ms")) {
+                return serdes_conf_set_int(name, val, 0, 3600*1000,
+                                           &sconf->retry_backoff_max_ms,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.cache.latest.ttl.ms")) {
+                return serdes_conf_set_int(name, val, -1, INT_MAX,
+                                           &sconf->latest_ttl_ms,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.cache.latest.refresh.ms")) {
+                return serdes_conf_set_int(name, val, 0, INT_MAX,
+                                           &sconf->latest_refresh_ms,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.cache.negative.ttl.ms")) {
+                return serdes_conf_set_int(name, val, 0, INT_MAX,
+                                           &sconf->negative_ttl_ms,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.prefetch.concurrency")) {
+                return serdes_conf_set_int(name, val, 1, 128,
+                                           &sconf->prefetch_concurrency,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.prefetch.window")) {
+                return serdes_conf_set_int(name, val, 0, 1000,
+                                           &sconf->prefetch_window,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.cache.path")) {
+                if (sconf->cache_path)
+                        free(sconf->cache_path);
+                sconf->cache_path = *val ? strdup(val) : NULL;
+
+        } else if (!strcmp(name, "schema.cache.shm.name")) {
+                if (*val && (*val != '/' || strchr(val+1, '/'))) {
+                        snprintf(errstr, errstr_size,
+                                 "Invalid value for %s, expected \"/name\"",
+                                 name);
+                        return SERDES_ERR_CONF_INVALID;
+                }
+                if (sconf->shm_name)
+                        free(sconf->shm_name);
+                sconf->shm_name = *val ? strdup(val) : NULL;
+
+        } else if (!strcmp(name, "schema.cache.shm.size")) {
+                return serdes_conf_set_int64(name, val, 65536, INT64_MAX,
+                                             &sconf->shm_size,
+                                             errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.cache.max.count")) {
+                return serdes_conf_set_int(name, val, 0, INT_MAX,
+                                           &sconf->max_count,
+                                           errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.cache.max.bytes")) {
+                return serdes_conf_set_int64(name, val, 0, INT64_MAX,
+                                             &sconf->max_bytes,
+                                             errstr, errstr_size);
+
+        } else if (!strcmp(name, "schema.cache.thread.size")) {
+                int size;
+                serdes_err_t err;
+
+                if ((err = serdes_conf_set_int(name, val, 0, 256, &size,
+                                               errstr, errstr_size)))
+                        return err;
+
+                /* Round up to power of two for direct mapping */
+                sconf->thread_cache_size = 0;
+                if (size > 0)
+                        for (sconf->thread_cache_size = 1 ;
+                             sconf->thread_cache_size < size ;
+                             sconf->thread_cache_size *= 2)
+                                ;
+
+        } else if (!strcmp(name, "schema.cache.pin.ids")) {
+                char **strv;
+                int *ids = NULL;
+                int cnt, i;
+
+                cnt = serdes_strv_split(val, &strv);
+                if (cnt > 0)
+                        ids = malloc(sizeof(*ids) * cnt);
+                for (i = 0 ; i < cnt ; i++) {
+                        serdes_err_t err;
+
+                        if ((err = serdes_conf_set_int(name, strv[i],
+                                                       0, INT_MAX, &ids[i],
+                                                       errstr,
+                                                       errstr_size))) {
+                                serdes_strv_destroy(strv, cnt);
+                                free(ids);
+                                return err;
+                        }
+                }
+                serdes_strv_destroy(strv, cnt);
+
+                if (sconf->pin_ids)
+                        free(sconf->pin_ids);
+                sconf->pin_ids    = ids;
+                sconf->pin_id_cnt = cnt;
+
+        } else if (!strcmp(name, "schema.cache.pin.subjects")) {
+                serdes_strv_destroy(sconf->pin_subjects,
+                                    sconf->pin_subject_cnt);
+                sconf->pin_subject_cnt = serdes_strv_split(val,
+                                                           &sconf->
+                                                           pin_subjects);
+
+        } else if (!strcmp(name, "schema.cache.shards")) {
+                int cnt;
+                serdes_err_t err;
+
+                if ((err = serdes_conf_set_int(name, val, 1, 256, &cnt,
+                                               errstr, errstr_size)))
+                        return err;
+
+                /* Round up to power of two for masking */
+                for (sconf->shard_cnt = 1 ; sconf->shard_cnt < cnt ;
+                     sconf->shard_cnt *= 2)
+                        ;
+
         } else {
                 snprintf(errstr, errstr_size,
                          "Unknown configuration property %s", name);
@@ -161,6 +453,10 @@ void serdes_conf_set_opaque (serdes_conf_t *sconf, void *opaque) {
         sconf->opaque = opaque;
 }
 
+void serdes_conf_set_cache (serdes_conf_t *sconf, serdes_cache_t *cache) {
+        sconf->cache = cache;
+}
+
 
 /**
  * Initialize config object to default values
@@ -169,6 +465,14 @@ static void serdes_conf_init (serdes_conf_t *sconf) {
         memset(sconf, 0, sizeof(*sconf));
         sconf->serializer_framing   = SERDES_FRAMING_CP1;
         sconf->deserializer_framing = SERDES_FRAMING_CP1;
+        sconf->request_timeout_ms   = 30000;
+        sconf->connect_timeout_ms   = 10000;
+        sconf->retries              = 2;
+        sconf->retry_backoff_ms     = 100;
+        sconf->retry_backoff_max_ms = 1000;
+        sconf->prefetch_concurrency = 8;
+        sconf->shm_size             = 16 * 1024 * 1024;
+        sconf->shard_cnt            = 1;
 }
 
 serdes_conf_t *serdes_conf_new (char *errstr, int errstr_size, ...) {
@@ -218,24 +522,128 @@ void serdes_log (serdes_t *sd, int level, const char *fac,
 }
 
 
-void serdes_destroy (serdes_t *sd) {
+static void serdes_free_cb (void *ptr, void *opaque) {
+        free(ptr);
+}
+
+/**
+ * Index table retire callback: defer freeing until no lock-free reader
+ * can be accessing the table.
+ */
+static void serdes_hashidx_retire_cb (void *ptr, void *opaque) {
+        ebr_retire((ebr_t *)opaque, ptr, serdes_free_cb, NULL);
+}
+
+
+/**
+ * Set up the handle's own schema cache: shards, indexes and
+ * reclamation, unless the handle is attached to a shared cache.
+ */
+static void serdes_schemas_init (serdes_t *sd) {
+        int i;
+
+        ebr_init(&sd->sd_ebr);
+        hashidx_init(&sd->sd_schemas_by_fp,
+                     serdes_hashidx_retire_cb, &sd->sd_ebr);
+        hashidx_init(&sd->sd_schemas_by_name,
+                     serdes_hashidx_retire_cb, &sd->sd_ebr);
+        hashidx_init(&sd->sd_objs, NULL, NULL);
+        mtx_init(&sd->sd_objs_lock, mtx_plain);
+
+        sd->sd_shard_cnt = sd->sd_conf.shard_cnt;
+        sd->sd_shards = calloc(sd->sd_shard_cnt, sizeof(*sd->sd_shards));
+        for (i = 0 ; i < sd->sd_shard_cnt ; i++) {
+                serdes_shard_t *sh = &sd->sd_shards[i];
+
+                mtx_init(&sh->sh_lock, mtx_plain);
+                TAILQ_INIT(&sh->sh_schemas);
+                hashidx_init(&sh->sh_schemas_by_id,
+                             serdes_hashidx_retire_cb, &sd->sd_ebr);
+                LIST_INIT(&sh->sh_inflight);
+        }
+}
+
+
+/**
+ * Destroy the handle's own schema cache and all its schemas,
+ * see serdes_schemas_init().
+ */
+static void serdes_schemas_destroy (serdes_t *sd) {
         serdes_schema_t *ss;
+        int i;
+
+        for (i = 0 ; i < sd->sd_shard_cnt ; i++) {
+                serdes_shard_t *sh = &sd->sd_shards[i];
+
+                while ((ss = TAILQ_FIRST(&sh->sh_schemas)))
+                        serdes_schema_destroy(ss);
+
+                hashidx_destroy(&sh->sh_schemas_by_id);
+                if (sh->sh_purgeq)
+                        free(sh->sh_purgeq);
+                mtx_destroy(&sh->sh_lock);
+        }
+
+        hashidx_destroy(&sd->sd_schemas_by_fp);
+        hashidx_destroy(&sd->sd_schemas_by_name);
+
+        /* Free all retired schemas, there are no readers left. */
+        ebr_destroy(&sd->sd_ebr);
+
+        /* All parsed objects were unloaded with their last schema. */
+        hashidx_destroy(&sd->sd_objs);
+        mtx_destroy(&sd->sd_objs_lock);
+
+        free(sd->sd_shards);
+}
 
-        while ((ss = LIST_FIRST(&sd->sd_schemas)))
-                serdes_schema_destroy(ss);
+
+void serdes_destroy (serdes_t *sd) {
+
+        serdes_refresh_stop(sd);
+
+        /* Wait for prefetch workers of timed out serdes_schemas_prefetch()
+         * calls to finish their current lookup, after failing
+         * the speculative prefetches' asynchronous requests. */
+        __atomic_store_n(&sd->sd_terminate, 1, __ATOMIC_RELAXED);
+        if (sd->sd_rest)
+                rest_pool_cancel(sd->sd_rest);
+        mtx_lock(&sd->sd_lock);
+        while (sd->sd_prefetch_workers > 0)
+                cnd_wait(&sd->sd_prefetch_cnd, &sd->sd_lock);
+        mtx_unlock(&sd->sd_lock);
+
+        if (sd->sd_cache)
+                serdes_cache_destroy(sd->sd_cache);
+        else
+                serdes_schemas_destroy(sd);
+
+        if (sd->sd_file)
+                schema_file_close(sd->sd_file);
+
+        if (sd->sd_shm)
+                schema_shm_close(sd->sd_shm);
+
+        if (sd->sd_rest)
+                rest_pool_destroy(sd->sd_rest);
 
         serdes_conf_destroy0(&sd->sd_conf);
 
+        cnd_destroy(&sd->sd_refresh_cnd);
+        cnd_destroy(&sd->sd_prefetch_cnd);
         mtx_destroy(&sd->sd_lock);
         free(sd);
 }
 
 serdes_t *serdes_new (serdes_conf_t *conf, char *errstr, size_t errstr_size) {
         serdes_t *sd;
+        rest_conf_t rconf;
 
         sd = calloc(1, sizeof(*sd));
-        LIST_INIT(&sd->sd_schemas);
         mtx_init(&sd->sd_lock, mtx_plain);
+        cnd_init(&sd->sd_prefetch_cnd);
+        cnd_init(&sd->sd_refresh_cnd);
+        serdes_gen_bump(sd);
 
         if (conf) {
                 serdes_conf_copy0(&sd->sd_conf, conf);
@@ -243,6 +651,17 @@ serdes_t *serdes_new (serdes_conf_t *conf, char *errstr, size_t errstr_size) {
         } else
                 serdes_conf_init(&sd->sd_conf);
 
+        if (sd->sd_conf.cache) {
+                /* Schemas are looked up in and loaded by the shared cache's
+                 * handle, this one only provides framing. */
+                sd->sd_cache = sd->sd_conf.cache;
+                __atomic_add_fetch(&sd->sd_cache->sc_refcnt, 1,
+                                   __ATOMIC_RELAXED);
+                return sd;
+        }
+
+        serdes_schemas_init(sd);
+
         if (!sd->sd_conf.schema_load_cb) {
 #ifndef ENABLE_AVRO_C
                 snprintf(errstr, errstr_size,
@@ -257,5 +676,112 @@ serdes_t *serdes_new (serdes_conf_t *conf, char *errstr, size_t errstr_size) {
 #endif
         }
 
+        rconf.max_async            = sd->sd_conf.prefetch_concurrency;
+        rconf.timeout_ms           = sd->sd_conf.request_timeout_ms;
+        rconf.connect_timeout_ms   = sd->sd_conf.connect_timeout_ms;
+        rconf.retries              = sd->sd_conf.retries;
+        rconf.retry_backoff_ms     = sd->sd_conf.retry_backoff_ms;
+        rconf.retry_backoff_max_ms = sd->sd_conf.retry_backoff_max_ms;
+        sd->sd_rest = rest_pool_new(&rconf);
+
+        if (sd->sd_conf.cache_path) {
+                char ferrstr[256];
+
+                /* Records are indexed now but only parsed on cache miss.
+                 * The file is only a cache: carry on without it
+                 * if it can't be opened. */
+                if (!(sd->sd_file = schema_file_open(sd->sd_conf.cache_path,
+                                                     ferrstr,
+                                                     sizeof(ferrstr))))
+                        serdes_log(sd, LOG_WARNING, "CACHEFILE", "%s",
+                                   ferrstr);
+        }
+
+        if (sd->sd_conf.shm_name) {
+                char ferrstr[256];
+
+                /* Like the cache file the segment is optional. */
+                if (!(sd->sd_shm = schema_shm_open(sd->sd_conf.shm_name,
+                                                   (size_t)sd->sd_conf.
+                                                   shm_size,
+                                                   ferrstr,
+                                                   sizeof(ferrstr))))
+                        serdes_log(sd, LOG_WARNING, "CACHESHM", "%s",
+                                   ferrstr);
+        }
+
+        if (sd->sd_conf.pin_subject_cnt > 0 &&
+            sd->sd_conf.latest_ttl_ms == 0) {
+                snprintf(errstr, errstr_size,
+                         "schema.cache.pin.subjects requires "
+                         "schema.cache.latest.ttl.ms to be non-zero");
+                serdes_destroy(sd);
+                return NULL;
+        }
+
+        if (sd->sd_conf.latest_refresh_ms > 0 &&
+            sd->sd_conf.latest_ttl_ms != 0 &&
+            serdes_refresh_start(sd, errstr, (int)errstr_size) == -1) {
+                serdes_destroy(sd);
+                return NULL;
+        }
+
+        if (sd->sd_conf.pin_id_cnt > 0 || sd->sd_conf.pin_subject_cnt > 0) {
+                int total = sd->sd_conf.pin_id_cnt +
+                        sd->sd_conf.pin_subject_cnt;
+                int timeout_ms = sd->sd_conf.request_timeout_ms > 0 ?
+                        sd->sd_conf.request_timeout_ms : -1;
+                int loaded;
+
+                /* Schemas are pinned as they are cached, those that
+                 * can't be loaded now are pinned when first looked up.
+                 * Don't hold up handle creation on a slow or unavailable
+                 * registry for longer than a request: lookups still
+                 * in progress finish in the background. */
+                loaded = serdes_schemas_prefetch(sd, sd->sd_conf.pin_ids,
+                                                 sd->sd_conf.pin_id_cnt,
+                                                 (const char **)sd->sd_conf.
+                                                 pin_subjects,
+                                                 sd->sd_conf.pin_subject_cnt,
+                                                 timeout_ms);
+                if (loaded < total)
+                        serdes_log(sd, LOG_WARNING, "PIN",
+                                   "Only %d/%d pinned schemas could be "
+                                   "loaded", loaded, total);
+        }
+
         return sd;
 }
+
+
+
+serdes_cache_t *serdes_cache_new (serdes_conf_t *conf,
+                                  char *errstr, size_t errstr_size) {
+        serdes_cache_t *cache;
+        serdes_t *sd;
+
+        if (conf && conf->cache) {
+                snprintf(errstr, errstr_size,
+                         "A shared schema cache can't be attached "
+                         "to another cache");
+                serdes_conf_destroy(conf);
+                return NULL;
+        }
+
+        if (!(sd = serdes_new(conf, errstr, errstr_size)))
+                return NULL;
+
+        cache = calloc(1, sizeof(*cache));
+        cache->sc_sd     = sd;
+        cache->sc_refcnt = 1;
+
+        return cache;
+}
+
+void serdes_cache_destroy (serdes_cache_t *cache) {
+        if (__atomic_sub_fetch(&cache->sc_refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+
+        serdes_destroy(cache->sc_sd);
+        free(cache);
+}
@@ -28,6 +28,7 @@
 typedef struct serdes_s serdes_t;
 typedef struct serdes_schema_s serdes_schema_t;
 typedef struct serdes_conf_s serdes_conf_t;
+typedef struct serdes_cache_s serdes_cache_t;
 
 
 
@@ -90,6 +91,11 @@ serdes_err_t serdes_conf_set (serdes_conf_t *sconf,
  * The unloader is responsible for freeing any memory or resources from the
  * loader callback.
  *
+ * Schemas whose definitions only differ cosmetically (whitespace, attribute
+ * order, `doc`, namespace notation) share one schema object: the loader is
+ * only called for the first of them and the unloader is called with the
+ * last of them to be freed.
+ *
  * Default: Avro-C library if ENABLE_AVRO_C is set at library buildtime, else none.
  */
 SERDES_EXPORT
@@ -122,6 +128,20 @@ SERDES_EXPORT
 void serdes_conf_set_opaque (serdes_conf_t *sconf, void *opaque);
 
 
+/**
+ * Attach handles created with this configuration to the shared schema
+ * cache `cache` (see serdes_cache_new()), or to a private schema cache
+ * if `cache` is NULL (the default).
+ *
+ * Schemas are then looked up in, fetched into and owned by the shared
+ * cache: the schema registry, schema cache and schema loader
+ * configuration of the handle are ignored in favour of the cache's,
+ * while the framing and logging configuration remain the handle's.
+ */
+SERDES_EXPORT
+void serdes_conf_set_cache (serdes_conf_t *sconf, serdes_cache_t *cache);
+
+
 /**
  * Creates a new configuration object with default settings.
  * The `...` var-args list is an optiona list of
@@ -150,6 +170,9 @@ serdes_conf_t *serdes_conf_new (char *errstr, int errstr_size, ...);
 
 /**
  * Remove schema from local cache and free memory.
+ *
+ * The memory is not freed until any references acquired with
+ * serdes_schema_acquire() have been released.
  */
 SERDES_EXPORT
 void serdes_schema_destroy (serdes_schema_t *ss);
@@ -161,7 +184,17 @@ void serdes_schema_destroy (serdes_schema_t *ss);
  * `name` and `id` are mutually exclusive.
  * Null value for `name` is `NULL` and `-1` for `id`.
  *
+ * A lookup by `name` resolves the subject's latest version, which is
+ * cached according to the `schema.cache.latest.ttl.ms` property.
+ *
+ * Cache misses are fetched from the schema registry without blocking
+ * lookups of other schemas, concurrent lookups of the same schema
+ * share a single registry request.
+ *
  * The returned schema will be fully loaded and immediately usable.
+ * It is owned by the local cache and is only valid until it is purged
+ * (see serdes_schemas_purge()), use serdes_schema_acquire() to hold on
+ * to a schema while purging runs concurrently.
  *
  * If the get or load fails NULL is returned and a human readable error
  * description is written to `errstr` of size `errstr_size`.
@@ -171,6 +204,46 @@ serdes_schema_t *serdes_schema_get (serdes_t *sd, const char *name, int id,
                                     char *errstr, int errstr_size);
 
 
+/**
+ * Same as serdes_schema_get() but returns a reference to the schema
+ * which keeps it valid, even if it is purged from the local cache,
+ * until released with serdes_schema_release().
+ *
+ * All references must be released before the serdes handle is destroyed.
+ */
+SERDES_EXPORT
+serdes_schema_t *serdes_schema_acquire (serdes_t *sd, const char *name, int id,
+                                        char *errstr, int errstr_size);
+
+/**
+ * Release a schema reference acquired with serdes_schema_acquire().
+ */
+SERDES_EXPORT
+void serdes_schema_release (serdes_schema_t *schema);
+
+
+/**
+ * Pin schema in the local cache: a pinned schema is neither purged
+ * (serdes_schemas_purge()) nor evicted to honour `schema.cache.max.count`
+ * and `schema.cache.max.bytes`, it may still be removed with
+ * serdes_schema_destroy().
+ *
+ * Pins nest: the schema is unpinned when serdes_schema_unpin() has been
+ * called as many times as serdes_schema_pin().
+ *
+ * See also the `schema.cache.pin.ids` and `schema.cache.pin.subjects`
+ * properties.
+ */
+SERDES_EXPORT
+void serdes_schema_pin (serdes_schema_t *schema);
+
+/**
+ * Remove a pin added with serdes_schema_pin().
+ */
+SERDES_EXPORT
+void serdes_schema_unpin (serdes_schema_t *schema);
+
+
 /**
  * Add schema definition to the local cache and stores the schema to remote
  * schema registry.
@@ -205,6 +278,10 @@ int serdes_schema_id (serdes_schema_t *schema);
  * Returns the schema name.
  * The returned pointer is only valid until the schema is destroyed.
  * NULL is returned if the name of the schema is not known.
+ *
+ * A schema registered under several subjects is cached once, by id:
+ * its name is that of the subject it was first looked up by, even when
+ * returned by a lookup by another subject's name.
  */
 SERDES_EXPORT
 const char *serdes_schema_name (serdes_schema_t *schema);
@@ -222,6 +299,7 @@ const char *serdes_schema_definition (serdes_schema_t *schema);
  * Returns the schema object.
  * It's type depends on the serdes_conf_set_schema_load_cb() configuration
  * and defaults to `avro_schema_t *`.
+ * The object may be shared with other schemas of equivalent definition.
  */
 SERDES_EXPORT
 void *serdes_schema_object (serdes_schema_t *schema);
@@ -229,6 +307,8 @@ void *serdes_schema_object (serdes_schema_t *schema);
 
 /**
  * Returns the serdes_t handle for a schema.
+ * For schemas of a shared cache this is the cache's internal handle,
+ * not the handle used to look up the schema.
  */
 SERDES_EXPORT
 serdes_t *serdes_schema_handle (serdes_schema_t *schema);
@@ -250,14 +330,42 @@ void *serdes_schema_opaque (serdes_schema_t *schema);
 
 /**
  * Purges any schemas from the local schema cache that have not been used
- * in `max_age` seconds.
+ * in `max_age` seconds, except pinned schemas (serdes_schema_pin()).
+ *
+ * Purged schemas that are referenced (serdes_schema_acquire()) are
+ * freed when their last reference is released, it is thus safe to
+ * purge while other threads are serializing or deserializing.
+ *
+ * Each call looks at a bounded number of schemas of each cache shard,
+ * least recently used first, and only locks the cache for short intervals,
+ * so this may be called frequently: if more schemas than that have
+ * expired the remaining ones are purged by the following calls.
  *
- * Returns the number of schemas removed.
+ * Returns the number of schemas removed by this call.
  */
 SERDES_EXPORT
 int serdes_schemas_purge (serdes_t *serdes, int max_age);
 
 
+/**
+ * Load the schemas with the `id_cnt` ids in `ids` and the latest schemas
+ * of the `subject_cnt` subjects in `subjects` into the local schema cache,
+ * e.g., to warm up the cache at startup.
+ *
+ * Lookups are performed concurrently by up to `schema.prefetch.concurrency`
+ * threads. The call returns when all schemas are loaded (or failed to load)
+ * or `timeout_ms` has elapsed (-1 for no timeout), in which case lookups in
+ * progress will finish in the background.
+ *
+ * Returns the number of schemas loaded, failures are logged as debug.
+ */
+SERDES_EXPORT
+int serdes_schemas_prefetch (serdes_t *sd,
+                             const int *ids, int id_cnt,
+                             const char **subjects, int subject_cnt,
+                             int timeout_ms);
+
+
 
 /*******************************************************************************
  *
@@ -287,6 +395,32 @@ SERDES_EXPORT
 void serdes_destroy (serdes_t *serdes);
 
 
+/**
+ * Create a schema cache that can be shared by multiple handles
+ * (see serdes_conf_set_cache()), e.g., handles with different framing,
+ * so that each schema is only fetched, parsed and kept once.
+ *
+ * `conf` provides the schema registry, schema cache and schema loader
+ * configuration of the cache and has the same ownership semantics as
+ * for serdes_new(). Caches don't nest: `conf` must not have a cache set
+ * with serdes_conf_set_cache().
+ *
+ * Returns a new cache on success or NULL on failure (error string
+ * written to `errstr`).
+ */
+SERDES_EXPORT
+serdes_cache_t *serdes_cache_new (serdes_conf_t *conf,
+                                  char *errstr, size_t errstr_size);
+
+/**
+ * Releases the application's reference to the cache.
+ * The cache and its schemas are freed when the last handle attached to it
+ * is destroyed.
+ */
+SERDES_EXPORT
+void serdes_cache_destroy (serdes_cache_t *cache);
+
+
 
 
 /**
@@ -306,10 +440,21 @@ size_t serdes_deserializer_framing_size (serdes_t *serdes);
  */
 size_t serdes_framing_write (serdes_schema_t *schema, char *payload, size_t size);
 
+/**
+ * Same as serdes_framing_write() but writes the serializer framing
+ * configured for handle `sd` rather than for the schema's handle,
+ * which differ for schemas of a shared cache (see serdes_cache_new()).
+ */
+size_t serdes_serializer_framing_write (serdes_t *sd, serdes_schema_t *schema,
+                                        char *payload, size_t size);
+
 /**
  * Read framing from `payload` (of size `size`) and extract the schema identifier
  * and look up and fetch the schema.
  *
+ * If the schema was not cached, the following schema ids are prefetched
+ * in the background as configured by `schema.prefetch.window`.
+ *
  * If any of these steps fail -1 will be returned and the reason is written
  * to `errstr`.
  *
@@ -320,3 +465,13 @@ size_t serdes_framing_write (serdes_schema_t *schema, char *payload, size_t size
 ssize_t serdes_framing_read (serdes_t *sd, const void **payloadp, size_t *sizep,
                              serdes_schema_t **schemap,
                              char *errstr, int errstr_size);
+
+/**
+ * Same as serdes_framing_read() but a reference is acquired on the
+ * schema returned in `*schemap`, which must be released with
+ * serdes_schema_release().
+ */
+ssize_t serdes_framing_read_acquire (serdes_t *sd,
+                                     const void **payloadp, size_t *sizep,
+                                     serdes_schema_t **schemap,
+                                     char *errstr, int errstr_size);
@@ -23,6 +23,10 @@
 #include "tinycthread.h"
 #include "serdes.h"
 #include "rest.h"
+#include "hashidx.h"
+#include "ebr.h"
+#include "schema-file.h"
+#include "schema-shm.h"
 
 
 #ifndef LOG_DEBUG
@@ -56,11 +60,58 @@ struct serdes_conf_s {
         url_list_t  schema_registry_urls;      /* CSV list of schema
                                                 * registry URLs. */
         int         debug;                     /* Debugging 1=enabled */
+        int         request_timeout_ms;        /* Schema registry request
+                                                * timeout, 0 = none */
+        int         connect_timeout_ms;        /* Schema registry connect
+                                                * timeout, 0 = default */
+        int         retries;                   /* Retries of failed schema
+                                                * registry requests */
+        int         retry_backoff_ms;          /* Initial retry backoff */
+        int         retry_backoff_max_ms;      /* Max retry backoff */
 
 
         serdes_framing_t   serializer_framing;   /* Serializer framing */
         serdes_framing_t deserializer_framing;   /* Deserializer framing */
 
+        int         thread_cache_size;         /* Entries in thread-local
+                                                * id cache (power of 2),
+                                                * 0 = disabled */
+        int         latest_ttl_ms;             /* How long a subject's
+                                                * "latest" schema is cached:
+                                                * -1 = forever, 0 = never */
+        int         latest_refresh_ms;         /* Background revalidation
+                                                * interval of cached
+                                                * "latest" schemas,
+                                                * 0 = disabled */
+        int         negative_ttl_ms;           /* How long failed lookups
+                                                * by id are cached,
+                                                * 0 = never */
+        int         prefetch_concurrency;      /* Max parallel lookups per
+                                                * serdes_schemas_prefetch() */
+        int         prefetch_window;           /* Following ids to prefetch
+                                                * on a framing id miss,
+                                                * 0 = disabled */
+        char       *cache_path;                /* Persistent schema cache
+                                                * file, or NULL */
+        char       *shm_name;                  /* Shared memory schema cache
+                                                * segment, or NULL */
+        int64_t     shm_size;                  /* Size of new shared memory
+                                                * segments */
+        int         max_count;                 /* Max cached schemas,
+                                                * 0 = unlimited */
+        int64_t     max_bytes;                 /* Max cached schema bytes,
+                                                * 0 = unlimited */
+        int         shard_cnt;                 /* Schema cache shards
+                                                * (power of 2) */
+        int        *pin_ids;                   /* Schema ids to pin */
+        int         pin_id_cnt;
+        char      **pin_subjects;              /* Subjects whose latest
+                                                * schema to pin */
+        int         pin_subject_cnt;
+
+        serdes_cache_t *cache;                 /* Shared schema cache to
+                                                * attach to, or NULL */
+
         /* Schema load/unload callbacks */
         void *(*schema_load_cb) (serdes_schema_t *ss,
                                  const char *definition, size_t definition_len,
@@ -78,12 +129,156 @@ struct serdes_conf_s {
 
 
 
+typedef struct serdes_inflight_s serdes_inflight_t;
+
+
+/**
+ * Shared schema cache (serdes_cache_new()): an internal handle owning
+ * the schemas of all handles attached to the cache.
+ */
+struct serdes_cache_s {
+        serdes_t     *sc_sd;                 /* Handle owning the schemas */
+        int           sc_refcnt;             /* Application's reference and
+                                              * attached handles' (atomic) */
+};
+
+
+/**
+ * Parsed schema object shared by all schemas with the same
+ * canonical form (see serdes_schema_canonical()).
+ */
+typedef struct serdes_schema_obj_s {
+        uint64_t      so_fingerprint;        /* CRC-64-AVRO of
+                                              * so_canonical */
+        char         *so_canonical;          /* Canonical form */
+        size_t        so_canonical_len;
+        void         *so_obj;                /* Parsed schema object */
+        int           so_refcnt;             /* Schemas using so_obj,
+                                              * protected by
+                                              * sd_objs_lock */
+} serdes_schema_obj_t;
+
+
+/**
+ * Subject's latest schema, indexed in sd_schemas_by_name.
+ * A schema registered under several subjects is the latest schema of
+ * each of them, while only cached once.
+ */
+typedef struct serdes_subject_s {
+        LIST_ENTRY(serdes_subject_s) sj_link; /* ss_subjects */
+        char            *sj_name;            /* Subject name */
+        struct serdes_schema_s *sj_ss;       /* Latest schema */
+        int64_t          sj_ts_latest;       /* When sj_ss was resolved
+                                              * (serdes_clock(), atomic) */
+} serdes_subject_t;
+
+/**
+ * Definition that resolved to a cached schema with a different
+ * definition, e.g., an added definition the registry already knows
+ * the normalized form of, see serdes_schema_alias0().
+ * Indexed by fingerprint in sd_schemas_by_fp, along with the schemas.
+ */
+typedef struct serdes_alias_s {
+        struct serdes_alias_s *sa_next;      /* ss_aliases */
+        uint64_t         sa_fingerprint;     /* CRC-64-AVRO of definition */
+        int              sa_definition_len;
+        char             sa_definition[];    /* Not nul-terminated */
+} serdes_alias_t;
+
+/**
+ * Schema cache shard ("schema.cache.shards"): the schema cache is
+ * partitioned by schema id, see serdes_shard().
+ */
+typedef struct serdes_shard_s {
+        mtx_t          sh_lock;                  /* Protects the shard.
+                                                  * Never held across
+                                                  * registry I/O. */
+        TAILQ_HEAD(serdes_schema_head, serdes_schema_s) sh_schemas;
+                                                 /* Schemas, in
+                                                  * approximate LRU order:
+                                                  * most recent first */
+        int            sh_schema_cnt;            /* Schemas on sh_schemas */
+        int64_t        sh_schema_bytes;          /* Sum of ss_bytes */
+        hashidx_t      sh_schemas_by_id;         /* sh_schemas indexed
+                                                  * by ss_id */
+        serdes_schema_t **sh_purgeq;             /* Purge queue: min-heap of
+                                                  * the sh_schema_cnt schemas
+                                                  * by ss_t_purgeq */
+        int            sh_purgeq_size;           /* Allocated entries */
+        LIST_HEAD(, serdes_inflight_s) sh_inflight; /* In-flight registry
+                                                     * requests for keys
+                                                     * of this shard */
+} serdes_shard_t;
+
 /**
  * Main serdes handle
  */
 struct serdes_s {
-        mtx_t          sd_lock;                  /* Protects sd_schemas */
-        LIST_HEAD(, serdes_schema_s) sd_schemas; /* Schema cache */
+        serdes_shard_t *sd_shards;               /* Schema cache shards */
+        int            sd_shard_cnt;             /* conf.shard_cnt */
+
+        mtx_t          sd_lock;                  /* Protects writes to
+                                                  * the indexes below and
+                                                  * ss_subjects. If a shard
+                                                  * lock is needed too it
+                                                  * must be acquired first. */
+        hashidx_t      sd_schemas_by_fp;         /* Cached schemas indexed
+                                                  * by ss_fingerprint */
+        hashidx_t      sd_schemas_by_name;       /* Subjects' latest schemas
+                                                  * (serdes_subject_t)
+                                                  * indexed by sj_name
+                                                  * hash */
+
+        int            sd_prefetch_workers;      /* Running prefetch worker
+                                                  * threads, protected by
+                                                  * sd_lock */
+        cnd_t          sd_prefetch_cnd;          /* Signalled when a prefetch
+                                                  * worker exits */
+        int            sd_speculating;           /* Speculative prefetch
+                                                  * in progress: pending
+                                                  * fetches (atomic) */
+        int            sd_terminate;             /* serdes_destroy() called:
+                                                  * prefetch workers stop
+                                                  * (atomic) */
+
+        thrd_t         sd_refresh_thrd;          /* Background refresher of
+                                                  * "latest" schemas */
+        int            sd_refresh_run;           /* Refresher is running
+                                                  * (atomic, set under
+                                                  * sd_lock) */
+        cnd_t          sd_refresh_cnd;           /* Wakes up the refresher
+                                                  * on termination */
+
+        rest_pool_t   *sd_rest;                  /* Schema registry
+                                                  * connections, NULL if
+                                                  * attached to a shared
+                                                  * cache */
+
+        schema_file_t *sd_file;                  /* Persistent schema cache
+                                                  * ("schema.cache.path"),
+                                                  * or NULL */
+        schema_shm_t  *sd_shm;                   /* Shared memory schema cache
+                                                  * ("schema.cache.shm.name"),
+                                                  * or NULL */
+
+        uint64_t       sd_gen;                   /* Cache generation (atomic),
+                                                  * process-wide unique,
+                                                  * see serdes_gen_bump() */
+
+        ebr_t          sd_ebr;                   /* Reclamation of schemas
+                                                  * and index tables
+                                                  * removed from the cache,
+                                                  * allows lock-free lookups
+                                                  * in the schema indexes. */
+
+        mtx_t          sd_objs_lock;             /* Protects sd_objs */
+        hashidx_t      sd_objs;                  /* Shared parsed schema
+                                                  * objects indexed by
+                                                  * so_fingerprint */
+
+        serdes_cache_t *sd_cache;                /* Attached shared schema
+                                                  * cache, or NULL if the
+                                                  * handle has its own */
 
         struct serdes_conf_s sd_conf;                  /* Configuration */
 };
@@ -93,20 +288,59 @@ struct serdes_s {
  * Cached schema.
  */
 struct serdes_schema_s {
-        LIST_ENTRY(serdes_schema_s) ss_link; /* serdes_t.sd_schemas list */
+        TAILQ_ENTRY(serdes_schema_s) ss_link; /* serdes_shard_t.sh_schemas */
         int           ss_id;                 /* Schema registry's id of schema*/
         char         *ss_name;               /* Name of schema */
 
         char         *ss_definition;         /* Schema definition */
         int           ss_definition_len;     /* Schema definition length */
+        uint64_t      ss_fingerprint;        /* CRC-64-AVRO of definition */
 
-        time_t        ss_t_last_used;        /* Timestamp of last use. */
+        int64_t       ss_t_last_used;        /* Timestamp of last use
+                                              * (serdes_clock_coarse(),
+                                              *  atomic). */
+
+        LIST_HEAD(, serdes_subject_s) ss_subjects; /* Subjects this
+                                              * schema was resolved as the
+                                              * latest version of.
+                                              * Protected by sd_lock. */
+
+        serdes_alias_t *ss_aliases;          /* Other definitions of this
+                                              * schema (atomic): prepended
+                                              * under sd_lock, freed with
+                                              * the schema. */
 
         void         *ss_schema_obj;         /* Schema object, type depends
                                               * on configured load_cb */
-
-        int           ss_linked;             /* On sd_schemas list */
-        mtx_t         ss_lock;               /* Protects ss_t_last_used */
+        serdes_schema_obj_t *ss_obj;         /* Shared ss_schema_obj,
+                                              * or NULL if the definition
+                                              * has no canonical form */
+
+        char         *ss_errstr;             /* Negative cache entry:
+                                              * error of the failed lookup,
+                                              * else NULL. */
+        long          ss_errcode;            /* Registry response code of
+                                              * failed fetch */
+        int64_t       ss_ts_expiry;          /* Negative entry expiry
+                                              * (serdes_clock()) */
+        int           ss_speculative;        /* Negative entry of a
+                                              * speculative prefetch:
+                                              * ignored by other lookups */
+
+        int           ss_refcnt;             /* References (atomic):
+                                              * the cache's while linked
+                                              * and the application's
+                                              * (serdes_schema_acquire()) */
+        int           ss_linked;             /* On sh_schemas list */
+        int64_t       ss_bytes;              /* Accounted memory size
+                                              * while linked */
+        int           ss_lru_ref;            /* Used since last LRU
+                                              * eviction pass (atomic) */
+        int           ss_pinned;             /* Pins (atomic): exempt from
+                                              * purge and eviction if > 0 */
+        int64_t       ss_t_purgeq;           /* ss_t_last_used when last
+                                              * (re)queued on sh_purgeq */
+        int           ss_purgeq_idx;         /* Position in sh_purgeq */
         serdes_t     *ss_sd;                 /* Back-pointer to serdes_t */
         void         *ss_opaque;             /* Application opaque */
 };
@@ -116,6 +350,87 @@ struct serdes_schema_s {
 void serdes_log (serdes_t *sd, int level, const char *fac,
                  const char *fmt, ...);
 
+uint64_t serdes_fingerprint64 (const void *buf, size_t len);
+
+/**
+ * Returns the canonical form (free() when done) of Avro schema
+ * `definition` with its length in `*canonical_lenp`, or NULL if the
+ * definition is not valid JSON or not a schema.
+ */
+char *serdes_schema_canonical (const char *definition, size_t definition_len,
+                               size_t *canonical_lenp);
+
+/**
+ * Returns the handle owning the schema cache of handle `sd`:
+ * the shared cache's if attached to one, else `sd` itself.
+ */
+static __inline serdes_t *serdes_cache_sd (serdes_t *sd) {
+        return sd->sd_cache ? sd->sd_cache->sc_sd : sd;
+}
+
+/**
+ * Returns the shard of cache key `key`: a schema id, for the shard
+ * holding the schema, or a definition fingerprint or subject name hash
+ * for the shard tracking in-flight requests for the key.
+ */
+static __inline serdes_shard_t *serdes_shard (serdes_t *sd, uint64_t key) {
+        return &sd->sd_shards[((key * 0x9e3779b97f4a7c15ULL) >> 32) &
+                              (uint64_t)(sd->sd_shard_cnt - 1)];
+}
+
+/**
+ * Look up schema `id` read from a message's framing, as
+ * serdes_schema_get() or serdes_schema_acquire() (if `do_ref`), and if it
+ * was not cached prefetch the following ids in the background
+ * ("schema.prefetch.window").
+ */
+serdes_schema_t *serdes_schema_get_framed (serdes_t *sd, int id, int do_ref,
+                                           char *errstr, int errstr_size);
+
+/**
+ * Start the background refresher of cached "latest" schemas
+ * ("schema.cache.latest.refresh.ms").
+ *
+ * Returns -1 on failure.
+ */
+int serdes_refresh_start (serdes_t *sd, char *errstr, int errstr_size);
+
+/**
+ * Stop the background refresher and wait for it to exit,
+ * if it is running.
+ */
+void serdes_refresh_stop (serdes_t *sd);
+
+/**
+ * Assign the handle a new cache generation, invalidating any
+ * thread-local cache entries for the handle.
+ */
+void serdes_gen_bump (serdes_t *sd);
+
+
+/**
+ * Returns a monotonic clock in microseconds.
+ */
+static __inline int64_t serdes_clock (void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * Returns a cheap monotonic clock in seconds, with a resolution
+ * of a clock tick where supported.
+ */
+static __inline int64_t serdes_clock_coarse (void) {
+        struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+        return (int64_t)ts.tv_sec;
+}
+
 
 
 
@@ -21,10 +21,10 @@
 
 
 
-serdes_err_t serdes_schema_serialize_avro (serdes_schema_t *ss,
-                                           avro_value_t *avro,
-                                           void **payloadp, size_t *sizep,
-                                           char *errstr, int errstr_size) {
+serdes_err_t serdes_serialize_avro (serdes_t *sd, serdes_schema_t *ss,
+                                    avro_value_t *avro,
+                                    void **payloadp, size_t *sizep,
+                                    char *errstr, int errstr_size) {
         char *payload;
         size_t size;
         avro_writer_t writer;
@@ -40,7 +40,7 @@ serdes_err_t serdes_schema_serialize_avro (serdes_schema_t *ss,
                 return SERDES_ERR_SERIALIZER;
         }
 
-        size += serdes_serializer_framing_size(ss->ss_sd);
+        size += serdes_serializer_framing_size(sd);
 
         if (!payloadp) {
                 /* Application is querying for buffer size */
@@ -66,7 +66,7 @@ serdes_err_t serdes_schema_serialize_avro (serdes_schema_t *ss,
         }
 
         /* Write framing, if any. */
-        of = serdes_framing_write(ss, payload, size);
+        of = serdes_serializer_framing_write(sd, ss, payload, size);
         if (of == -1) {
                 snprintf(errstr, errstr_size, "Not enough space for framing");
                 if (!*payloadp)
@@ -99,3 +99,11 @@ serdes_err_t serdes_schema_serialize_avro (serdes_schema_t *ss,
         return SERDES_ERR_OK;
 }
 
+
+serdes_err_t serdes_schema_serialize_avro (serdes_schema_t *ss,
+                                           avro_value_t *avro,
+                                           void **payloadp, size_t *sizep,
+                                           char *errstr, int errstr_size) {
+        return serdes_serialize_avro(ss->ss_sd, ss, avro, payloadp, sizep,
+                                     errstr, errstr_size);
+}
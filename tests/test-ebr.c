@@ -0,0 +1,179 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Epoch-based reclamation unit tests
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ebr.h"
+
+#include "test.h"
+
+
+#define OBJ_MAGIC  0x4f424a4fU
+
+struct obj {
+        unsigned int magic;
+        int          seq;
+};
+
+static struct obj *obj_new (int seq) {
+        struct obj *obj = malloc(sizeof(*obj));
+        obj->magic = OBJ_MAGIC;
+        obj->seq   = seq;
+        return obj;
+}
+
+static void obj_free_cb (void *ptr, void *opaque) {
+        struct obj *obj = ptr;
+
+        if (opaque)
+                (*(int *)opaque)++;
+
+        /* Poison: a reader seeing this has used a freed object,
+         * if not caught by the memory checker. */
+        obj->magic = 0;
+        free(obj);
+}
+
+
+static void test_reclaim (void) {
+        ebr_t ebr;
+        int freed = 0;
+        int token;
+
+        ebr_init(&ebr);
+
+        TEST_ASSERT(ebr_reclaim(&ebr) == 0, "nothing retired");
+
+        /* No readers: freed right away. */
+        ebr_retire(&ebr, obj_new(1), obj_free_cb, &freed);
+        TEST_ASSERT(ebr_reclaim(&ebr) == 1, "no readers");
+        TEST_ASSERT(freed == 1, "freed %d", freed);
+
+        /* A reader that entered before the object was retired
+         * may still access it. */
+        token = ebr_enter(&ebr);
+        ebr_retire(&ebr, obj_new(2), obj_free_cb, &freed);
+        TEST_ASSERT(ebr_reclaim(&ebr) == 0, "reader active");
+        TEST_ASSERT(ebr_reclaim(&ebr) == 0, "reader still active");
+        TEST_ASSERT(freed == 1, "freed %d", freed);
+        ebr_leave(&ebr, token);
+        TEST_ASSERT(ebr_reclaim(&ebr) == 1, "reader left");
+        TEST_ASSERT(freed == 2, "freed %d", freed);
+
+        /* A reader that entered after the object was retired
+         * can't hold it up forever: it is freed once
+         * that reader has left. */
+        ebr_retire(&ebr, obj_new(3), obj_free_cb, &freed);
+        token = ebr_enter(&ebr);
+        ebr_reclaim(&ebr);
+        ebr_leave(&ebr, token);
+        ebr_reclaim(&ebr);
+        TEST_ASSERT(freed == 3, "freed %d", freed);
+
+        /* Objects still in limbo are freed on destroy. */
+        token = ebr_enter(&ebr);
+        ebr_retire(&ebr, obj_new(4), obj_free_cb, &freed);
+        ebr_retire(&ebr, obj_new(5), obj_free_cb, &freed);
+        TEST_ASSERT(ebr_reclaim(&ebr) == 0, "reader active");
+        ebr_leave(&ebr, token);
+        ebr_destroy(&ebr);
+        TEST_ASSERT(freed == 5, "freed %d", freed);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * Lock-free readers racing with a writer replacing and retiring
+ * the shared object: no reader may see a freed object.
+ */
+#define READER_CNT  4
+#define WRITE_CNT   20000
+
+static ebr_t shared_ebr;
+static struct obj *shared_obj;
+static int writer_done;
+
+static int reader_main (void *arg) {
+        int reads = 0;
+
+        while (!__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE)) {
+                int token = ebr_enter(&shared_ebr);
+                struct obj *obj = __atomic_load_n(&shared_obj,
+                                                  __ATOMIC_ACQUIRE);
+
+                TEST_ASSERT(obj->magic == OBJ_MAGIC,
+                            "object %d used after free", obj->seq);
+                ebr_leave(&shared_ebr, token);
+                reads++;
+        }
+
+        *(int *)arg = reads;
+        return 0;
+}
+
+static void test_concurrent (void) {
+        thrd_t thrds[READER_CNT];
+        int reads[READER_CNT];
+        int freed = 0;
+        int i;
+
+        ebr_init(&shared_ebr);
+        shared_obj = obj_new(0);
+
+        for (i = 0 ; i < READER_CNT ; i++)
+                TEST_ASSERT(thrd_create(&thrds[i], reader_main,
+                                        &reads[i]) == thrd_success,
+                            "thrd_create");
+
+        for (i = 1 ; i <= WRITE_CNT ; i++) {
+                struct obj *old = shared_obj;
+
+                __atomic_store_n(&shared_obj, obj_new(i), __ATOMIC_RELEASE);
+                ebr_retire(&shared_ebr, old, obj_free_cb, &freed);
+                ebr_reclaim(&shared_ebr);
+        }
+
+        __atomic_store_n(&writer_done, 1, __ATOMIC_RELEASE);
+        for (i = 0 ; i < READER_CNT ; i++)
+                thrd_join(thrds[i], NULL);
+
+        /* Readers don't block reclamation: most objects must have
+         * been freed while they were running. */
+        TEST_ASSERT(freed > WRITE_CNT / 2, "only %d/%d objects reclaimed",
+                    freed, WRITE_CNT);
+
+        ebr_reclaim(&shared_ebr);
+        TEST_ASSERT(freed == WRITE_CNT, "%d/%d objects reclaimed",
+                    freed, WRITE_CNT);
+
+        obj_free_cb(shared_obj, NULL);
+        ebr_destroy(&shared_ebr);
+
+        TEST_PASSED();
+}
+
+
+int main (int argc, char **argv) {
+        test_reclaim();
+        test_concurrent();
+        return 0;
+}
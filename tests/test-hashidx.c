@@ -0,0 +1,185 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * hashidx unit tests
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hashidx.h"
+
+#include "test.h"
+
+
+/* Values are pointers into this array: val(i) */
+static char vals[100000];
+#define val(i)  ((void *)&vals[(i)])
+
+
+/**
+ * Returns the number of values found for `key`.
+ */
+static int find_cnt (const hashidx_t *hi, uint64_t key) {
+        size_t pos = 0;
+        int cnt = 0;
+
+        while (hashidx_find(hi, key, &pos))
+                cnt++;
+
+        return cnt;
+}
+
+
+static void test_basic (void) {
+        hashidx_t hi;
+        size_t pos = 0;
+
+        hashidx_init(&hi, NULL, NULL);
+
+        TEST_ASSERT(!hashidx_find(&hi, 1, &pos), "empty index");
+        TEST_ASSERT(!hashidx_remove(&hi, 1, val(1)), "empty index");
+
+        hashidx_insert(&hi, 1, val(1));
+        hashidx_insert(&hi, 2, val(2));
+
+        pos = 0;
+        TEST_ASSERT(hashidx_find(&hi, 1, &pos) == val(1), "key 1");
+        TEST_ASSERT(!hashidx_find(&hi, 1, &pos), "key 1 has one value");
+        TEST_ASSERT(!hashidx_find(&hi, 1, &pos), "iterator is at end");
+        pos = 0;
+        TEST_ASSERT(hashidx_find(&hi, 2, &pos) == val(2), "key 2");
+        pos = 0;
+        TEST_ASSERT(!hashidx_find(&hi, 3, &pos), "key 3 not inserted");
+
+        /* Removal must match both key and value. */
+        TEST_ASSERT(!hashidx_remove(&hi, 1, val(2)), "wrong value");
+        TEST_ASSERT(!hashidx_remove(&hi, 3, val(1)), "wrong key");
+        TEST_ASSERT(hashidx_remove(&hi, 1, val(1)), "key 1");
+        TEST_ASSERT(!hashidx_remove(&hi, 1, val(1)), "already removed");
+        TEST_ASSERT(hi.cnt == 1, "cnt %zu", hi.cnt);
+        TEST_ASSERT(find_cnt(&hi, 1) == 0, "key 1 removed");
+        TEST_ASSERT(find_cnt(&hi, 2) == 1, "key 2 remains");
+
+        hashidx_destroy(&hi);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * Values for the same key share a probe sequence: removing one
+ * must leave a tombstone that doesn't hide the following ones.
+ */
+static void test_tombstones (void) {
+        hashidx_t hi;
+        int i;
+
+        hashidx_init(&hi, NULL, NULL);
+
+        for (i = 0 ; i < 5 ; i++)
+                hashidx_insert(&hi, 42, val(i));
+        TEST_ASSERT(find_cnt(&hi, 42) == 5, "5 values");
+
+        TEST_ASSERT(hashidx_remove(&hi, 42, val(0)), "first");
+        TEST_ASSERT(hashidx_remove(&hi, 42, val(2)), "middle");
+        TEST_ASSERT(find_cnt(&hi, 42) == 3, "%d values after removal",
+                    find_cnt(&hi, 42));
+        TEST_ASSERT(hashidx_remove(&hi, 42, val(4)), "last");
+        TEST_ASSERT(hashidx_remove(&hi, 42, val(3)), "behind tombstone");
+        TEST_ASSERT(find_cnt(&hi, 42) == 1, "one value left");
+        TEST_ASSERT(hi.cnt == 1, "cnt %zu", hi.cnt);
+
+        /* Tombstones count towards the load factor and are dropped
+         * when the table is rebuilt: churn must not grow the table. */
+        for (i = 0 ; i < 10000 ; i++) {
+                hashidx_insert(&hi, 1000 + i, val(i));
+                TEST_ASSERT(hashidx_remove(&hi, 1000 + i, val(i)),
+                            "churn %d", i);
+                TEST_ASSERT(hi.used * 2 <= hi.tbl->size,
+                            "%zu used slots out of %zu",
+                            hi.used, hi.tbl->size);
+        }
+        TEST_ASSERT(hi.tbl->size == 16, "table grew to %zu slots",
+                    hi.tbl->size);
+        TEST_ASSERT(find_cnt(&hi, 42) == 1, "value survived rebuilds");
+
+        hashidx_destroy(&hi);
+
+        TEST_PASSED();
+}
+
+
+static int retire_cnt;
+
+static void retire_cb (void *ptr, void *opaque) {
+        TEST_ASSERT(opaque == &retire_cnt, "opaque");
+        retire_cnt++;
+        free(ptr);
+}
+
+/**
+ * Growing the table keeps all entries and retires replaced tables.
+ */
+static void test_resize (void) {
+        hashidx_t hi;
+        const struct hashidx_tbl *tbl;
+        int cnt = (int)sizeof(vals);
+        int i;
+
+        hashidx_init(&hi, retire_cb, &retire_cnt);
+
+        hashidx_insert(&hi, 0, val(0));
+        tbl = hi.tbl;
+
+        for (i = 1 ; i < cnt ; i++)
+                hashidx_insert(&hi, (uint64_t)i, val(i));
+
+        TEST_ASSERT(hi.tbl != tbl, "table not replaced");
+        TEST_ASSERT(retire_cnt > 0, "replaced tables not retired");
+        TEST_ASSERT(hi.cnt == (size_t)cnt, "cnt %zu", hi.cnt);
+        TEST_ASSERT(hi.used * 2 <= hi.tbl->size,
+                    "%zu used slots out of %zu", hi.used, hi.tbl->size);
+
+        for (i = 0 ; i < cnt ; i++) {
+                size_t pos = 0;
+                TEST_ASSERT(hashidx_find(&hi, (uint64_t)i, &pos) == val(i),
+                            "key %d", i);
+                TEST_ASSERT(!hashidx_find(&hi, (uint64_t)i, &pos),
+                            "key %d has one value", i);
+        }
+
+        /* Remove every other entry, the rest must still be found. */
+        for (i = 0 ; i < cnt ; i += 2)
+                TEST_ASSERT(hashidx_remove(&hi, (uint64_t)i, val(i)),
+                            "key %d", i);
+        for (i = 0 ; i < cnt ; i++)
+                TEST_ASSERT(find_cnt(&hi, (uint64_t)i) == (i & 1),
+                            "key %d", i);
+
+        hashidx_destroy(&hi);
+
+        TEST_PASSED();
+}
+
+
+int main (int argc, char **argv) {
+        test_basic();
+        test_tombstones();
+        test_resize();
+        return 0;
+}
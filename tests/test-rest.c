@@ -0,0 +1,480 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * REST client unit tests: URL selection and health, retries and backoff.
+ *
+ * Requests are sent to a minimal HTTP server run by the test.
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/* Include the implementation to test its internal functions. */
+#include "../src/rest.c"
+
+#include "test.h"
+
+
+/**
+ * Test HTTP server: responds to each request (one per connection)
+ * with the next response code of `srv_codes`, repeating the last one.
+ */
+static int srv_fd = -1;
+static int srv_port;
+static int srv_run;
+static thrd_t srv_thrd;
+static const int *srv_codes;
+static int srv_code_cnt;
+static int srv_req_cnt;      /* Requests received (atomic) */
+
+static void srv_handle (int fd) {
+        char buf[4096], resp[256];
+        size_t len = 0;
+        ssize_t r;
+        int i, code;
+
+        /* Read the request headers, requests have no body. */
+        while (len < sizeof(buf) - 1 &&
+               (r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+                len += (size_t)r;
+                buf[len] = '\0';
+                if (strstr(buf, "\r\n\r\n"))
+                        break;
+        }
+
+        i = __atomic_fetch_add(&srv_req_cnt, 1, __ATOMIC_SEQ_CST);
+        code = srv_codes[i < srv_code_cnt ? i : srv_code_cnt - 1];
+
+        len = (size_t)snprintf(resp, sizeof(resp),
+                               "HTTP/1.1 %d Test\r\n"
+                               "Content-Type: application/json\r\n"
+                               "Content-Length: %d\r\n"
+                               "Connection: close\r\n"
+                               "\r\n"
+                               "{\"req\":%04d}",
+                               code, (int)strlen("{\"req\":0000}"), i);
+        if (write(fd, resp, len) != (ssize_t)len)
+                fprintf(stderr, "%s: write failed\n", __FUNCTION__);
+}
+
+static int srv_main (void *arg) {
+        while (__atomic_load_n(&srv_run, __ATOMIC_SEQ_CST)) {
+                struct pollfd pfd = { .fd = srv_fd, .events = POLLIN };
+                int fd;
+
+                if (poll(&pfd, 1, 100) <= 0 ||
+                    (fd = accept(srv_fd, NULL, NULL)) == -1)
+                        continue;
+
+                srv_handle(fd);
+                close(fd);
+        }
+
+        return 0;
+}
+
+/**
+ * Returns a socket listening on a free local port, in `*portp`.
+ */
+static int listen_any (int *portp) {
+        struct sockaddr_in sin = { .sin_family = AF_INET };
+        socklen_t sinlen = sizeof(sin);
+        int fd;
+
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        TEST_ASSERT((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1, "socket");
+        TEST_ASSERT(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0,
+                    "bind");
+        TEST_ASSERT(listen(fd, 16) == 0, "listen");
+        TEST_ASSERT(getsockname(fd, (struct sockaddr *)&sin, &sinlen) == 0,
+                    "getsockname");
+        *portp = ntohs(sin.sin_port);
+
+        return fd;
+}
+
+static void srv_start (void) {
+        srv_fd = listen_any(&srv_port);
+        srv_run = 1;
+        TEST_ASSERT(thrd_create(&srv_thrd, srv_main, NULL) == thrd_success,
+                    "thrd_create");
+}
+
+static void srv_stop (void) {
+        __atomic_store_n(&srv_run, 0, __ATOMIC_SEQ_CST);
+        thrd_join(srv_thrd, NULL);
+        close(srv_fd);
+}
+
+/**
+ * Set the server's response codes for the following requests.
+ */
+static void srv_respond (const int *codes, int cnt) {
+        srv_codes    = codes;
+        srv_code_cnt = cnt;
+        __atomic_store_n(&srv_req_cnt, 0, __ATOMIC_SEQ_CST);
+}
+
+#define SRV_RESPOND(codes...) do {                                      \
+                static const int _codes[] = { codes };                  \
+                srv_respond(_codes, sizeof(_codes) / sizeof(*_codes));  \
+        } while (0)
+
+
+/**
+ * Returns the URL of a local port nothing listens on:
+ * connections are refused.
+ */
+static void refused_url (char *dst, size_t size) {
+        int port;
+        int fd = listen_any(&port);
+
+        close(fd);
+        snprintf(dst, size, "http://127.0.0.1:%d", port);
+}
+
+
+static rest_pool_t *pool_new (int retries) {
+        rest_conf_t conf = {
+                .max_async            = 4,
+                .timeout_ms           = 5000,
+                .connect_timeout_ms   = 1000,
+                .retries              = retries,
+                .retry_backoff_ms     = 1,
+                .retry_backoff_max_ms = 10
+        };
+
+        return rest_pool_new(&conf);
+}
+
+
+static void test_backoff (void) {
+        rest_conf_t conf = {
+                .retry_backoff_ms     = 100,
+                .retry_backoff_max_ms = 1000
+        };
+        rest_pool_t *pool = rest_pool_new(&conf);
+        int retry, i;
+
+        for (retry = 1 ; retry <= 40 ; retry++) {
+                int64_t max = (int64_t)100 << (retry < 30 ? retry - 1 : 30);
+                int first = -1, same = 1;
+
+                if (max > 1000)
+                        max = 1000;
+
+                /* A random half (or more) of the exponential backoff */
+                for (i = 0 ; i < 100 ; i++) {
+                        int backoff = rest_retry_backoff_ms(pool, retry);
+
+                        TEST_ASSERT(backoff >= max / 2 && backoff <= max,
+                                    "retry %d: backoff %d not in %d..%d",
+                                    retry, backoff, (int)max / 2, (int)max);
+                        if (first == -1)
+                                first = backoff;
+                        else if (backoff != first)
+                                same = 0;
+                }
+
+                TEST_ASSERT(!same, "retry %d: no jitter: backoff always %d",
+                            retry, first);
+        }
+
+        rest_pool_destroy(pool);
+
+        /* No backoff */
+        conf.retry_backoff_ms = 0;
+        pool = rest_pool_new(&conf);
+        TEST_ASSERT(rest_retry_backoff_ms(pool, 1) == 0, "backoff");
+        rest_pool_destroy(pool);
+
+        TEST_PASSED();
+}
+
+
+static void test_url_select (void) {
+        url_list_t ul;
+        char tried[3] = { 0 };
+        int64_t now;
+        int i;
+
+        TEST_ASSERT(url_list_parse(&ul, "http://a,http://b,http://c") == 3,
+                    "parse");
+
+        /* URLs with unknown latency first */
+        TEST_ASSERT(url_list_select(&ul, tried) == 0, "first URL");
+        url_list_report(&ul, 0, 1, 100);
+        TEST_ASSERT(url_list_select(&ul, tried) == 1, "unmeasured URL");
+        url_list_report(&ul, 1, 1, 50);
+        TEST_ASSERT(url_list_select(&ul, tried) == 2, "unmeasured URL");
+        url_list_report(&ul, 2, 1, 200);
+
+        /* Then the fastest, skipping those already tried */
+        TEST_ASSERT(url_list_select(&ul, tried) == 1, "fastest URL");
+        tried[1] = 1;
+        TEST_ASSERT(url_list_select(&ul, tried) == 0, "second fastest URL");
+        tried[0] = tried[2] = 1;
+        TEST_ASSERT(url_list_select(&ul, tried) == -1, "all tried");
+        memset(tried, 0, sizeof(tried));
+
+        /* Latency is averaged: a single slow request doesn't make
+         * the fastest URL the slowest. */
+        url_list_report(&ul, 1, 1, 400);
+        TEST_ASSERT(url_list_select(&ul, tried) == 1, "fastest URL");
+
+        /* Out of rotation after consecutive failures only */
+        for (i = 0 ; i < URL_MAX_FAILS - 1 ; i++)
+                url_list_report(&ul, 1, 0, 0);
+        url_list_report(&ul, 1, 1, 50);
+        for (i = 0 ; i < URL_MAX_FAILS - 1 ; i++)
+                url_list_report(&ul, 1, 0, 0);
+        TEST_ASSERT(url_list_select(&ul, tried) == 1, "URL in rotation");
+        url_list_report(&ul, 1, 0, 0);
+        TEST_ASSERT(ul.health[1].down_until > 0, "URL in rotation");
+        TEST_ASSERT(url_list_select(&ul, tried) == 0,
+                    "failed URL selected");
+
+        /* All URLs down: the first one back up is tried. */
+        for (i = 0 ; i < URL_MAX_FAILS ; i++) {
+                url_list_report(&ul, 0, 0, 0);
+                url_list_report(&ul, 2, 0, 0);
+        }
+        now = rest_clock_ms();
+        ul.health[0].down_until = now + 3000;
+        ul.health[1].down_until = now + 1000;
+        ul.health[2].down_until = now + 2000;
+        TEST_ASSERT(url_list_select(&ul, tried) == 1, "first URL back up");
+        tried[1] = 1;
+        TEST_ASSERT(url_list_select(&ul, tried) == 2, "second URL back up");
+        memset(tried, 0, sizeof(tried));
+
+        /* Cooldown over: a single request probes the URL. */
+        ul.health[2].down_until = now - 1;
+        TEST_ASSERT(url_list_select(&ul, tried) == 2, "probe");
+        TEST_ASSERT(ul.health[2].down_until > now, "probe not claimed");
+        TEST_ASSERT(url_list_select(&ul, tried) == 1, "probed twice");
+
+        /* Failed probe: out for another cooldown period,
+         * successful probe: back in rotation. */
+        url_list_report(&ul, 2, 0, 0);
+        TEST_ASSERT(ul.health[2].down_until > now, "failed probe");
+        ul.health[2].down_until = now - 1;
+        TEST_ASSERT(url_list_select(&ul, tried) == 2, "probe");
+        url_list_report(&ul, 2, 1, 200);
+        TEST_ASSERT(ul.health[2].down_until == 0 && ul.health[2].fails == 0,
+                    "successful probe");
+        TEST_ASSERT(url_list_select(&ul, tried) == 2, "URL back in rotation");
+
+        url_list_clear(&ul);
+
+        TEST_PASSED();
+}
+
+
+static void test_retry (void) {
+        rest_pool_t *pool;
+        rest_response_t *rr;
+        url_list_t ul;
+        char url[64];
+
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d", srv_port);
+
+        /* Server errors are retried */
+        url_list_parse(&ul, url);
+        pool = pool_new(2);
+        SRV_RESPOND(503, 503, 200);
+        rr = rest_get(pool, &ul, "/test");
+        TEST_ASSERT(rr->code == 200, "code %ld", rr->code);
+        TEST_ASSERT(rr->len == 12 && !strncmp(rr->payload, "{\"req\":0002}",
+                                              rr->len),
+                    "payload %.*s", rr->len, rr->payload);
+        TEST_ASSERT(srv_req_cnt == 3, "%d requests", srv_req_cnt);
+        rest_response_destroy(rr);
+
+        /* .. up to `retries` times */
+        SRV_RESPOND(500);
+        rr = rest_get(pool, &ul, "/test");
+        TEST_ASSERT(rr->code == 500, "code %ld", rr->code);
+        TEST_ASSERT(srv_req_cnt == 3, "%d requests", srv_req_cnt);
+        rest_response_destroy(rr);
+        rest_pool_destroy(pool);
+        url_list_clear(&ul);
+
+        /* Other failures are terminal */
+        url_list_parse(&ul, url);
+        pool = pool_new(2);
+        SRV_RESPOND(404, 200);
+        rr = rest_post(pool, &ul, "{}", 2, "/test");
+        TEST_ASSERT(rr->code == 404, "code %ld", rr->code);
+        TEST_ASSERT(srv_req_cnt == 1, "%d requests", srv_req_cnt);
+        rest_response_destroy(rr);
+
+        /* No retries */
+        rest_pool_destroy(pool);
+        pool = pool_new(0);
+        SRV_RESPOND(503, 200);
+        rr = rest_get(pool, &ul, "/test");
+        TEST_ASSERT(rr->code == 503, "code %ld", rr->code);
+        TEST_ASSERT(srv_req_cnt == 1, "%d requests", srv_req_cnt);
+        rest_response_destroy(rr);
+        rest_pool_destroy(pool);
+        url_list_clear(&ul);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * Requests fail over to the next URL on connection failures,
+ * and a URL failing repeatedly is no longer tried.
+ */
+static void test_failover (void) {
+        rest_pool_t *pool;
+        rest_response_t *rr;
+        url_list_t ul;
+        char urls[128], down[64];
+        int i;
+
+        refused_url(down, sizeof(down));
+        snprintf(urls, sizeof(urls), "%s,http://127.0.0.1:%d/",
+                 down, srv_port);
+        url_list_parse(&ul, urls);
+        pool = pool_new(0);
+        SRV_RESPOND(200);
+
+        for (i = 0 ; i < URL_MAX_FAILS + 2 ; i++) {
+                rr = rest_get(pool, &ul, "/test");
+                TEST_ASSERT(rr->code == 200, "request %d: code %ld: %s",
+                            i, rr->code, rr->errstr ? rr->errstr : "");
+                rest_response_destroy(rr);
+        }
+
+        TEST_ASSERT(srv_req_cnt == URL_MAX_FAILS + 2, "%d requests",
+                    srv_req_cnt);
+        TEST_ASSERT(ul.health[0].fails == URL_MAX_FAILS,
+                    "URL tried %d times", ul.health[0].fails);
+        TEST_ASSERT(ul.health[0].down_until > 0, "URL in rotation");
+        TEST_ASSERT(ul.health[1].fails == 0 && ul.health[1].ewma_us > 0,
+                    "URL health");
+
+        /* All URLs failing */
+        url_list_clear(&ul);
+        url_list_parse(&ul, down);
+        rr = rest_get(pool, &ul, "/test");
+        TEST_ASSERT(rr->code == -1 && rr->errstr, "code %ld", rr->code);
+        rest_response_destroy(rr);
+
+        rest_pool_destroy(pool);
+        url_list_clear(&ul);
+
+        TEST_PASSED();
+}
+
+
+struct async_result {
+        mtx_t lock;
+        cnd_t cnd;
+        long  code;   /* Response code, 0 until done */
+};
+
+static void async_done_cb (rest_response_t *rr, void *opaque) {
+        struct async_result *res = opaque;
+
+        mtx_lock(&res->lock);
+        res->code = rr->code;
+        cnd_signal(&res->cnd);
+        mtx_unlock(&res->lock);
+
+        rest_response_destroy(rr);
+}
+
+static long async_get (rest_pool_t *pool, url_list_t *ul) {
+        struct async_result res = { .code = 0 };
+        long code;
+
+        mtx_init(&res.lock, mtx_plain);
+        cnd_init(&res.cnd);
+
+        TEST_ASSERT(rest_get_async(pool, ul, async_done_cb, &res,
+                                   "/test") == 0, "rest_get_async");
+
+        mtx_lock(&res.lock);
+        while (!res.code)
+                cnd_wait(&res.cnd, &res.lock);
+        code = res.code;
+        mtx_unlock(&res.lock);
+
+        mtx_destroy(&res.lock);
+        cnd_destroy(&res.cnd);
+
+        return code;
+}
+
+static void test_retry_async (void) {
+        rest_pool_t *pool;
+        url_list_t ul;
+        char urls[128], down[64];
+        long code;
+
+        refused_url(down, sizeof(down));
+        snprintf(urls, sizeof(urls), "%s,http://127.0.0.1:%d",
+                 down, srv_port);
+        url_list_parse(&ul, urls);
+        pool = pool_new(2);
+
+        SRV_RESPOND(502, 503, 200);
+        code = async_get(pool, &ul);
+        TEST_ASSERT(code == 200, "code %ld", code);
+        TEST_ASSERT(srv_req_cnt == 3, "%d requests", srv_req_cnt);
+
+        SRV_RESPOND(404);
+        code = async_get(pool, &ul);
+        TEST_ASSERT(code == 404, "code %ld", code);
+        TEST_ASSERT(srv_req_cnt == 1, "%d requests", srv_req_cnt);
+
+        /* The failure of the last URL tried is returned. */
+        SRV_RESPOND(500);
+        code = async_get(pool, &ul);
+        TEST_ASSERT(code == 500 || code == -1, "code %ld", code);
+        TEST_ASSERT(srv_req_cnt == 3, "%d requests", srv_req_cnt);
+
+        rest_pool_destroy(pool);
+        url_list_clear(&ul);
+
+        TEST_PASSED();
+}
+
+
+int main (int argc, char **argv) {
+        rest_init();
+        unittest_url_encode();
+
+        test_backoff();
+        test_url_select();
+
+        srv_start();
+        test_retry();
+        test_failover();
+        test_retry_async();
+        srv_stop();
+
+        return 0;
+}
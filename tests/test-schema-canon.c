@@ -0,0 +1,172 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Schema canonical form unit tests
+ */
+
+#include <string.h>
+
+#include "serdes_int.h"
+
+#include "test.h"
+
+
+static void test_canonical (void) {
+        /* Tuples of input definitions and expected canonical form */
+        const char *test[] = {
+                /* [PRIMITIVES] */
+                "\"int\"", "\"int\"",
+                "{\"type\": \"int\"}", "\"int\"",
+                "{\"type\": \"int\", \"doc\": \"An int\"}", "\"int\"",
+
+                /* [ORDER], [WHITESPACE], [STRIP] */
+                "{ \"fields\": [ { \"type\": \"int\", \"doc\": \"f\",\n"
+                "                  \"name\": \"a\" } ],\n"
+                "  \"doc\": \"A record\", \"type\": \"record\",\n"
+                "  \"name\": \"R\" }",
+                "{\"name\":\"R\",\"type\":\"record\","
+                "\"fields\":[{\"name\":\"a\",\"type\":\"int\"}]}",
+
+                "{\"symbols\": [\"A\", \"B\"], \"name\": \"E\", "
+                "\"type\": \"enum\"}",
+                "{\"name\":\"E\",\"type\":\"enum\",\"symbols\":[\"A\",\"B\"]}",
+
+                "{\"size\": 16, \"type\": \"fixed\", \"name\": \"md5\"}",
+                "{\"name\":\"md5\",\"type\":\"fixed\",\"size\":16}",
+
+                /* Unions, arrays and maps */
+                "[\"null\", {\"type\": \"array\", "
+                "\"items\": {\"type\": \"string\"}}]",
+                "[\"null\",{\"type\":\"array\",\"items\":\"string\"}]",
+
+                "{\"values\": \"long\", \"type\": \"map\"}",
+                "{\"type\":\"map\",\"values\":\"long\"}",
+
+                /* [FULLNAMES]: the namespace is inherited by nested
+                 * named types and references. */
+                "{\"type\": \"record\", \"name\": \"R\", "
+                "\"namespace\": \"ns\", \"fields\": ["
+                "{\"name\": \"f\", \"type\": {\"type\": \"fixed\", "
+                "\"name\": \"F\", \"size\": 4}},"
+                "{\"name\": \"g\", \"type\": \"F\"},"
+                "{\"name\": \"h\", \"type\": {\"type\": \"enum\", "
+                "\"name\": \"E\", \"namespace\": \"other\", "
+                "\"symbols\": [\"X\"]}},"
+                "{\"name\": \"i\", \"type\": \"other.E\"}]}",
+                "{\"name\":\"ns.R\",\"type\":\"record\",\"fields\":["
+                "{\"name\":\"f\",\"type\":"
+                "{\"name\":\"ns.F\",\"type\":\"fixed\",\"size\":4}},"
+                "{\"name\":\"g\",\"type\":\"ns.F\"},"
+                "{\"name\":\"h\",\"type\":"
+                "{\"name\":\"other.E\",\"type\":\"enum\","
+                "\"symbols\":[\"X\"]}},"
+                "{\"name\":\"i\",\"type\":\"other.E\"}]}",
+
+                /* A dotted name is a fullname and provides the
+                 * namespace of its fields. */
+                "{\"type\": \"record\", \"name\": \"a.b.R\", "
+                "\"namespace\": \"ignored\", \"fields\": ["
+                "{\"name\": \"s\", \"type\": \"R\"}]}",
+                "{\"name\":\"a.b.R\",\"type\":\"record\",\"fields\":["
+                "{\"name\":\"s\",\"type\":\"a.b.R\"}]}",
+
+                /* Other attributes are retained, sorted by name,
+                 * with object values' keys sorted. */
+                "{\"type\": \"record\", \"name\": \"R\", \"fields\": ["
+                "{\"order\": \"descending\", \"default\": {\"b\": 1, "
+                "\"a\": [2]}, \"type\": {\"type\": \"map\", "
+                "\"values\": \"int\"}, \"name\": \"m\", "
+                "\"aliases\": [\"n\"]}]}",
+                "{\"name\":\"R\",\"type\":\"record\",\"fields\":["
+                "{\"name\":\"m\",\"type\":{\"type\":\"map\","
+                "\"values\":\"int\"},\"aliases\":[\"n\"],"
+                "\"default\":{\"a\":[2],\"b\":1},"
+                "\"order\":\"descending\"}]}",
+
+                "{\"logicalType\": \"timestamp-millis\", \"type\": \"long\"}",
+                "{\"type\":\"long\",\"logicalType\":\"timestamp-millis\"}",
+
+                /* [STRINGS] */
+                "{\"type\": \"enum\", \"name\": \"E\", "
+                "\"symbols\": [\"\\u0041\\t\\\"\"]}",
+                "{\"name\":\"E\",\"type\":\"enum\","
+                "\"symbols\":[\"A\\t\\\"\"]}",
+
+                NULL, NULL
+        };
+        int i;
+
+        for (i = 0 ; test[i] ; i += 2) {
+                const char *input = test[i];
+                const char *exp = test[i+1];
+                size_t len;
+                char *canon;
+
+                canon = serdes_schema_canonical(input, strlen(input), &len);
+                TEST_ASSERT(canon, "no canonical form for %s", input);
+                TEST_ASSERT(len == strlen(canon), "length %zu for %s",
+                            len, canon);
+                TEST_ASSERT(!strcmp(canon, exp),
+                            "expected %s for %s, not %s", exp, input, canon);
+
+                /* The canonical form is its own canonical form. */
+                free(canon);
+                canon = serdes_schema_canonical(exp, strlen(exp), &len);
+                TEST_ASSERT(canon && !strcmp(canon, exp),
+                            "expected %s for itself, not %s",
+                            exp, canon ? canon : "(null)");
+                free(canon);
+        }
+
+        TEST_PASSED();
+}
+
+
+static void test_invalid (void) {
+        const char *test[] = {
+                "",
+                "not json",
+                "42",
+                "{\"name\": \"R\"}",                      /* No type */
+                "{\"type\": \"record\", \"fields\": []}", /* No name */
+                "{\"type\": \"record\", \"name\": \"R\", "
+                "\"fields\": {}}",                        /* Bad fields */
+                "{\"type\": \"record\", \"name\": \"R\", "
+                "\"fields\": [\"int\"]}",                 /* Bad field */
+                "[\"null\", 1]",                          /* Bad union */
+                NULL
+        };
+        int i;
+
+        for (i = 0 ; test[i] ; i++) {
+                size_t len;
+                char *canon = serdes_schema_canonical(test[i],
+                                                      strlen(test[i]), &len);
+
+                TEST_ASSERT(!canon, "canonical form %s for invalid %s",
+                            canon, test[i]);
+        }
+
+        TEST_PASSED();
+}
+
+
+int main (int argc, char **argv) {
+        test_canonical();
+        test_invalid();
+        return 0;
+}
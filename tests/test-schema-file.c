@@ -0,0 +1,260 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Persistent schema cache file unit tests
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "schema-file.h"
+
+#include "test.h"
+
+
+static char path[256];
+
+#define DEF_LEN  1000  /* Definition length of test records */
+
+/* Offset of the `i`th (0..) test record with subject name "s" */
+#define REC_LEN     ((sizeof(struct schema_file_rec) + 1 + DEF_LEN + 7) & ~7)
+#define REC_OFF(i)  (sizeof(struct schema_file_hdr) + (i) * REC_LEN)
+
+
+/**
+ * Returns test definition for schema `id` (static buffer).
+ */
+static const char *test_def (int id) {
+        static char def[DEF_LEN + 1];
+
+        memset(def, 'a' + (id % 26), DEF_LEN);
+        def[DEF_LEN] = '\0';
+        return def;
+}
+
+static void put (schema_file_t *sf, int id) {
+        schema_file_put(sf, id, "s", test_def(id), DEF_LEN, (uint64_t)id);
+}
+
+/**
+ * Returns 1 if schema `id` is found with the expected contents, else 0.
+ */
+static int get (schema_file_t *sf, int id) {
+        char *name, *def;
+        int len;
+
+        if (!schema_file_get(sf, id, &name, &def, &len))
+                return 0;
+
+        TEST_ASSERT(name && !strcmp(name, "s"), "id %d: name %s",
+                    id, name ? name : "(null)");
+        TEST_ASSERT(len == DEF_LEN && !strcmp(def, test_def(id)),
+                    "id %d: definition of %d bytes", id, len);
+        free(name);
+        free(def);
+
+        return 1;
+}
+
+static size_t file_size (void) {
+        struct stat st;
+
+        TEST_ASSERT(stat(path, &st) == 0, "stat %s", path);
+        return (size_t)st.st_size;
+}
+
+static void file_write (const void *buf, size_t len, size_t off) {
+        int fd = open(path, O_WRONLY);
+
+        TEST_ASSERT(fd != -1, "open %s", path);
+        TEST_ASSERT(pwrite(fd, buf, len, off) == (ssize_t)len, "pwrite");
+        close(fd);
+}
+
+static schema_file_t *file_open (void) {
+        char errstr[256];
+        schema_file_t *sf = schema_file_open(path, errstr, sizeof(errstr));
+
+        TEST_ASSERT(sf, "%s", errstr);
+        return sf;
+}
+
+
+static void test_put_get (void) {
+        schema_file_t *sf, *sf2;
+        char *name, *def;
+        int len;
+        int i;
+
+        unlink(path);
+        sf = file_open();
+
+        for (i = 1 ; i <= 3 ; i++)
+                put(sf, i);
+        TEST_ASSERT(file_size() == REC_OFF(3), "file size %zu",
+                    file_size());
+
+        for (i = 1 ; i <= 3 ; i++)
+                TEST_ASSERT(get(sf, i), "id %d", i);
+        TEST_ASSERT(!get(sf, 4), "id 4 not added");
+
+        /* Already cached: not appended again. */
+        put(sf, 2);
+        TEST_ASSERT(file_size() == REC_OFF(3), "file size %zu",
+                    file_size());
+
+        /* Unknown subject name */
+        schema_file_put(sf, 4, NULL, "\"int\"", 5, 4);
+        TEST_ASSERT(schema_file_get(sf, 4, &name, &def, &len), "id 4");
+        TEST_ASSERT(!name && len == 5 && !strcmp(def, "\"int\""),
+                    "id 4: name %s, definition %s", name, def);
+        free(def);
+
+        /* Records appended by another handle (process) are picked up. */
+        sf2 = file_open();
+        for (i = 1 ; i <= 3 ; i++)
+                TEST_ASSERT(get(sf2, i), "id %d", i);
+        put(sf2, 5);
+        TEST_ASSERT(get(sf, 5), "id 5 appended by other handle");
+        schema_file_close(sf2);
+
+        schema_file_close(sf);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * A record torn by a crash in the middle of an append is ignored,
+ * and dropped by the next append.
+ */
+static void test_torn (void) {
+        schema_file_t *sf;
+        int i;
+
+        unlink(path);
+        sf = file_open();
+        for (i = 1 ; i <= 3 ; i++)
+                put(sf, i);
+        schema_file_close(sf);
+
+        TEST_ASSERT(truncate(path, REC_OFF(2) + REC_LEN / 2) == 0,
+                    "truncate");
+
+        sf = file_open();
+        TEST_ASSERT(get(sf, 1) && get(sf, 2), "complete records");
+        TEST_ASSERT(!get(sf, 3), "torn record");
+
+        put(sf, 4);
+        TEST_ASSERT(file_size() == REC_OFF(3), "torn record not dropped: "
+                    "file size %zu", file_size());
+        TEST_ASSERT(get(sf, 4), "id 4");
+        schema_file_close(sf);
+
+        sf = file_open();
+        TEST_ASSERT(get(sf, 1) && get(sf, 2) && get(sf, 4), "reopened");
+        TEST_ASSERT(!get(sf, 3), "torn record");
+        schema_file_close(sf);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * Corrupt records are not returned, and the file is truncated
+ * by another process while open.
+ */
+static void test_corrupt (void) {
+        schema_file_t *sf;
+        uint32_t bad_magic = 0;
+        int i;
+
+        unlink(path);
+        sf = file_open();
+        for (i = 1 ; i <= 5 ; i++)
+                put(sf, i);
+
+        /* Bad checksum: only that record is lost, and it may be
+         * added again. */
+        file_write("X", 1, REC_OFF(1) + sizeof(struct schema_file_rec) + 10);
+        TEST_ASSERT(!get(sf, 2), "corrupt definition");
+        TEST_ASSERT(get(sf, 1) && get(sf, 3), "other records");
+
+        /* Record header no longer matching the indexed one */
+        file_write(&bad_magic, sizeof(bad_magic), REC_OFF(2));
+        TEST_ASSERT(!get(sf, 3), "corrupt header");
+
+        /* Truncated by another process: the lost records are not
+         * found, and reading them doesn't crash. */
+        TEST_ASSERT(truncate(path, REC_OFF(4) - 1) == 0, "truncate");
+        TEST_ASSERT(!get(sf, 4) && !get(sf, 5), "truncated records");
+        TEST_ASSERT(get(sf, 1), "id 1");
+        schema_file_close(sf);
+
+        /* Scanning stops at the first corrupt header: the
+         * following records are not indexed. */
+        sf = file_open();
+        TEST_ASSERT(get(sf, 1), "id 1");
+        TEST_ASSERT(!get(sf, 2) && !get(sf, 3) && !get(sf, 4),
+                    "corrupt records");
+
+        put(sf, 2);
+        TEST_ASSERT(get(sf, 2), "id 2 added again");
+        TEST_ASSERT(file_size() == REC_OFF(3), "file size %zu",
+                    file_size());
+        schema_file_close(sf);
+
+        TEST_PASSED();
+}
+
+
+static void test_not_cache_file (void) {
+        char errstr[256];
+        int fd;
+
+        unlink(path);
+        fd = open(path, O_WRONLY|O_CREAT, 0644);
+        TEST_ASSERT(fd != -1, "open %s", path);
+        TEST_ASSERT(write(fd, "garbage!", 8) == 8, "write");
+        close(fd);
+
+        errstr[0] = '\0';
+        TEST_ASSERT(!schema_file_open(path, errstr, sizeof(errstr)),
+                    "opened");
+        TEST_ASSERT(strstr(errstr, "not a schema cache file"),
+                    "errstr %s", errstr);
+
+        TEST_PASSED();
+}
+
+
+int main (int argc, char **argv) {
+        const char *tmpdir = getenv("TMPDIR");
+
+        snprintf(path, sizeof(path), "%s/libserdes-test-%d.cache",
+                 tmpdir ? tmpdir : "/tmp", (int)getpid());
+
+        test_put_get();
+        test_torn();
+        test_corrupt();
+        test_not_cache_file();
+
+        unlink(path);
+        return 0;
+}
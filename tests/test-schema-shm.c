@@ -0,0 +1,280 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Shared-memory schema cache unit tests
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "schema-shm.h"
+
+#include "test.h"
+
+
+static char name[64];
+
+#define SHM_SIZE  16384  /* 32 slots per index: at most 16 records */
+
+
+static schema_shm_t *shm_open_test (size_t size) {
+        char errstr[256];
+        schema_shm_t *shm = schema_shm_open(name, size,
+                                            errstr, sizeof(errstr));
+
+        TEST_ASSERT(shm, "%s", errstr);
+        return shm;
+}
+
+/**
+ * Map the segment (to tamper with it), munmap() when done.
+ */
+static struct schema_shm_hdr *shm_map (void) {
+        int fd = shm_open(name, O_RDWR, 0);
+        void *map;
+
+        TEST_ASSERT(fd != -1, "shm_open %s", name);
+        map = mmap(NULL, SHM_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        TEST_ASSERT(map != MAP_FAILED, "mmap %s", name);
+        close(fd);
+
+        return map;
+}
+
+static struct schema_file_rec *shm_rec (struct schema_shm_hdr *hdr,
+                                        int i) {
+        uint64_t off = hdr->data_off;
+
+        while (i-- > 0)
+                off += ((struct schema_file_rec *)((char *)hdr + off))->len;
+
+        return (struct schema_file_rec *)((char *)hdr + off);
+}
+
+static void put (schema_shm_t *shm, int id, int definition_len) {
+        char *def = malloc(definition_len);
+
+        memset(def, 'a' + (id % 26), definition_len);
+        schema_shm_put(shm, id, "s", def, definition_len, (uint64_t)id);
+        free(def);
+}
+
+/**
+ * Returns 1 if schema `id` is found with the expected contents, else 0.
+ */
+static int get (schema_shm_t *shm, int id, int definition_len) {
+        char *nm, *def;
+        int len, i;
+
+        if (!schema_shm_get(shm, id, &nm, &def, &len))
+                return 0;
+
+        TEST_ASSERT(nm && !strcmp(nm, "s"), "id %d: name %s",
+                    id, nm ? nm : "(null)");
+        TEST_ASSERT(len == definition_len, "id %d: definition of %d bytes",
+                    id, len);
+        for (i = 0 ; i < len ; i++)
+                TEST_ASSERT(def[i] == 'a' + (id % 26),
+                            "id %d: definition byte %d", id, i);
+        free(nm);
+        free(def);
+
+        return 1;
+}
+
+
+static void test_put_get (void) {
+        schema_shm_t *shm, *shm2;
+
+        shm_unlink(name);
+        shm = shm_open_test(SHM_SIZE);
+
+        schema_shm_put(shm, 1, "s1", "\"int\"", 5, 100);
+        schema_shm_put(shm, 2, "s2", "\"int\"", 5, 100);
+        put(shm, 3, 100);
+
+        TEST_ASSERT(get(shm, 3, 100), "id 3");
+        TEST_ASSERT(!get(shm, 4, 100), "id 4 not added");
+
+        /* Same definition under two subjects */
+        TEST_ASSERT(schema_shm_find(shm, "s1", "\"int\"", 5, 100) == 1,
+                    "s1");
+        TEST_ASSERT(schema_shm_find(shm, "s2", "\"int\"", 5, 100) == 2,
+                    "s2");
+        TEST_ASSERT(schema_shm_find(shm, "s3", "\"int\"", 5, 100) == -1,
+                    "s3");
+        TEST_ASSERT(schema_shm_find(shm, "s1", "\"long\"", 6, 100) == -1,
+                    "fingerprint collision");
+
+        /* Another handle (process) sees the records, and the
+         * existing segment's size is used. */
+        shm2 = shm_open_test(SHM_SIZE * 4);
+        TEST_ASSERT(get(shm2, 3, 100), "id 3");
+        put(shm2, 4, 100);
+        TEST_ASSERT(get(shm, 4, 100), "id 4 added by other handle");
+        schema_shm_close(shm2);
+
+        schema_shm_close(shm);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * New records are not added once the segment's data area or
+ * indexes are full.
+ */
+static void test_full (void) {
+        schema_shm_t *shm;
+        int i, cnt;
+
+        /* Data full */
+        shm_unlink(name);
+        shm = shm_open_test(SHM_SIZE);
+
+        for (i = 1 ; i <= 20 ; i++)
+                put(shm, i, 1000);
+
+        for (cnt = 0, i = 1 ; i <= 20 ; i++)
+                cnt += get(shm, i, 1000);
+        TEST_ASSERT(cnt > 10 && cnt < 16, "%d records of 1000 bytes "
+                    "in a %d bytes segment", cnt, SHM_SIZE);
+        for (i = 1 ; i <= cnt ; i++)
+                TEST_ASSERT(get(shm, i, 1000), "id %d", i);
+
+        /* Smaller records may still fit. */
+        put(shm, 100, 10);
+        TEST_ASSERT(get(shm, 100, 10), "id 100");
+        schema_shm_close(shm);
+
+        /* Index full */
+        shm_unlink(name);
+        shm = shm_open_test(SHM_SIZE);
+
+        for (i = 1 ; i <= 20 ; i++)
+                put(shm, i, 10);
+        for (i = 1 ; i <= 16 ; i++)
+                TEST_ASSERT(get(shm, i, 10), "id %d", i);
+        for (i = 17 ; i <= 20 ; i++)
+                TEST_ASSERT(!get(shm, i, 10), "id %d beyond index load", i);
+        schema_shm_close(shm);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * A record larger than the segment is not added (nor written
+ * past the segment's end).
+ */
+static void test_rec_too_large (void) {
+        schema_shm_t *shm;
+
+        shm_unlink(name);
+        shm = shm_open_test(SHM_SIZE);
+
+        put(shm, 1, SHM_SIZE + 100);
+        TEST_ASSERT(!get(shm, 1, SHM_SIZE + 100), "record added");
+
+        /* Would fit in the empty segment, but not after another
+         * record. */
+        put(shm, 2, 100);
+        put(shm, 3, SHM_SIZE - 600);
+        TEST_ASSERT(!get(shm, 3, SHM_SIZE - 600), "record added");
+
+        put(shm, 4, 100);
+        TEST_ASSERT(get(shm, 2, 100) && get(shm, 4, 100), "small records");
+
+        schema_shm_close(shm);
+
+        TEST_PASSED();
+}
+
+
+/**
+ * Corrupt records and headers are ignored.
+ */
+static void test_corrupt (void) {
+        schema_shm_t *shm;
+        struct schema_shm_hdr *hdr;
+        struct schema_file_rec *rec;
+        char errstr[256];
+        int i;
+
+        shm_unlink(name);
+        shm = shm_open_test(SHM_SIZE);
+        for (i = 1 ; i <= 4 ; i++)
+                put(shm, i, 100);
+
+        hdr = shm_map();
+
+        /* Corrupt definition: checksum mismatch */
+        rec = shm_rec(hdr, 0);
+        ((char *)(rec + 1))[10] = 'X';
+        TEST_ASSERT(!get(shm, 1, 100), "corrupt definition");
+
+        /* Corrupt record header */
+        rec = shm_rec(hdr, 1);
+        rec->magic = 0;
+        TEST_ASSERT(!get(shm, 2, 100), "corrupt magic");
+
+        /* Record length past the segment's end */
+        rec = shm_rec(hdr, 2);
+        rec->name_len = SHM_SIZE;
+        rec->len = (sizeof(*rec) + SHM_SIZE + 100 + 7) & ~7;
+        TEST_ASSERT(!get(shm, 3, 100), "record past segment end");
+        TEST_ASSERT(schema_shm_find(shm, "s", "x", 1, 3) == -1,
+                    "record past segment end");
+
+        TEST_ASSERT(get(shm, 4, 100), "intact record");
+
+        /* Corrupt data end: nothing is written past the segment. */
+        hdr->data_end = SHM_SIZE + 8;
+        put(shm, 5, 100);
+        TEST_ASSERT(!get(shm, 5, 100), "record added past segment end");
+        hdr->data_end = (uint64_t)-8;
+        put(shm, 6, 100);
+        TEST_ASSERT(!get(shm, 6, 100), "record added past segment end");
+
+        schema_shm_close(shm);
+
+        /* Such a segment is refused when opened. */
+        errstr[0] = '\0';
+        TEST_ASSERT(!schema_shm_open(name, SHM_SIZE, errstr, sizeof(errstr)),
+                    "opened");
+        TEST_ASSERT(strstr(errstr, "not a shared memory schema cache"),
+                    "errstr %s", errstr);
+
+        munmap(hdr, SHM_SIZE);
+
+        TEST_PASSED();
+}
+
+
+int main (int argc, char **argv) {
+        snprintf(name, sizeof(name), "/libserdes-test-%d", (int)getpid());
+
+        test_put_get();
+        test_full();
+        test_rec_too_large();
+        test_corrupt();
+
+        shm_unlink(name);
+        return 0;
+}
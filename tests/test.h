@@ -0,0 +1,44 @@
+/**
+ * Copyright 2015 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/**
+ * Unit test helpers.
+ *
+ * Each test program runs its test functions in sequence and exits
+ * with a non-zero status on the first failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/**
+ * Fail the test if `cond` is false, with a printf-style reason.
+ */
+#define TEST_ASSERT(cond,fmt...) do {                                   \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: %s: FAILED: %s: ",      \
+                                __FILE__, __LINE__, __FUNCTION__,       \
+                                #cond);                                 \
+                        fprintf(stderr, fmt);                           \
+                        fprintf(stderr, "\n");                          \
+                        exit(1);                                        \
+                }                                                       \
+        } while (0)
+
+#define TEST_PASSED() fprintf(stderr, "%s PASSED\n", __FUNCTION__)